@@ -6,13 +6,19 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "bitmap.h"
+#include "stats.h"
 
 #define nth_bit_mask(n) (1 << (n))
 #define byte_index(n) ((n) / 8)
 #define bit_index(n) ((n) % 8)
 
+#define WORD_BITS 64
+#define word_index(n) ((n) / WORD_BITS)
+#define word_count(bits) (((bits) + WORD_BITS - 1) / WORD_BITS)
+
 // Get the given bit from the bitmap.
 int bitmap_get(void *bm, int i) {
   uint8_t *base = (uint8_t *) bm;
@@ -34,6 +40,214 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Mask selecting bits [lo, hi) of a word, where 0 <= lo < hi <= 64.
+static uint64_t range_mask(int lo, int hi) {
+  uint64_t upper = hi == WORD_BITS ? ~0ULL : (1ULL << hi) - 1;
+  return upper & ~((1ULL << lo) - 1);
+}
+
+/**
+ * Returns the index of the first bit in [from, to) whose value is `v`,
+ * or -1 if there is none. Works a word at a time; when a summary is given,
+ * words it marks as full are skipped while looking for clear bits.
+ */
+static int scan(const uint64_t *words, const bitmap_summary_t *sum, int from,
+                int to, int v) {
+  while (from < to) {
+    int wi = word_index(from);
+    int hi = to - wi * WORD_BITS < WORD_BITS ? to - wi * WORD_BITS : WORD_BITS;
+    uint64_t w = v ? words[wi] : ~words[wi];
+    w &= range_mask(from % WORD_BITS, hi);
+    if (w != 0) {
+      return wi * WORD_BITS + __builtin_ctzll(w);
+    }
+
+    from = (wi + 1) * WORD_BITS;
+    if (sum != NULL && !v && from < to) {
+      int next = scan(sum->full, NULL, wi + 1, word_index(to - 1) + 1, 0);
+      if (next == -1) {
+        return -1;
+      }
+      from = next * WORD_BITS;
+    }
+  }
+
+  return -1;
+}
+
+// Find the first clear bit in [start, size), then in [0, start).
+static int find_zero(const uint64_t *words, const bitmap_summary_t *sum,
+                     int size, int start) {
+  if (start < 0 || start >= size) {
+    start = 0;
+  }
+
+  int ii = scan(words, sum, start, size, 0);
+  if (ii == -1) {
+    ii = scan(words, sum, 0, start, 0);
+  }
+  return ii;
+}
+
+// Find the first run of `n` clear bits that lies within [from, to).
+static int find_run_in(const uint64_t *words, const bitmap_summary_t *sum,
+                       int from, int to, int n) {
+  while (to - from >= n) {
+    int zero = scan(words, sum, from, to - n + 1, 0);
+    if (zero == -1) {
+      return -1;
+    }
+
+    int one = scan(words, NULL, zero, zero + n, 1);
+    if (one == -1) {
+      return zero;
+    }
+    from = one + 1;
+  }
+
+  return -1;
+}
+
+// Find the first run of `n` clear bits starting in [start, size), then in
+// [0, start).
+static int find_run(const uint64_t *words, const bitmap_summary_t *sum,
+                    int size, int start, int n) {
+  if (start < 0 || start >= size) {
+    start = 0;
+  }
+
+  int ii = find_run_in(words, sum, start, size, n);
+  if (ii == -1) {
+    int to = start + n - 1 < size ? start + n - 1 : size;
+    ii = find_run_in(words, sum, 0, to, n);
+  }
+  return ii;
+}
+
+// Set the bits [start, start + n) to the given value, a word at a time.
+void bitmap_put_range(void *bm, int start, int n, int v) {
+  uint64_t *words = (uint64_t *)bm;
+  int end = start + n;
+
+  while (start < end) {
+    int wi = word_index(start);
+    int hi =
+        end - wi * WORD_BITS < WORD_BITS ? end - wi * WORD_BITS : WORD_BITS;
+    uint64_t mask = range_mask(start % WORD_BITS, hi);
+
+    if (v) {
+      words[wi] |= mask;
+    } else {
+      words[wi] &= ~mask;
+    }
+    start = (wi + 1) * WORD_BITS;
+  }
+}
+
+// Count the set bits among the first `size` bits of the bitmap.
+int bitmap_count(void *bm, int size) {
+  uint64_t *words = (uint64_t *)bm;
+  int count = 0;
+
+  for (int wi = 0; wi < word_count(size); wi++) {
+    int bits = size - wi * WORD_BITS;
+    uint64_t mask = bits >= WORD_BITS ? ~0ULL : range_mask(0, bits);
+    count += __builtin_popcountll(words[wi] & mask);
+  }
+
+  return count;
+}
+
+int bitmap_find_zero(void *bm, int size, int start) {
+  return find_zero((uint64_t *)bm, NULL, size, start);
+}
+
+int bitmap_find_run(void *bm, int size, int start, int n) {
+  return find_run((uint64_t *)bm, NULL, size, start, n);
+}
+
+// Whether word `wi` of the summarized bitmap has no clear bits. Bits past the
+// end of the bitmap count as set.
+static int word_full(const bitmap_summary_t *sum, int wi) {
+  int bits = sum->size - wi * WORD_BITS;
+  uint64_t mask = bits >= WORD_BITS ? ~0ULL : range_mask(0, bits);
+  return (sum->bm[wi] & mask) == mask;
+}
+
+// Recompute the summary bits of words [first, last].
+static void summary_refresh(bitmap_summary_t *sum, int first, int last) {
+  for (int wi = first; wi <= last; wi++) {
+    bitmap_put(sum->full, wi, word_full(sum, wi));
+  }
+}
+
+void bitmap_summary_init(bitmap_summary_t *sum, void *bm, int size) {
+  int words = word_count(size);
+  sum->bm = (uint64_t *)bm;
+  sum->size = size;
+  sum->full = calloc(word_count(words), sizeof(uint64_t));
+  summary_refresh(sum, 0, words - 1);
+}
+
+void bitmap_summary_free(bitmap_summary_t *sum) {
+  free(sum->full);
+  sum->full = NULL;
+}
+
+void bitmap_summary_put(bitmap_summary_t *sum, int start, int n, int v) {
+  if (n <= 0) {
+    return;
+  }
+
+  bitmap_put_range(sum->bm, start, n, v);
+  summary_refresh(sum, word_index(start), word_index(start + n - 1));
+}
+
+int bitmap_summary_find_zero(bitmap_summary_t *sum, int start) {
+  uint64_t t0 = stats_now();
+  int found = find_zero(sum->bm, sum, sum->size, start);
+  stats_record(STATS_BITMAP_SCAN, t0, 0);
+  return found;
+}
+
+int bitmap_summary_find_run(bitmap_summary_t *sum, int start, int n) {
+  uint64_t t0 = stats_now();
+  int found = find_run(sum->bm, sum, sum->size, start, n);
+  stats_record(STATS_BITMAP_SCAN, t0, 0);
+  return found;
+}
+
+int bitmap_summary_run_length(bitmap_summary_t *sum, int start, int max) {
+  int end = max < sum->size - start ? start + max : sum->size;
+  int one = scan(sum->bm, NULL, start, end, 1);
+  return (one == -1 ? end : one) - start;
+}
+
+int bitmap_summary_find_longest(bitmap_summary_t *sum, int max, int *len) {
+  uint64_t t0 = stats_now();
+  int best = -1;
+  int best_len = 0;
+
+  for (int from = 0; from < sum->size && best_len < max;) {
+    int zero = scan(sum->bm, sum, from, sum->size, 0);
+    if (zero == -1) {
+      break;
+    }
+
+    int one = scan(sum->bm, NULL, zero, sum->size, 1);
+    int end = one == -1 ? sum->size : one;
+    if (end - zero > best_len) {
+      best = zero;
+      best_len = end - zero;
+    }
+    from = end + 1;
+  }
+
+  *len = best_len < max ? best_len : max;
+  stats_record(STATS_BITMAP_SCAN, t0, 0);
+  return best;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
 
@@ -3,10 +3,16 @@
  * @author CS3650 staff
  *
  * A bitmap interface.
+ *
+ * Bit `i` is bit `i % 8` of byte `i / 8`. On little-endian machines that is
+ * also bit `i % 64` of 64-bit word `i / 64`, which the searches below rely on
+ * to test 64 bits at a time. Bitmaps must be 8-byte aligned.
  */
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <stdint.h>
+
 /**
  * Get the given bit from the bitmap.
  *
@@ -27,11 +33,143 @@ int bitmap_get(void *bm, int i);
 void bitmap_put(void *bm, int i, int v);
 
 /**
- * Pretty-print a bitmap. 
+ * Set a range of bits in the bitmap to the given value.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start Index of the first bit to set.
+ * @param n Number of bits to set.
+ * @param v Value the bits should be set to (0 or 1).
+ */
+void bitmap_put_range(void *bm, int start, int n, int v);
+
+/**
+ * Count the set bits in the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits in the bitmap.
+ *
+ * @return The number of bits set to 1.
+ */
+int bitmap_count(void *bm, int size);
+
+/**
+ * Find the first clear bit at or after `start`, wrapping around to the
+ * beginning of the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits in the bitmap.
+ * @param start Index to start searching from.
+ *
+ * @return The index of the clear bit, or -1 if every bit is set.
+ */
+int bitmap_find_zero(void *bm, int size, int start);
+
+/**
+ * Find the first run of `n` clear bits starting at or after `start`,
+ * wrapping around to the beginning of the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits in the bitmap.
+ * @param start Index to start searching from.
+ * @param n Length of the run.
+ *
+ * @return The index of the first bit of the run, or -1 if there is none.
+ */
+int bitmap_find_run(void *bm, int size, int start, int n);
+
+/**
+ * Pretty-print a bitmap.
  *
  * @param bm Pointer to the bitmap.
  * @param size The number of bits to print.
  */
 void bitmap_print(void *bm, int size);
 
+/**
+ * A bitmap with a summary level on top: one summary bit per 64-bit word of
+ * the bitmap, set when that word is full. Searches skip 64 full words per
+ * summary word, so finding a clear bit in a huge, nearly full bitmap touches
+ * a few cache lines instead of the whole map.
+ *
+ * The summary lives in memory only and is rebuilt when the bitmap is loaded.
+ * All updates to the bitmap must go through the `bitmap_summary_*` functions
+ * to keep it accurate.
+ */
+typedef struct bitmap_summary {
+  uint64_t *bm;    // the bitmap itself
+  uint64_t *full;  // bit w is set when word w of `bm` is full
+  int size;        // number of bits in `bm`
+} bitmap_summary_t;
+
+/**
+ * Build the summary of the given bitmap.
+ *
+ * @param sum The summary to initialize.
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits in the bitmap.
+ */
+void bitmap_summary_init(bitmap_summary_t *sum, void *bm, int size);
+
+/**
+ * Release the memory held by the summary.
+ *
+ * @param sum The summary to release.
+ */
+void bitmap_summary_free(bitmap_summary_t *sum);
+
+/**
+ * Set a range of bits in the summarized bitmap to the given value.
+ *
+ * @param sum The summarized bitmap.
+ * @param start Index of the first bit to set.
+ * @param n Number of bits to set.
+ * @param v Value the bits should be set to (0 or 1).
+ */
+void bitmap_summary_put(bitmap_summary_t *sum, int start, int n, int v);
+
+/**
+ * Find the first clear bit at or after `start`, wrapping around.
+ *
+ * @param sum The summarized bitmap.
+ * @param start Index to start searching from.
+ *
+ * @return The index of the clear bit, or -1 if every bit is set.
+ */
+int bitmap_summary_find_zero(bitmap_summary_t *sum, int start);
+
+/**
+ * Find the first run of `n` clear bits starting at or after `start`,
+ * wrapping around.
+ *
+ * @param sum The summarized bitmap.
+ * @param start Index to start searching from.
+ * @param n Length of the run.
+ *
+ * @return The index of the first bit of the run, or -1 if there is none.
+ */
+int bitmap_summary_find_run(bitmap_summary_t *sum, int start, int n);
+
+/**
+ * Count the clear bits starting at `start`, up to the first set bit.
+ *
+ * @param sum The summarized bitmap.
+ * @param start Index of the first bit of the run.
+ * @param max Stop counting after this many bits.
+ *
+ * @return The length of the run of clear bits, at most `max`.
+ */
+int bitmap_summary_run_length(bitmap_summary_t *sum, int start, int max);
+
+/**
+ * Find the longest run of clear bits in the bitmap, stopping at the first
+ * run of at least `max` bits.
+ *
+ * @param sum The summarized bitmap.
+ * @param max Length at which a run is long enough.
+ * @param len Set to the length of the run found, at most `max`.
+ *
+ * @return The index of the first bit of the run, or -1 if every bit is set.
+ */
+int bitmap_summary_find_longest(bitmap_summary_t *sum, int max, int *len);
+
 #endif
@@ -10,8 +10,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -20,19 +22,65 @@
 
 #include "bitmap.h"
 #include "constants.h"
+#include "journal.h"
+#include "share.h"
+#include "stats.h"
+#include "trace.h"
 
-const int BLOCK_COUNT = 256;  // we split the "disk" into 256 blocks
 const int BLOCK_SIZE = 4096;  // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT;  // = 1MB
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+// Size of a new image when the image file is not big enough already.
+static const int64_t NUFS_DEFAULT_SIZE = 1 << 20;  // = 1MB
+
+// Smallest number of blocks a formatted image can have.
+static const int NUFS_MIN_BLOCKS = 64;
+
+// Inodes reserved per block of disk space when formatting.
+static const int BLOCKS_PER_INODE = 4;
+
+// The journal takes this fraction of the disk, within the bounds below.
+static const int BLOCKS_PER_JOURNAL_BLOCK = 32;
+static const int JOURNAL_MIN_BLOCKS = 16;
+static const int JOURNAL_MAX_BLOCKS = 4096;
+
+// Dedup index blocks reserved per block of disk space when formatting,
+// enough to index every block if the hashes spread evenly.
+static const int BLOCKS_PER_INDEX_BLOCK = 256;
+
+// Transparent huge pages map 2MB of the image at a time, aligned the same
+// in the file and in memory.
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
+static size_t blocks_size = 0;
+
+// Index of the free blocks bitmap, to find free blocks quickly.
+static bitmap_summary_t blocks_summary;
+
+// A run of blocks freed by a transaction that has not committed yet.
+typedef struct block_run {
+  int bnum;
+  int n;
+} block_run_t;
+
+static block_run_t *deferred_runs = NULL;
+static int deferred_count = 0;
+static int deferred_cap = 0;
+
+// Free blocks, and how many of them are reserved for delayed allocations.
+// The calling thread may take `spendable` of the reserved ones.
+static int free_count = 0;
+static int reserved_count = 0;
+static __thread int spendable = 0;
+
+// Guards `blocks_summary`, the block hint in the superblock, the deferred
+// runs and the counts above. Only the journal's own lock is taken while it
+// is held.
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
+int bytes_to_blocks(int64_t bytes) {
   int quo = bytes / BLOCK_SIZE;
   int rem = bytes % BLOCK_SIZE;
   if (rem == 0) {
@@ -42,83 +90,541 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Returns the number of blocks taken by a bitmap of `bits` bits.
+static int bitmap_blocks(int bits) { return bytes_to_blocks((bits + 7) / 8); }
+
+// Write a fresh superblock, empty bitmaps, inode table, reference table,
+// dedup index and journal to the image.
+static void blocks_format(int block_count) {
+  assert(block_count >= NUFS_MIN_BLOCKS);
+
+  // Round the inode table up to whole blocks.
+  int inodes_per_block = BLOCK_SIZE / sizeof(inode_t);
+  int inode_count = block_count / BLOCKS_PER_INODE;
+  if (inode_count < inodes_per_block) {
+    inode_count = inodes_per_block;
+  }
+  inode_count = bytes_to_blocks((int64_t)inode_count * sizeof(inode_t)) *
+                inodes_per_block;
+
+  superblock_t *sb = get_superblock();
+  memset(sb, 0, BLOCK_SIZE);
+  sb->magic = NUFS_MAGIC;
+  sb->version = NUFS_VERSION;
+  sb->block_size = BLOCK_SIZE;
+  sb->block_count = block_count;
+  sb->inode_count = inode_count;
+  sb->block_bitmap_bnum = 1;
+  sb->inode_bitmap_bnum = sb->block_bitmap_bnum + bitmap_blocks(block_count);
+  sb->inode_table_bnum = sb->inode_bitmap_bnum + bitmap_blocks(inode_count);
+  sb->refs_bnum = sb->inode_table_bnum +
+                  inode_count * sizeof(inode_t) / BLOCK_SIZE;
+  sb->index_bnum =
+      sb->refs_bnum + bytes_to_blocks((int64_t)block_count * sizeof(uint32_t));
+  sb->index_blocks = (block_count + BLOCKS_PER_INDEX_BLOCK - 1) /
+                     BLOCKS_PER_INDEX_BLOCK;
+  sb->journal_bnum = sb->index_bnum + sb->index_blocks;
+  sb->journal_blocks = block_count / BLOCKS_PER_JOURNAL_BLOCK;
+  if (sb->journal_blocks < JOURNAL_MIN_BLOCKS) {
+    sb->journal_blocks = JOURNAL_MIN_BLOCKS;
+  } else if (sb->journal_blocks > JOURNAL_MAX_BLOCKS) {
+    sb->journal_blocks = JOURNAL_MAX_BLOCKS;
+  }
+  sb->data_bnum = sb->journal_bnum + sb->journal_blocks;
+  assert(sb->data_bnum < block_count);
+
+  void *meta = blocks_get_block(1);
+  memset(meta, 0, (size_t)(sb->data_bnum - 1) * BLOCK_SIZE);
+
+  // The superblock, the bitmaps, the tables and the journal are always in
+  // use.
+  bitmap_put_range(get_blocks_bitmap(), 0, sb->data_bnum, 1);
+  sb->block_hint = sb->data_bnum;
+  sb->inode_hint = 0;
+
+  // Nothing is journaled yet, so write the layout out directly.
+  int rv = blocks_write(0, sb, sb->data_bnum);
+  assert(rv == 0 && blocks_flush() == 0);
+  blocks_drop(0, sb->data_bnum);
+}
+
 /**
- * | 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 | 9 | 10 |
- * | B | I | D | D | D | D | D | D | D | D | D  |
- *
- * create /hello.txt
- * root directory holds pointer to inode?
+ * Returns whether the environment variable `name` is set to anything but
+ * "0".
  */
+static int env_flag(const char *name) {
+  const char *env = getenv(name);
+  return env != NULL && *env != '\0' && strcmp(env, "0") != 0;
+}
+
+/**
+ * Maps the image privately, so that the journal decides when modified
+ * blocks are written back, and at an address aligned to a huge page if
+ * `huge`. Nothing is reserved for the private copies of the blocks, which
+ * only the modified blocks get.
+ * Returns the mapping or MAP_FAILED.
+ */
+static void *map_image(int huge) {
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_NORESERVE;
+  if (!huge) {
+    return mmap(0, blocks_size, prot, flags, blocks_fd, 0);
+  }
+
+  // Reserve enough address space to align the image within it.
+  size_t span = blocks_size + HUGE_PAGE_SIZE;
+  char *area = mmap(0, span, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (area == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  char *base = (char *)(((uintptr_t)area + HUGE_PAGE_SIZE - 1) &
+                        ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  if (base > area) {
+    munmap(area, base - area);
+  }
+  if (area + span > base + blocks_size) {
+    munmap(base + blocks_size, area + span - (base + blocks_size));
+  }
+  return mmap(base, blocks_size, prot, flags | MAP_FIXED, blocks_fd, 0);
+}
+
+/**
+ * Faults in the page table entries of the given blocks ahead of their
+ * first use.
+ */
+static void prefault(int bnum, int count) {
+  char *start = blocks_get_block(bnum);
+  size_t size = (size_t)count * BLOCK_SIZE;
+#ifdef MADV_POPULATE_READ
+  if (madvise(start, size, MADV_POPULATE_READ) == 0) {
+    return;
+  }
+#endif
+  // Older kernels: touch every page.
+  size_t page = sysconf(_SC_PAGESIZE);
+  for (size_t off = 0; off < size; off += page) {
+    (void)*(volatile char *)(start + off);
+  }
+}
+
+/**
+ * Applies the mapping options set in the environment to the image
+ * described by `sb`:
+ * - $NUFS_PREFAULT maps in the bitmaps, the inode table and the root
+ *   directory up front, so that the first operations do not fault on them
+ *   one page at a time;
+ * - $NUFS_HUGEPAGES asks for transparent huge pages on the data blocks.
+ *   The mapping is of a regular file, so the pages read from the image
+ *   stay small; only the anonymous copies that modified blocks get, on
+ *   kernels that back those with huge pages, can be huge.
+ */
+static void advise_image(const superblock_t *sb) {
+  if (env_flag("NUFS_PREFAULT")) {
+    prefault(0, sb->refs_bnum);
+    prefault(sb->data_bnum, 1);
+  }
+
+  if (env_flag("NUFS_HUGEPAGES")) {
+    size_t start = (size_t)sb->data_bnum * BLOCK_SIZE;
+    start = (start + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (start < blocks_size) {
+      madvise((char *)blocks_base + start, blocks_size - start, MADV_HUGEPAGE);
+    }
+  }
+}
+
+/**
+ * Checks that the superblock `sb`, read from an image of `size` bytes,
+ * describes an image this build can mount, printing why if it does not.
+ * Returns 0 if it does and -1 otherwise.
+ */
+static int check_superblock(const char *image_path, const superblock_t *sb,
+                            off_t size) {
+  if (sb->version != NUFS_VERSION) {
+    fprintf(stderr, "nufs: %s: format version %u, expected %u\n", image_path,
+            sb->version, NUFS_VERSION);
+    return -1;
+  }
+  if (sb->block_size != BLOCK_SIZE) {
+    fprintf(stderr, "nufs: %s: block size %u, expected %d\n", image_path,
+            sb->block_size, BLOCK_SIZE);
+    return -1;
+  }
+  if (size < (off_t)sb->block_count * BLOCK_SIZE) {
+    fprintf(stderr, "nufs: %s: image is shorter than its %u blocks\n",
+            image_path, sb->block_count);
+    return -1;
+  }
+  return 0;
+}
 
 // Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
+int blocks_init(const char *image_path) {
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  assert(blocks_fd != -1);
+  if (blocks_fd == -1) {
+    fprintf(stderr, "nufs: %s: %s\n", image_path, strerror(errno));
+    return -1;
+  }
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  struct stat st;
+  int rv = fstat(blocks_fd, &st);
   assert(rv == 0);
 
+  superblock_t sb;
+  memset(&sb, 0, sizeof(sb));
+  ssize_t got = pread(blocks_fd, &sb, sizeof(sb), 0);
+  assert(got >= 0);
+
+  int formatted = sb.magic == NUFS_MAGIC;
+  if (formatted) {
+    if (check_superblock(image_path, &sb, st.st_size) != 0) {
+      close(blocks_fd);
+      blocks_fd = -1;
+      return -1;
+    }
+    blocks_size = (size_t)sb.block_count * BLOCK_SIZE;
+
+    // Finish the last commit before anything is read from the image.
+    journal_init(&sb);
+  } else {
+    // Only ever format a blank image, never one holding something else.
+    superblock_t blank;
+    memset(&blank, 0, sizeof(blank));
+    if (memcmp(&sb, &blank, sizeof(sb)) != 0) {
+      fprintf(stderr, "nufs: %s: not a nufs image\n", image_path);
+      close(blocks_fd);
+      blocks_fd = -1;
+      return -1;
+    }
+
+    int64_t size = st.st_size > NUFS_DEFAULT_SIZE ? st.st_size
+                                                  : NUFS_DEFAULT_SIZE;
+    blocks_size = (size_t)(size / BLOCK_SIZE) * BLOCK_SIZE;
+    rv = ftruncate(blocks_fd, blocks_size);
+    assert(rv == 0);
+  }
+
   // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  blocks_base = map_image(env_flag("NUFS_HUGEPAGES"));
   assert(blocks_base != MAP_FAILED);
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  if (!formatted) {
+    blocks_format(blocks_size / BLOCK_SIZE);
+    journal_init(get_superblock());
+  }
+  advise_image(get_superblock());
+
+  bitmap_summary_init(&blocks_summary, get_blocks_bitmap(), BLOCK_COUNT);
+  free_count = BLOCK_COUNT - bitmap_count(get_blocks_bitmap(), BLOCK_COUNT);
+  reserved_count = 0;
+  return 0;
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  journal_stop();
+  bitmap_summary_free(&blocks_summary);
+  int rv = munmap(blocks_base, blocks_size);
   assert(rv == 0);
+  close(blocks_fd);
+  blocks_fd = -1;
+}
+
+// Commit the modified blocks to the disk image.
+int blocks_sync() { return journal_commit(); }
+
+// Read blocks straight from the disk image.
+int blocks_read(int bnum, void *buf, int count) {
+  size_t size = (size_t)count * BLOCK_SIZE;
+  off_t offset = (off_t)bnum * BLOCK_SIZE;
+  for (size_t done = 0; done < size;) {
+    ssize_t got = pread(blocks_fd, (char *)buf + done, size - done,
+                        offset + done);
+    if (got <= 0) {
+      return -1;
+    }
+    done += got;
+  }
+  return 0;
+}
+
+// Write blocks to the disk image.
+int blocks_write(int bnum, const void *buf, int count) {
+  size_t size = (size_t)count * BLOCK_SIZE;
+  off_t offset = (off_t)bnum * BLOCK_SIZE;
+  for (size_t done = 0; done < size;) {
+    ssize_t put = pwrite(blocks_fd, (const char *)buf + done, size - done,
+                         offset + done);
+    if (put <= 0) {
+      return -1;
+    }
+    done += put;
+  }
+  return 0;
+}
+
+// Wait until the written blocks are on disk.
+int blocks_flush() { return fdatasync(blocks_fd); }
+
+// Returns whether the `count` blocks starting at `bnum` hold in memory
+// what they hold in the image.
+static int blocks_clean(int bnum, int count) {
+  char *buf = malloc(BLOCK_SIZE);
+  int clean = buf != NULL;
+  for (int i = 0; clean && i < count; i++) {
+    off_t offset = (off_t)(bnum + i) * BLOCK_SIZE;
+    clean = pread(blocks_fd, buf, BLOCK_SIZE, offset) == BLOCK_SIZE &&
+            memcmp(buf, blocks_get_block(bnum + i), BLOCK_SIZE) == 0;
+  }
+  free(buf);
+  return clean;
+}
+
+// Discard the in-memory copies of written blocks.
+void blocks_drop(int bnum, int count) {
+  // Pages are discarded whole. With pages larger than blocks, those at
+  // either end also hold other blocks, and are only discarded if those
+  // were written back too; otherwise the pages stay, until a later drop.
+  size_t page = sysconf(_SC_PAGESIZE);
+  int per_page = page > (size_t)BLOCK_SIZE ? page / BLOCK_SIZE : 1;
+  int start = bnum / per_page * per_page;
+  int end = (bnum + count + per_page - 1) / per_page * per_page;
+  if (start < bnum && !blocks_clean(start, bnum - start)) {
+    start += per_page;
+  }
+  if (bnum + count < end && start < end &&
+      !blocks_clean(bnum + count, end - bnum - count)) {
+    end -= per_page;
+  }
+  if (start < end) {
+    madvise(blocks_get_block(start), (size_t)(end - start) * BLOCK_SIZE,
+            MADV_DONTNEED);
+  }
+}
+
+void blocks_advise(int bnum, int count, blocks_advice_t advice) {
+  int behavior = MADV_WILLNEED;
+  if (advice == BLOCKS_COLD) {
+#ifdef MADV_COLD
+    behavior = MADV_COLD;
+#else
+    return;
+#endif
+  }
+
+  // madvise() takes whole pages.
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = (size_t)BLOCK_SIZE * bnum / page * page;
+  size_t end = (size_t)BLOCK_SIZE * (bnum + count);
+  end = (end + page - 1) / page * page;
+  madvise(blocks_base + start, end - start, behavior);
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return blocks_base + (size_t)BLOCK_SIZE * bnum;
+}
+
+// Return a pointer to the superblock, stored in block 0.
+superblock_t *get_superblock() { return (superblock_t *)blocks_base; }
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() {
+  return blocks_get_block(get_superblock()->block_bitmap_bnum);
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
+  return blocks_get_block(get_superblock()->inode_bitmap_bnum);
+}
 
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *)(block + BLOCK_BITMAP_SIZE);
+// Marks the bits [`start`, `start` + `n`) of the block bitmap and the
+// block hint to be journaled.
+static void dirty_bitmap(int start, int n) {
+  journal_dirty((char *)get_blocks_bitmap() + start / 8,
+                (start + n - 1) / 8 - start / 8 + 1);
+  journal_dirty(get_superblock(), sizeof(superblock_t));
+}
+
+// Returns how many blocks the calling thread may allocate. Called with
+// `alloc_lock` held.
+static int available() { return free_count - reserved_count + spendable; }
+
+// Counts `n` blocks as allocated, taking the reserved ones the calling
+// thread may take first. Called with `alloc_lock` held.
+static void take(int n) {
+  int reserved = n < spendable ? n : spendable;
+  spendable -= reserved;
+  reserved_count -= reserved;
+  free_count -= n;
 }
 
 // Allocate a new block and return its index.
 int alloc_block() {
-  void *bbm = get_blocks_bitmap();
-  int ii = next_free_block();
+  pthread_mutex_lock(&alloc_lock);
+  int ii = -1;
+  if (available() > 0) {
+    ii = bitmap_summary_find_zero(&blocks_summary,
+                                  get_superblock()->block_hint);
+  }
+  if (ii != -1) {
+    bitmap_summary_put(&blocks_summary, ii, 1, 1);
+    take(1);
 
-  if (ii == -1) {
-    return -1;
+    // Rotate the cursor, so the next search starts past this block.
+    get_superblock()->block_hint = ii + 1;
+    dirty_bitmap(ii, 1);
   }
+  pthread_mutex_unlock(&alloc_lock);
 
-  bitmap_put(bbm, ii, 1);
-  printf("+ alloc_block() -> %d\n", ii);
+  if (ii != -1) {
+    TRACE_EVENT(TRACE_ALLOC_BLOCKS, -1, ii, 1, 0);
+  }
   return ii;
 }
 
-// Deallocate the block with the given index.
-void free_block(int bnum) {
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
-  printf("+ free_block(%d)\n", bnum);
+// Allocate a run of up to `n` contiguous blocks, preferably at `goal`.
+int alloc_blocks(int n, int goal, int *count) {
+  uint64_t t0 = stats_now();
+  superblock_t *sb = get_superblock();
+  int start = -1;
+  int len = 0;
+  pthread_mutex_lock(&alloc_lock);
+  n = n < available() ? n : available();
+  if (n < 1) {
+    pthread_mutex_unlock(&alloc_lock);
+    stats_record(STATS_ALLOC_BLOCKS, t0, -ENOSPC);
+    return -1;
+  }
+
+  // Continue right where the caller left off, if that block is free.
+  if (goal >= 0 && goal < BLOCK_COUNT) {
+    len = bitmap_summary_run_length(&blocks_summary, goal, n);
+    start = len > 0 ? goal : -1;
+  }
+
+  // Otherwise, the next run that is long enough.
+  if (start == -1) {
+    int from = goal >= 0 ? goal : sb->block_hint;
+    start = bitmap_summary_find_run(&blocks_summary, from, n);
+    len = n;
+  }
+
+  // Otherwise, the longest run there is.
+  if (start == -1) {
+    start = bitmap_summary_find_longest(&blocks_summary, n, &len);
+    if (start == -1) {
+      pthread_mutex_unlock(&alloc_lock);
+      stats_record(STATS_ALLOC_BLOCKS, t0, -ENOSPC);
+      return -1;
+    }
+  }
+
+  bitmap_summary_put(&blocks_summary, start, len, 1);
+  take(len);
+  sb->block_hint = start + len;
+  dirty_bitmap(start, len);
+  pthread_mutex_unlock(&alloc_lock);
+  *count = len;
+  TRACE_EVENT(TRACE_ALLOC_BLOCKS, -1, start, len, goal);
+  stats_record(STATS_ALLOC_BLOCKS, t0, 0);
+  return start;
 }
 
-int next_free_block() {
-  void *bbm = get_blocks_bitmap();
+// Deallocate the block with the given index.
+void free_block(int bnum) { free_blocks(bnum, 1); }
 
-  for (int ii = 0; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      return ii;
+/**
+ * Deallocates the run of `n` blocks at `bnum`, which are referenced once,
+ * once the transaction commits.
+ */
+static void release_blocks(int bnum, int n) {
+  pthread_mutex_lock(&alloc_lock);
+  if (journal_in_transaction()) {
+    if (deferred_count == deferred_cap) {
+      deferred_cap = deferred_cap == 0 ? 16 : deferred_cap * 2;
+      deferred_runs =
+          realloc(deferred_runs, deferred_cap * sizeof(block_run_t));
+      assert(deferred_runs != NULL);
     }
+    deferred_runs[deferred_count++] = (block_run_t){.bnum = bnum, .n = n};
+  } else {
+    bitmap_summary_put(&blocks_summary, bnum, n, 0);
+    free_count += n;
+    dirty_bitmap(bnum, n);
   }
+  pthread_mutex_unlock(&alloc_lock);
+  TRACE_EVENT(TRACE_FREE_BLOCKS, -1, bnum, n, 0);
+}
 
-  return -1;
+// Deallocate a run of contiguous blocks, dropping a reference to the shared
+// ones.
+void free_blocks(int bnum, int n) {
+  for (int done = 0; done < n;) {
+    int shared;
+    int run = share_release(bnum + done, n - done, &shared);
+    if (!shared) {
+      release_blocks(bnum + done, run);
+    }
+    done += run;
+  }
+}
+
+// Deallocate the blocks freed by the transactions being committed.
+void blocks_release_deferred() {
+  pthread_mutex_lock(&alloc_lock);
+  for (int i = 0; i < deferred_count; i++) {
+    bitmap_summary_put(&blocks_summary, deferred_runs[i].bnum,
+                       deferred_runs[i].n, 0);
+    free_count += deferred_runs[i].n;
+    dirty_bitmap(deferred_runs[i].bnum, deferred_runs[i].n);
+  }
+  deferred_count = 0;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Whether blocks freed by transactions wait for them to commit.
+int blocks_deferred() {
+  pthread_mutex_lock(&alloc_lock);
+  int any = deferred_count > 0;
+  pthread_mutex_unlock(&alloc_lock);
+  return any;
+}
+
+// Reserve blocks for data to be allocated later.
+int blocks_reserve(int n) {
+  pthread_mutex_lock(&alloc_lock);
+  int rv = free_count - reserved_count >= n ? 0 : -1;
+  if (rv == 0) {
+    reserved_count += n;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return rv;
+}
+
+// Give back blocks reserved with blocks_reserve().
+void blocks_unreserve(int n) {
+  pthread_mutex_lock(&alloc_lock);
+  reserved_count -= n;
+  assert(reserved_count >= 0);
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Let the calling thread take reserved blocks.
+void blocks_spend_reserved(int n) { spendable += n; }
+
+// Stop the calling thread from taking reserved blocks.
+int blocks_unspend_reserved() {
+  int left = spendable;
+  spendable = 0;
+  return left;
+}
+
+int next_free_block() {
+  pthread_mutex_lock(&alloc_lock);
+  int bnum = bitmap_summary_find_zero(&blocks_summary,
+                                      get_superblock()->block_hint);
+  pthread_mutex_unlock(&alloc_lock);
+  return bnum;
 }
@@ -4,17 +4,53 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * The disk image is mmapped, so block data is accessed using pointers. The
+ * mapping is private: modified blocks reach the disk through the journal,
+ * see journal.h.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT;
 extern const int BLOCK_SIZE;
-extern const int NUFS_SIZE;
-extern const int BLOCK_BITMAP_SIZE;
+
+#define NUFS_MAGIC 0x5346554e  // "NUFS"
+#define NUFS_VERSION 5
+
+/**
+ * The on-disk superblock, stored at the start of block 0.
+ *
+ * It describes the geometry of the image, so images of any size can be
+ * mounted without recompiling. The image is laid out as:
+ *
+ * | super | block bitmap | inode bitmap | inode table | refs | dedup index |
+ * | journal | data ... |
+ *
+ * The reference table and the dedup index are described in share.h.
+ */
+typedef struct superblock {
+  uint32_t magic;           // NUFS_MAGIC
+  uint32_t version;         // on-disk format version, NUFS_VERSION
+  int block_size;           // bytes per block
+  int block_count;          // blocks in the image
+  int inode_count;          // inodes in the inode table
+  int block_bitmap_bnum;    // first block of the free blocks bitmap
+  int inode_bitmap_bnum;    // first block of the free inodes bitmap
+  int inode_table_bnum;     // first block of the inode table
+  int data_bnum;            // first block available for data
+  int block_hint;           // where the next search for a free block starts
+  int inode_hint;           // where the next search for a free inode starts
+  int journal_bnum;         // first block of the journal
+  int journal_blocks;       // blocks in the journal
+  int refs_bnum;            // first block of the reference table
+  int index_bnum;           // first block of the dedup index
+  int index_blocks;         // blocks in the dedup index
+} superblock_t;
+
+// Number of blocks in the mounted image.
+#define BLOCK_COUNT (get_superblock()->block_count)
 
 /**
  * Compute the number of blocks needed to store the given number of bytes.
@@ -23,20 +59,90 @@ extern const int BLOCK_BITMAP_SIZE;
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(int64_t bytes);
 
 /**
  * Load and initialize the given disk image.
  *
+ * A formatted image is mounted with the geometry its superblock declares.
+ * A new or blank image is formatted to fill the size of the image file, or
+ * `NUFS_DEFAULT_SIZE` bytes if the file is smaller than that. An image of
+ * another format version, or holding something else, is refused.
+ *
  * @param image_path Path to the disk image file.
+ * @return 0 on success, or -1 after printing why the image was refused.
  */
-void blocks_init(const char *image_path);
+int blocks_init(const char *image_path);
 
 /**
  * Close the disk image.
  */
 void blocks_free();
 
+/**
+ * Commit the modified blocks to the disk image, and wait until they are on
+ * disk.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int blocks_sync();
+
+/**
+ * Read blocks straight from the disk image, bypassing the mapping.
+ *
+ * @param bnum The first block to read.
+ * @param buf Where to read the blocks to.
+ * @param count The number of blocks to read.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int blocks_read(int bnum, void *buf, int count);
+
+/**
+ * Write blocks to the disk image, without syncing them.
+ *
+ * @param bnum The first block to write.
+ * @param buf The contents of the blocks.
+ * @param count The number of blocks to write.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int blocks_write(int bnum, const void *buf, int count);
+
+/**
+ * Wait until the blocks written to the disk image are on disk.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int blocks_flush();
+
+/**
+ * Discard the in-memory copies of blocks that were written to the disk
+ * image, so that they are read back from it. Memory is given back a page at
+ * a time: a page that also holds blocks whose copies differ from the image
+ * is kept. The caller makes sure nothing modifies the blocks sharing pages
+ * with those dropped meanwhile.
+ *
+ * @param bnum The first block to discard.
+ * @param count The number of blocks to discard.
+ */
+void blocks_drop(int bnum, int count);
+
+typedef enum blocks_advice {
+  BLOCKS_WILLNEED,  // about to be read: start reading them from the image
+  BLOCKS_COLD,      // read once: let them go first when memory is short
+} blocks_advice_t;
+
+/**
+ * Advise the kernel on how blocks will be used. Blocks sharing a page with
+ * them get the same advice.
+ *
+ * @param bnum The first block.
+ * @param count The number of blocks.
+ * @param advice How the blocks will be used.
+ */
+void blocks_advise(int bnum, int count, blocks_advice_t advice);
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -46,6 +152,13 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Return a pointer to the superblock of the mounted image.
+ *
+ * @return A pointer to the superblock.
+ */
+superblock_t *get_superblock();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -63,12 +176,30 @@ void *get_inode_bitmap();
 /**
  * Allocate a new block and return its block index.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the first unused block after the previous allocation (next fit,
+ * wrapping around) and marks it as allocated.
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
+/**
+ * Allocate a run of up to `n` contiguous blocks, preferably starting at
+ * the `goal` block.
+ *
+ * Takes the free run starting at `goal` if there is one, so that a file
+ * keeps growing in place. Otherwise takes the first run of `n` free blocks
+ * after `goal` (or after the previous allocation if `goal` is -1), falling
+ * back to the longest free run on the disk.
+ *
+ * @param n The number of blocks wanted.
+ * @param goal The block the run should start at, or -1 for no preference.
+ * @param count Set to the number of blocks allocated, between 1 and `n`.
+ *
+ * @return The index of the first block of the run, or -1 if the disk is full.
+ */
+int alloc_blocks(int n, int goal, int *count);
+
 /**
  * Deallocate the block with the given number.
  *
@@ -76,6 +207,63 @@ int alloc_block();
  */
 void free_block(int bnum);
 
+/**
+ * Deallocate a run of contiguous blocks.
+ *
+ * Blocks freed inside a transaction stay allocated until it commits, so
+ * that file data is never written over a block the disk still uses. Shared
+ * blocks only lose a reference, see share.h.
+ *
+ * @param bnum The first block of the run.
+ * @param n The number of blocks in the run.
+ */
+void free_blocks(int bnum, int n);
+
+/**
+ * Deallocate the blocks freed by transactions that are being committed.
+ */
+void blocks_release_deferred();
+
+/**
+ * Return whether blocks freed by transactions wait for them to commit.
+ *
+ * @return 1 if some blocks wait, 0 otherwise.
+ */
+int blocks_deferred();
+
+/**
+ * Reserve free blocks for data whose blocks are allocated later, so that
+ * other allocations leave them free.
+ *
+ * @param n The number of blocks to reserve.
+ *
+ * @return 0 on success, -1 if fewer than `n` blocks are free.
+ */
+int blocks_reserve(int n);
+
+/**
+ * Give back blocks reserved with blocks_reserve().
+ *
+ * @param n The number of blocks to give back.
+ */
+void blocks_unreserve(int n);
+
+/**
+ * Let the next allocations of the calling thread take up to `n` of the
+ * reserved blocks, before the others.
+ *
+ * @param n The number of reserved blocks that may be taken.
+ */
+void blocks_spend_reserved(int n);
+
+/**
+ * Stop the calling thread from taking reserved blocks.
+ *
+ * @return The number of reserved blocks it could have taken but did not,
+ * which stay reserved.
+ */
+int blocks_unspend_reserved();
+
 /**
  * Returns the block index of the next available block, without allocating.
  * Returns -1 if nothing is free.
@@ -0,0 +1,207 @@
+#include "compress.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+// Shortest match worth a token, and the longest length a token holds
+// without extra bytes.
+#define MIN_MATCH 4
+#define TOKEN_MAX 15
+
+// The encoder remembers the last position of each hashed 4-byte sequence.
+#define HASH_BITS 12
+
+// Bytes sampled by compress_worthwhile().
+#define SAMPLE_SIZE 1024
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int hash(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+int compress_worthwhile(const void *src, size_t len) {
+  const uint8_t *in = src;
+  size_t step = len > SAMPLE_SIZE ? len / SAMPLE_SIZE : 1;
+  size_t counts[256] = {0};
+  size_t n = 0;
+  for (size_t i = 0; i < len; i += step, n++) {
+    counts[in[i]]++;
+  }
+
+  // Two sampled bytes are equal with probability 1/256 if the bytes are
+  // evenly spread; compressible data repeats bytes much more often.
+  size_t pairs = 0;
+  for (int b = 0; b < 256; b++) {
+    if (counts[b] > 1) {
+      pairs += counts[b] * (counts[b] - 1);
+    }
+  }
+  return n < 2 || pairs * 256 >= 2 * n * (n - 1);
+}
+
+/**
+ * Writes the extra bytes of a length of `n` past TOKEN_MAX at `out`.
+ * Returns the end of what was written, or NULL if it did not fit before
+ * `end`.
+ */
+static uint8_t *put_length(uint8_t *out, uint8_t *end, size_t n) {
+  for (; n >= 255; n -= 255) {
+    if (out == end) {
+      return NULL;
+    }
+    *out++ = 255;
+  }
+  if (out == end) {
+    return NULL;
+  }
+  *out++ = n;
+  return out;
+}
+
+/**
+ * Writes a token of the `lit` bytes at `literals` followed by a match of
+ * `match` bytes `offset` bytes back, or by nothing if `match` is 0.
+ * Returns the end of what was written, or NULL if it did not fit before
+ * `end`.
+ */
+static uint8_t *put_token(uint8_t *out, uint8_t *end, const uint8_t *literals,
+                          size_t lit, size_t offset, size_t match) {
+  size_t match_code = match > 0 ? match - MIN_MATCH : 0;
+  if (out == end) {
+    return NULL;
+  }
+  *out++ = (lit < TOKEN_MAX ? lit : TOKEN_MAX) << 4 |
+           (match_code < TOKEN_MAX ? match_code : TOKEN_MAX);
+
+  if (lit >= TOKEN_MAX) {
+    out = put_length(out, end, lit - TOKEN_MAX);
+  }
+  if (out == NULL || (size_t)(end - out) < lit) {
+    return NULL;
+  }
+  memcpy(out, literals, lit);
+  out += lit;
+
+  if (match == 0) {
+    return out;
+  }
+  if (end - out < 2) {
+    return NULL;
+  }
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  if (match_code >= TOKEN_MAX) {
+    out = put_length(out, end, match_code - TOKEN_MAX);
+  }
+  return out;
+}
+
+size_t compress_encode(const void *src, size_t len, void *dst, size_t cap) {
+  assert(len <= COMPRESS_MAX_INPUT);
+  const uint8_t *in = src;
+  uint8_t *out = dst;
+  uint8_t *end = out + cap;
+
+  // Positions fit in 16 bits. A stale or empty slot only costs a compare.
+  uint16_t table[1 << HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + MIN_MATCH <= len) {
+    uint32_t v = read32(in + pos);
+    int h = hash(v);
+    size_t cand = table[h];
+    table[h] = pos;
+    if (cand >= pos || read32(in + cand) != v) {
+      pos++;
+      continue;
+    }
+
+    size_t match = MIN_MATCH;
+    while (pos + match < len && in[cand + match] == in[pos + match]) {
+      match++;
+    }
+    out = put_token(out, end, in + anchor, pos - anchor, pos - cand, match);
+    if (out == NULL) {
+      return 0;
+    }
+    pos += match;
+    anchor = pos;
+  }
+
+  out = put_token(out, end, in + anchor, len - anchor, 0, 0);
+  return out == NULL ? 0 : out - (uint8_t *)dst;
+}
+
+/**
+ * Adds the extra bytes of a length at `*in` to `n`, advancing `*in`.
+ * Returns 0 on success and -1 if they run past `end`.
+ */
+static int get_length(const uint8_t **in, const uint8_t *end, size_t *n) {
+  uint8_t b;
+  do {
+    if (*in == end) {
+      return -1;
+    }
+    b = *(*in)++;
+    *n += b;
+  } while (b == 255);
+  return 0;
+}
+
+long compress_decode(const void *src, size_t len, void *dst, size_t cap) {
+  const uint8_t *in = src;
+  const uint8_t *in_end = in + len;
+  uint8_t *out = dst;
+  uint8_t *out_end = out + cap;
+
+  while (in < in_end) {
+    uint8_t token = *in++;
+    size_t lit = token >> 4;
+    if (lit == TOKEN_MAX && get_length(&in, in_end, &lit) == -1) {
+      return -1;
+    }
+    if (lit > (size_t)(in_end - in) || lit > (size_t)(out_end - out)) {
+      return -1;
+    }
+    memcpy(out, in, lit);
+    in += lit;
+    out += lit;
+    if (in == in_end) {
+      break;
+    }
+
+    if (in_end - in < 2) {
+      return -1;
+    }
+    size_t offset = in[0] | (size_t)in[1] << 8;
+    in += 2;
+    size_t match = token & TOKEN_MAX;
+    if (match == TOKEN_MAX && get_length(&in, in_end, &match) == -1) {
+      return -1;
+    }
+    match += MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(out - (uint8_t *)dst) ||
+        match > (size_t)(out_end - out)) {
+      return -1;
+    }
+
+    // A match may overlap its own output, repeating the last `offset` bytes.
+    const uint8_t *from = out - offset;
+    if (offset >= match) {
+      memcpy(out, from, match);
+    } else {
+      for (size_t i = 0; i < match; i++) {
+        out[i] = from[i];
+      }
+    }
+    out += match;
+  }
+
+  return out - (uint8_t *)dst;
+}
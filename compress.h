@@ -0,0 +1,40 @@
+// A small LZ77 codec for file contents.
+//
+// The format is a sequence of tokens, each a run of literal bytes followed
+// by a match: a copy of earlier output at most 65535 bytes back. A token
+// byte holds both lengths, 15 or more spilling into extra bytes that add up
+// until one is below 255; literals follow, then the match offset in two
+// little-endian bytes. The last token has literals only. There is no
+// entropy coding, so both directions run at memory speed.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+// Most bytes compress_encode() takes at once, so that offsets fit in 16 bits.
+#define COMPRESS_MAX_INPUT 65536
+
+/**
+ * Guesses from a sample of its bytes whether the `len` bytes at `src` are
+ * worth compressing: data whose bytes are close to evenly spread, like data
+ * that is already compressed or encrypted, is not.
+ * Returns 1 if they are and 0 otherwise.
+ */
+int compress_worthwhile(const void *src, size_t len);
+
+/**
+ * Compresses the `len` bytes at `src`, at most COMPRESS_MAX_INPUT, into
+ * the `cap` bytes at `dst`.
+ * Returns the compressed size, or 0 if it would not fit.
+ */
+size_t compress_encode(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * Decompresses the `len` bytes at `src` into the `cap` bytes at `dst`.
+ * Returns the decompressed size, or -1 if the data is corrupt or does not
+ * fit.
+ */
+long compress_decode(const void *src, size_t len, void *dst, size_t cap);
+
+#endif
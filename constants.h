@@ -3,13 +3,14 @@
 
 #define DIR_MODE 040775
 
-#define INODE_COUNT BLOCK_SIZE / sizeof(inode_t)
+#define INODE_COUNT (get_superblock()->inode_count)
 #define ENTRY_COUNT BLOCK_SIZE / sizeof(dirent_t)
 
 #define ROOT_DIR_INUM 0
 
-#define INODES_BNUM 1
-#define ROOT_DIR_BNUM 2
+#define INODES_BNUM (get_superblock()->inode_table_bnum)
+#define INODE_TABLE_BLOCKS (INODE_COUNT * sizeof(inode_t) / BLOCK_SIZE)
+#define ROOT_DIR_BNUM (get_superblock()->data_bnum)
 
 #define SELF_REF "."
 #define PARENT_REF ".."
\ No newline at end of file
@@ -0,0 +1,180 @@
+// Dentry cache: an in-memory hash table from paths to inode numbers.
+//
+// A fixed array of buckets, each a chain of entries. When the cache is full,
+// the chain an insert lands in is dropped to make room.
+//
+// Lookups share a reader/writer lock, changes take it exclusively. Every
+// invalidation bumps a generation counter, so that a lookup that raced with
+// a change to the tree does not cache its stale result.
+
+#include "dcache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DCACHE_BUCKETS 4096
+#define DCACHE_MAX_ENTRIES 16384
+
+typedef struct dentry {
+  uint64_t hash;
+  int inum;  // -1 for a negative entry
+  size_t len;
+  struct dentry *next;
+  char path[];
+} dentry_t;
+
+static dentry_t *buckets[DCACHE_BUCKETS];
+static int entry_count = 0;
+static uint64_t generation = 0;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// FNV-1a hash of the first `len` bytes of `path`.
+static uint64_t hash_path(const char *path, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)path[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static dentry_t **bucket_of(uint64_t hash) {
+  return &buckets[hash % DCACHE_BUCKETS];
+}
+
+// Returns the link pointing at the entry for `path`, or at the end of its
+// chain if there is no such entry.
+static dentry_t **find_link(const char *path, size_t len, uint64_t hash) {
+  dentry_t **link = bucket_of(hash);
+  while (*link != NULL) {
+    dentry_t *entry = *link;
+    if (entry->hash == hash && entry->len == len &&
+        memcmp(entry->path, path, len) == 0) {
+      break;
+    }
+    link = &entry->next;
+  }
+  return link;
+}
+
+// Unlinks and frees the entry `*link` points at.
+static void drop(dentry_t **link) {
+  dentry_t *entry = *link;
+  *link = entry->next;
+  free(entry);
+  entry_count--;
+}
+
+int dcache_lookup(const char *path, size_t len, int *inum) {
+  uint64_t hash = hash_path(path, len);
+  pthread_rwlock_rdlock(&lock);
+  dentry_t *entry = *find_link(path, len, hash);
+  if (entry != NULL) {
+    *inum = entry->inum;
+  }
+  pthread_rwlock_unlock(&lock);
+
+  return entry != NULL;
+}
+
+uint64_t dcache_generation() {
+  pthread_rwlock_rdlock(&lock);
+  uint64_t gen = generation;
+  pthread_rwlock_unlock(&lock);
+  return gen;
+}
+
+void dcache_insert(const char *path, size_t len, int inum, uint64_t gen) {
+  uint64_t hash = hash_path(path, len);
+  pthread_rwlock_wrlock(&lock);
+  if (gen != generation) {
+    pthread_rwlock_unlock(&lock);
+    return;
+  }
+
+  dentry_t **link = find_link(path, len, hash);
+  if (*link != NULL) {
+    (*link)->inum = inum;
+    pthread_rwlock_unlock(&lock);
+    return;
+  }
+
+  if (entry_count >= DCACHE_MAX_ENTRIES) {
+    dentry_t **head = bucket_of(hash);
+    while (*head != NULL) {
+      drop(head);
+    }
+    link = head;
+  }
+
+  dentry_t *entry = malloc(sizeof(dentry_t) + len + 1);
+  entry->hash = hash;
+  entry->inum = inum;
+  entry->len = len;
+  entry->next = NULL;
+  memcpy(entry->path, path, len);
+  entry->path[len] = '\0';
+
+  *link = entry;
+  entry_count++;
+  pthread_rwlock_unlock(&lock);
+}
+
+void dcache_invalidate(const char *path) {
+  size_t len = strlen(path);
+  uint64_t hash = hash_path(path, len);
+  pthread_rwlock_wrlock(&lock);
+  generation++;
+  dentry_t **link = find_link(path, len, hash);
+  if (*link != NULL) {
+    drop(link);
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+// Drops every entry; the lock must be held exclusively.
+static void clear_locked() {
+  if (entry_count == 0) {
+    return;
+  }
+  for (int i = 0; i < DCACHE_BUCKETS; i++) {
+    while (buckets[i] != NULL) {
+      drop(&buckets[i]);
+    }
+  }
+}
+
+void dcache_invalidate_tree(const char *path) {
+  size_t len = strlen(path);
+  pthread_rwlock_wrlock(&lock);
+  generation++;
+  if (strcmp(path, "/") == 0) {
+    clear_locked();
+    pthread_rwlock_unlock(&lock);
+    return;
+  }
+
+  for (int i = 0; i < DCACHE_BUCKETS; i++) {
+    dentry_t **link = &buckets[i];
+    while (*link != NULL) {
+      dentry_t *entry = *link;
+      int below = entry->len >= len && memcmp(entry->path, path, len) == 0 &&
+                  (entry->path[len] == '/' || entry->path[len] == '\0');
+      if (below) {
+        drop(link);
+      } else {
+        link = &entry->next;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+void dcache_clear() {
+  pthread_rwlock_wrlock(&lock);
+  generation++;
+  clear_locked();
+  pthread_rwlock_unlock(&lock);
+}
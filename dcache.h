@@ -0,0 +1,50 @@
+// Dentry cache: an in-memory hash table from paths to inode numbers.
+//
+// Caches misses too (negative entries), so repeated probes for names that do
+// not exist are as cheap as hits. The storage layer invalidates entries
+// whenever it adds, removes or moves a name. Safe to use from any thread.
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Looks up the first `len` bytes of `path` in the cache.
+ * Returns 1 and sets `inum` on a hit, where an `inum` of -1 means the path
+ * is cached as not existing. Returns 0 if the path is not cached.
+ */
+int dcache_lookup(const char *path, size_t len, int *inum);
+
+/**
+ * Returns the current generation of the cache, which changes whenever an
+ * entry is invalidated.
+ */
+uint64_t dcache_generation();
+
+/**
+ * Caches that the first `len` bytes of `path` resolve to `inum`, or that
+ * the path does not exist if `inum` is -1.
+ * Does nothing unless the cache is still at generation `gen`, which the
+ * caller read before resolving the path; otherwise, the path may have
+ * changed since.
+ */
+void dcache_insert(const char *path, size_t len, int inum, uint64_t gen);
+
+/**
+ * Drops the cached entry for `path`, if any.
+ */
+void dcache_invalidate(const char *path);
+
+/**
+ * Drops the cached entries for `path` and every path below it.
+ */
+void dcache_invalidate_tree(const char *path);
+
+/**
+ * Drops every cached entry.
+ */
+void dcache_clear();
+
+#endif
@@ -7,23 +7,17 @@
 #include "bitmap.h"
 #include "blocks.h"
 #include "constants.h"
+#include "dcache.h"
+#include "extent.h"
 #include "inode.h"
+#include "journal.h"
 #include "slist.h"
+#include "stats.h"
+#include "trace.h"
 
 void directory_init() {
-  // Do nothing if inodes block is already allocated.
-  int inodes_bnum = next_free_block();
-  if (inodes_bnum != INODES_BNUM) {
-    return;
-  }
-
-  // Allocate inodes block if not already allocated.
-  assert(alloc_block() == INODES_BNUM);
-
-  int next_free_bnum = next_free_block();
-
-  // Do nothing if `ROOT_DIR_BNUM` block is already initialized.
-  if (next_free_bnum != ROOT_DIR_BNUM) {
+  // Do nothing if the root directory already exists.
+  if (bitmap_get(get_inode_bitmap(), ROOT_DIR_INUM)) {
     return;
   }
 
@@ -37,13 +31,366 @@ void directory_init() {
   root_inode->refs = 1;
   root_inode->mode = DIR_MODE;
   root_inode->size = 0;
-  root_inode->block = ROOT_DIR_BNUM;
+  root_inode->flags = 0;
+  extent_init(root_inode);
+  assert(extent_insert(root_inode, 0, bnum, 1) == 0);
+}
+
+// Returns logical block `lblk` of the given directory inode `dd`.
+static dirent_t *get_dir_block(inode_t *dd, int lblk) {
+  return (dirent_t *)blocks_get_block(extent_map(dd, lblk, NULL));
+}
+
+// Directories with more entries than this are converted from the linear
+// format, a single block that is scanned, to the hashed format.
+#define DIR_LINEAR_MAX 8
+
+// A hashed directory is a linear hash table whose bucket `b` is logical
+// block `b` of the directory. A bucket that fills up chains overflow
+// blocks, which are placed from this logical block on.
+#define OVERFLOW_LBLK (1 << 20)
+
+// The next bucket is split whenever an insert leaves the table fuller than
+// this, in percent.
+#define DIR_MAX_LOAD 75
+
+// Every block of a hashed directory starts with this header in slot 0. The
+// other slots hold entries, each at or after the slot its name hashes to.
+typedef struct dir_bucket {
+  int count;     // entries in the block
+  int overflow;  // logical block of the next overflow block, 0 for none
+  // The shape of the table, only kept in bucket 0.
+  int level;  // the table has 2^level buckets, plus those split already
+  int split;  // the next bucket to split
+  char _reserved[sizeof(dirent_t) - 4 * sizeof(int)];
+} dir_bucket_t;
+
+#define BUCKET_SLOTS (ENTRY_COUNT - 1)
+
+_Static_assert(sizeof(dir_bucket_t) == sizeof(dirent_t),
+               "the bucket header must fill a directory slot");
+
+static int is_hashed(inode_t *dd) { return dd->flags & INODE_DIR_HASHED; }
+
+// FNV-1a hash of an entry name.
+static uint32_t name_hash(const char *name) {
+  uint32_t hash = 0x811c9dc5;
+  for (; *name != '\0'; name++) {
+    hash ^= (unsigned char)*name;
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+static dir_bucket_t *bucket_header(dirent_t *bucket) {
+  return (dir_bucket_t *)bucket;
+}
+
+// Returns the slot an entry with the given name `hash` is stored at first.
+static int home_slot(uint32_t hash) { return 1 + hash % BUCKET_SLOTS; }
+
+static int next_slot(int i) { return i == BUCKET_SLOTS ? 1 : i + 1; }
+
+/**
+ * Probes `bucket` for the entry `name`, whose hash is `hash`.
+ * Returns the entry if it is there, otherwise the free slot it would be
+ * stored in, or NULL if the bucket is full.
+ */
+static dirent_t *bucket_probe(dirent_t *bucket, const char *name,
+                              uint32_t hash) {
+  int i = home_slot(hash);
+  for (int n = 0; n < BUCKET_SLOTS; n++, i = next_slot(i)) {
+    dirent_t *entry = &bucket[i];
+    if (entry->name[0] == '\0' ||
+        (entry->hash == hash && strcmp(entry->name, name) == 0)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Stores a new entry in the free slot `entry` found by bucket_probe().
+ */
+static void bucket_fill(dirent_t *bucket, dirent_t *entry, const char *name,
+                        uint32_t hash, int inum) {
+  journal_dirty(bucket, BLOCK_SIZE);
+  strncpy(entry->name, name, DIR_NAME_LENGTH);
+  entry->inum = inum;
+  entry->hash = hash;
+  bucket_header(bucket)->count++;
+}
+
+/**
+ * Removes `entry` from `bucket`. The entries probed past it are shifted
+ * back, so that every probe still ends at the first free slot.
+ */
+static void bucket_remove(dirent_t *bucket, dirent_t *entry) {
+  int hole = entry - bucket;
+  journal_dirty(bucket, BLOCK_SIZE);
+  memset(entry, 0, sizeof(dirent_t));
+
+  for (int i = next_slot(hole); bucket[i].name[0] != '\0'; i = next_slot(i)) {
+    // An entry stays if its home slot lies between the hole and itself.
+    int home = home_slot(bucket[i].hash);
+    int stays = hole < i ? (hole < home && home <= i)
+                         : (hole < home || home <= i);
+    if (!stays) {
+      bucket[hole] = bucket[i];
+      memset(&bucket[i], 0, sizeof(dirent_t));
+      hole = i;
+    }
+  }
+
+  bucket_header(bucket)->count--;
+}
+
+static dir_bucket_t *table_shape(inode_t *dd) {
+  return bucket_header(get_dir_block(dd, 0));
+}
+
+static int64_t bucket_count(dir_bucket_t *shape) {
+  return ((int64_t)1 << shape->level) + shape->split;
+}
+
+// Returns the bucket the entries with the given name `hash` are stored in.
+static int bucket_of(inode_t *dd, uint32_t hash) {
+  dir_bucket_t *shape = table_shape(dd);
+  uint32_t b = hash & ((1u << shape->level) - 1);
+  if (b < (uint32_t)shape->split) {
+    b = hash & ((2u << shape->level) - 1);
+  }
+  return b;
+}
+
+/**
+ * Maps a zeroed block at logical block `lblk` of the directory `dd`,
+ * placed right after the block before it if that one is free.
+ * Returns the block, or NULL if the disk is full.
+ */
+static dirent_t *dir_alloc_block(inode_t *dd, int lblk) {
+  int prev = lblk > 0 ? extent_map(dd, lblk - 1, NULL) : 0;
+  int count;
+  int bnum = alloc_blocks(1, prev != 0 ? prev + 1 : -1, &count);
+  if (bnum == -1) {
+    return NULL;
+  }
+  if (extent_insert(dd, lblk, bnum, 1) == -1) {
+    free_block(bnum);
+    return NULL;
+  }
+
+  dirent_t *block = (dirent_t *)blocks_get_block(bnum);
+  journal_dirty(block, BLOCK_SIZE);
+  memset(block, 0, BLOCK_SIZE);
+  return block;
+}
+
+/**
+ * Chains a new overflow block to bucket `b`, right after the bucket.
+ * Returns the block, or NULL if the disk is full.
+ */
+static dirent_t *chain_extend(inode_t *dd, int b) {
+  int lblk = OVERFLOW_LBLK;
+  int run;
+  while (extent_map(dd, lblk, &run) != 0) {
+    lblk += run;
+  }
+
+  dirent_t *block = dir_alloc_block(dd, lblk);
+  if (block == NULL) {
+    return NULL;
+  }
+
+  dir_bucket_t *head = bucket_header(get_dir_block(dd, b));
+  journal_dirty(head, sizeof(dir_bucket_t));
+  bucket_header(block)->overflow = head->overflow;
+  head->overflow = lblk;
+  return block;
+}
+
+/**
+ * Returns the entry `name`, whose hash is `hash`, from bucket `b` or one
+ * of its overflow blocks, or NULL if there is no such entry.
+ */
+static dirent_t *chain_find(inode_t *dd, int b, const char *name,
+                            uint32_t hash) {
+  int lblk = b;
+  do {
+    dirent_t *bucket = get_dir_block(dd, lblk);
+    dirent_t *entry = bucket_probe(bucket, name, hash);
+    if (entry != NULL && entry->name[0] != '\0') {
+      return entry;
+    }
+    lblk = bucket_header(bucket)->overflow;
+  } while (lblk != 0);
+
+  return NULL;
+}
+
+/**
+ * Stores a new entry in the first block of bucket `b` that has room,
+ * chaining an overflow block if none has.
+ * Returns 0 on success and -1 if the disk is full.
+ */
+static int chain_insert(inode_t *dd, int b, const char *name, uint32_t hash,
+                        int inum) {
+  int lblk = b;
+  dirent_t *bucket;
+  do {
+    bucket = get_dir_block(dd, lblk);
+    if (bucket_header(bucket)->count < BUCKET_SLOTS) {
+      break;
+    }
+    lblk = bucket_header(bucket)->overflow;
+  } while (lblk != 0);
+
+  if (bucket_header(bucket)->count == BUCKET_SLOTS) {
+    bucket = chain_extend(dd, b);
+    if (bucket == NULL) {
+      return -1;
+    }
+  }
+
+  bucket_fill(bucket, bucket_probe(bucket, name, hash), name, hash, inum);
+  return 0;
+}
+
+/**
+ * Removes the entry `name`, whose hash is `hash`, from bucket `b` and
+ * releases the overflow block it was in if that becomes empty.
+ * Returns 0 on success and -1 if there is no such entry.
+ */
+static int chain_remove(inode_t *dd, int b, const char *name, uint32_t hash) {
+  dir_bucket_t *prev = NULL;
+  int lblk = b;
+  do {
+    dirent_t *bucket = get_dir_block(dd, lblk);
+    dirent_t *entry = bucket_probe(bucket, name, hash);
+    if (entry != NULL && entry->name[0] != '\0') {
+      bucket_remove(bucket, entry);
+
+      int next = bucket_header(bucket)->overflow;
+      if (prev != NULL && bucket_header(bucket)->count == 0 &&
+          extent_remove(dd, lblk, 1) == 0) {
+        journal_dirty(prev, sizeof(dir_bucket_t));
+        prev->overflow = next;
+      }
+      return 0;
+    }
+    prev = bucket_header(bucket);
+    lblk = prev->overflow;
+  } while (lblk != 0);
+
+  return -1;
+}
+
+/**
+ * Splits the next bucket in line, moving the entries that hash to the new
+ * bucket there. Leaves the table as it is if the disk is full.
+ */
+static void split_bucket(inode_t *dd) {
+  dir_bucket_t *shape = table_shape(dd);
+  int from = shape->split;
+  int to = from + (1 << shape->level);
+  uint32_t mask = (2u << shape->level) - 1;
+  if (to >= OVERFLOW_LBLK) {
+    return;
+  }
+
+  int total = 0;
+  int lblk = from;
+  do {
+    dirent_t *bucket = get_dir_block(dd, lblk);
+    total += bucket_header(bucket)->count;
+    lblk = bucket_header(bucket)->overflow;
+  } while (lblk != 0);
+
+  dirent_t *moving = malloc((total + 1) * sizeof(dirent_t));
+  int count = 0;
+  lblk = from;
+  do {
+    dirent_t *bucket = get_dir_block(dd, lblk);
+    for (int i = 1; i <= BUCKET_SLOTS; i++) {
+      if (bucket[i].name[0] != '\0' && (bucket[i].hash & mask) == to) {
+        moving[count++] = bucket[i];
+      }
+    }
+    lblk = bucket_header(bucket)->overflow;
+  } while (lblk != 0);
+
+  // Make room for every moving entry first, so moving cannot fail midway.
+  int room = 0;
+  if (dir_alloc_block(dd, to) != NULL) {
+    room = BUCKET_SLOTS;
+    while (room < count && chain_extend(dd, to) != NULL) {
+      room += BUCKET_SLOTS;
+    }
+  }
+
+  if (room < count || room == 0) {
+    lblk = to;
+    while (room > 0) {
+      int next = bucket_header(get_dir_block(dd, lblk))->overflow;
+      extent_remove(dd, lblk, 1);
+      lblk = next;
+      room -= BUCKET_SLOTS;
+    }
+    free(moving);
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    chain_remove(dd, from, moving[i].name, moving[i].hash);
+    chain_insert(dd, to, moving[i].name, moving[i].hash, moving[i].inum);
+  }
+  free(moving);
+
+  journal_dirty(shape, sizeof(dir_bucket_t));
+  shape->split++;
+  if (shape->split == 1 << shape->level) {
+    shape->level++;
+    shape->split = 0;
+  }
+}
+
+/**
+ * Rewrites the entries of the linear directory `dd` in the hashed format.
+ * Returns 0 on success and -1 if the disk is too full to do so, in which
+ * case the directory is left linear.
+ */
+static int make_hashed(inode_t *dd) {
+  dirent_t *block = get_dir_block(dd, 0);
+  dirent_t entries[ENTRY_COUNT];
+  memcpy(entries, block, BLOCK_SIZE);
+  journal_dirty(block, BLOCK_SIZE);
+  memset(block, 0, BLOCK_SIZE);
+  journal_dirty(dd, sizeof(inode_t));
+  dd->flags |= INODE_DIR_HASHED;
+
+  // A full linear block, which older images may hold, does not fit in a
+  // single bucket, and the overflow block may not be had.
+  for (int i = 0; i < ENTRY_COUNT; i++) {
+    if (entries[i].name[0] == '\0') {
+      continue;
+    }
+    uint32_t hash = name_hash(entries[i].name);
+    if (chain_insert(dd, 0, entries[i].name, hash, entries[i].inum) == -1) {
+      extent_remove(dd, OVERFLOW_LBLK, EXTENT_MAX_LBLK);
+      dd->flags &= ~INODE_DIR_HASHED;
+      memcpy(block, entries, BLOCK_SIZE);
+      return -1;
+    }
+  }
+
+  return 0;
 }
 
 int directory_lookup(inode_t *dd, const char *name) {
-  assert(dd->block == ROOT_DIR_BNUM || dd->mode == DIR_MODE);
-  dirent_t *dir_block = (dirent_t *)blocks_get_block(dd->block);
+  assert(is_dir(dd));
+  uint64_t t0 = stats_now();
   dirent_t *entry = get_entry_with_name(dd, name);
+  stats_record(STATS_DIR_LOOKUP, t0, 0);
   if (entry == NULL) {
     return -1;
   }
@@ -51,75 +398,185 @@ int directory_lookup(inode_t *dd, const char *name) {
   return entry->inum;
 }
 
-int tree_lookup(const char *path) {
-  if (strcmp(path, "/") == 0) {
+/**
+ * Looks up the entry named by the `len` bytes at `name` in the directory
+ * `dir_inum`, holding its read lock. Returns -1 if `dir_inum` is not a
+ * directory or the name is not in it.
+ */
+static int lookup_component(int dir_inum, const char *name, size_t len) {
+  if (len >= DIR_NAME_LENGTH) {
+    return -1;
+  }
+
+  char buf[DIR_NAME_LENGTH];
+  memcpy(buf, name, len);
+  buf[len] = '\0';
+
+  inode_read_lock(dir_inum);
+  inode_t *dd = get_inode(dir_inum);
+  int inum = is_dir(dd) ? directory_lookup(dd, buf) : -1;
+  inode_unlock(dir_inum);
+  return inum;
+}
+
+/**
+ * Resolves the first `len` bytes of `path` through the dentry cache.
+ * On a miss, the walk starts from the closest cached ancestor and caches
+ * every path it resolves on the way down.
+ */
+static int tree_lookup_n(const char *path, size_t len) {
+  if (len <= 1) {
     return ROOT_DIR_INUM;
   }
 
-  // Splits the path into a linked list.
-  // Skips first element because it is "".
-  slist_t *path_list = s_explode(++path, '/');
-  s_print(path_list);
-  slist_t *curr = path_list;
-  int inum = ROOT_DIR_INUM;
-  while (curr != NULL) {
-    inum = directory_lookup(get_inode(inum), curr->data);
-    if (inum == -1) {
-      return -1;
+  int inum;
+  if (dcache_lookup(path, len, &inum)) {
+    return inum;
+  }
+
+  // Back up to the closest ancestor that is cached, or to the root.
+  uint64_t gen = dcache_generation();
+  size_t start = len;
+  inum = ROOT_DIR_INUM;
+  do {
+    start--;
+    while (start > 0 && path[start] != '/') {
+      start--;
     }
-    curr = curr->next;
+  } while (start > 0 && !dcache_lookup(path, start, &inum));
+
+  while (start < len && inum != -1) {
+    size_t end = start + 1;
+    while (end < len && path[end] != '/') {
+      end++;
+    }
+
+    inum = lookup_component(inum, path + start + 1, end - start - 1);
+    dcache_insert(path, end, inum, gen);
+    start = end;
   }
 
   return inum;
 }
 
-dirent_t *next_free_entry(inode_t *dd) {
-  // Look for an entry space that was previously deleted.
-  dirent_t *free_entry = get_entry_with_name(dd, "");
-  if (free_entry != NULL) {
-    return free_entry;
+int tree_lookup(const char *path) {
+  uint64_t t0 = stats_now();
+  int inum = tree_lookup_n(path, strlen(path));
+  stats_record(STATS_PATH_LOOKUP, t0, 0);
+  TRACE_INUM(inum);
+  return inum;
+}
+
+const char *path_split(const char *path, size_t *parent_len) {
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL) {
+    *parent_len = 0;
+    return path;
   }
 
-  // No space available
-  if (dd->size + sizeof(dirent_t) > BLOCK_SIZE) {
-    return NULL;
+  *parent_len = slash - path;
+  return slash + 1;
+}
+
+int path_lookup_parent(const char *path, char name[DIR_NAME_LENGTH]) {
+  size_t parent_len;
+  const char *leaf = path_split(path, &parent_len);
+  size_t leaf_len = strlen(leaf);
+  if (leaf_len == 0 || leaf_len >= DIR_NAME_LENGTH) {
+    return -1;
   }
 
-  // If next available space is at the end
-  dirent_t *dir_block = (dirent_t *)blocks_get_block(dd->block);
-  return (dirent_t *)((char *)(dir_block) + dd->size);
+  uint64_t t0 = stats_now();
+  int parent_inum = tree_lookup_n(path, parent_len);
+  stats_record(STATS_PATH_LOOKUP, t0, 0);
+  if (parent_inum == -1 || !is_dir(get_inode(parent_inum))) {
+    return -1;
+  }
+
+  memcpy(name, leaf, leaf_len + 1);
+  return parent_inum;
+}
+
+dirent_t *next_free_entry(inode_t *dd) {
+  assert(!is_hashed(dd));
+  dirent_t *dir_block = get_dir_block(dd, 0);
+  for (int i = 0; i < ENTRY_COUNT; i++) {
+    if (dir_block[i].name[0] == '\0') {
+      return &dir_block[i];
+    }
+  }
+
+  return NULL;
 }
 
 int directory_put(inode_t *dd, const char *name, int inum) {
-  dirent_t *new_entry = next_free_entry(dd);
-  if (new_entry == NULL) {
+  if (get_entry_with_name(dd, name) != NULL) {
     return -1;
   }
 
-  strncpy(new_entry->name, name, DIR_NAME_LENGTH);
-  new_entry->inum = inum;
-  dd->size += sizeof(dirent_t);
+  int count = get_num_entries(dd->size);
+  if (!is_hashed(dd) && count >= DIR_LINEAR_MAX && make_hashed(dd) == -1) {
+    return -1;
+  }
 
+  if (is_hashed(dd)) {
+    uint32_t hash = name_hash(name);
+    if (chain_insert(dd, bucket_of(dd, hash), name, hash, inum) == -1) {
+      return -1;
+    }
+    if ((int64_t)(count + 1) * 100 >
+        bucket_count(table_shape(dd)) * BUCKET_SLOTS * DIR_MAX_LOAD) {
+      split_bucket(dd);
+    }
+  } else {
+    dirent_t *new_entry = next_free_entry(dd);
+    if (new_entry == NULL) {
+      return -1;
+    }
+    journal_dirty(new_entry, sizeof(dirent_t));
+    strncpy(new_entry->name, name, DIR_NAME_LENGTH);
+    new_entry->inum = inum;
+  }
+
+  journal_dirty(dd, sizeof(inode_t));
+  dd->size += sizeof(dirent_t);
   return 0;
 }
 
 int directory_delete(inode_t *dd, const char *name) {
-  dirent_t *entry_to_delete = get_entry_with_name(dd, name);
-  if (entry_to_delete == NULL) {
-    return -1;
+  if (is_hashed(dd)) {
+    uint32_t hash = name_hash(name);
+    if (chain_remove(dd, bucket_of(dd, hash), name, hash) == -1) {
+      return -1;
+    }
+  } else {
+    dirent_t *entry_to_delete = get_entry_with_name(dd, name);
+    if (entry_to_delete == NULL) {
+      return -1;
+    }
+    journal_dirty(entry_to_delete, sizeof(dirent_t));
+    entry_to_delete->name[0] = '\0';
   }
-
-  entry_to_delete->name[0] = '\0';
+  journal_dirty(dd, sizeof(inode_t));
   dd->size -= sizeof(dirent_t);
 
   return 0;
 }
 
 dirent_t *get_entry_with_name(inode_t *dd, const char *name) {
-  dirent_t *dir_block = (dirent_t *)blocks_get_block(dd->block);
+  if (name[0] == '\0') {
+    return NULL;
+  }
+
+  if (is_hashed(dd)) {
+    uint32_t hash = name_hash(name);
+    return chain_find(dd, bucket_of(dd, hash), name, hash);
+  }
+
+  dirent_t *dir_block = get_dir_block(dd, 0);
   for (int i = 0; i < ENTRY_COUNT; i++) {
     dirent_t *entry = get_entry(dir_block, i);
-    if (entry != NULL && strcmp(entry->name, name) == 0) {
+    if (strcmp(entry->name, name) == 0) {
       return entry;
     }
   }
@@ -127,6 +584,34 @@ dirent_t *get_entry_with_name(inode_t *dd, const char *name) {
   return NULL;
 }
 
+// Returns the first slot of a directory block that can hold an entry.
+static int first_entry_slot(inode_t *dd) { return is_hashed(dd) ? 1 : 0; }
+
+/**
+ * Returns the entry of the directory `dd` at or after slot `slot` of its
+ * logical block `lblk`, and moves both past it. Walks every block of a
+ * hashed directory, buckets and overflow blocks alike, in logical order.
+ * Returns NULL when there are no more entries.
+ */
+static dirent_t *next_entry(inode_t *dd, int *lblk, int *slot) {
+  for (;;) {
+    dirent_t *dir_block = get_dir_block(dd, *lblk);
+    while (*slot < ENTRY_COUNT) {
+      dirent_t *entry = &dir_block[(*slot)++];
+      if (entry->name[0] != '\0') {
+        return entry;
+      }
+    }
+
+    extent_t ext;
+    if (!is_hashed(dd) || extent_next(dd, *lblk + 1, &ext) == -1) {
+      return NULL;
+    }
+    *lblk = ext.lblk > *lblk + 1 ? ext.lblk : *lblk + 1;
+    *slot = first_entry_slot(dd);
+  }
+}
+
 slist_t *directory_list(const char *path) {
   int inum = tree_lookup(path);
   if (inum == -1) {
@@ -134,64 +619,53 @@ slist_t *directory_list(const char *path) {
   }
 
   inode_t *dd = get_inode(inum);
-  dirent_t *dir_block = (dirent_t *)blocks_get_block(dd->block);
-  slist_t *entries;
-
-  for (int i = 0; i < ENTRY_COUNT; i++) {
-    dirent_t *entry = get_entry(dir_block, i);
-    // Exclude self and parent references and
-    // previously removed entries (empty names)
-    if (entry != NULL && strcmp(entry->name, "")) {
-      entries = s_cons(entry->name, entries);
-    }
+  slist_t *entries = NULL;
+  inode_read_lock(inum);
+  int lblk = 0;
+  int slot = first_entry_slot(dd);
+  dirent_t *entry;
+  while ((entry = next_entry(dd, &lblk, &slot)) != NULL) {
+    entries = s_cons(entry->name, entries);
   }
+  inode_unlock(inum);
 
   return entries;
 }
 
-char *get_parent_path(const char *path) {
-  if (strcmp(path, "/") == 0) {
-    return "/";
-  }
-
-  int last_dir_char;
-  for (int i = 0; i < strlen(path); i++) {
-    if (path[i] == '/') {
-      last_dir_char = i;
+dirent_t *directory_entries(int inum, int *count) {
+  inode_t *dd = get_inode(inum);
+  inode_read_lock(inum);
+
+  int capacity = 16;
+  dirent_t *entries = malloc(capacity * sizeof(dirent_t));
+  *count = 0;
+  int lblk = 0;
+  int slot = first_entry_slot(dd);
+  dirent_t *entry;
+  while (entries != NULL && (entry = next_entry(dd, &lblk, &slot)) != NULL) {
+    if (*count == capacity) {
+      capacity *= 2;
+      dirent_t *grown = realloc(entries, capacity * sizeof(dirent_t));
+      if (grown == NULL) {
+        free(entries);
+        entries = NULL;
+        break;
+      }
+      entries = grown;
     }
+    entries[(*count)++] = *entry;
   }
 
-  if (last_dir_char == 0) {
-    return "/";
-  }
-
-  char *path_to_parent = (char *)malloc(last_dir_char + 1);
-  strncpy(path_to_parent, path, last_dir_char);
-  path_to_parent[last_dir_char] = '\0';
-
-  return path_to_parent;
-}
-
-char *get_entry_name(const char *path) {
-  if (strcmp(path, "/") == 0) {
-    return "";
-  }
-
-  slist_t *path_list = s_explode(path, '/');
-  slist_t *curr = path_list;
-
-  while (curr != NULL) {
-    if (curr->next == NULL) {
-      return curr->data;
-    }
-    curr = curr->next;
-  }
+  inode_unlock(inum);
+  return entries;
 }
 
 void print_directory(inode_t *dd) {
-  dirent_t *dir_block = (dirent_t *)blocks_get_block(dd->block);
-  for (int i = 0; i < get_num_entries(dd->size); i++) {
-    printf("%s\n", get_entry(dir_block, i)->name);
+  int lblk = 0;
+  int slot = first_entry_slot(dd);
+  dirent_t *entry;
+  while ((entry = next_entry(dd, &lblk, &slot)) != NULL) {
+    printf("%s\n", entry->name);
   }
 }
 
@@ -9,14 +9,18 @@
 
 #define DIR_NAME_LENGTH 48
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
 
 typedef struct dirent {
-  char name[DIR_NAME_LENGTH];
+  char name[DIR_NAME_LENGTH];  // "" for a free slot
   int inum;
-  char _reserved[12];
+  uint32_t hash;  // hash of `name`, set in hashed directories
+  char _reserved[8];
 } dirent_t;
 
 /**
@@ -34,13 +38,36 @@ int directory_lookup(inode_t *dd, const char *name);
 
 /**
  * Given a path, returns the `inum` of that entry.
+ * Lookups are cached, so callers that change the tree must invalidate the
+ * paths they change in the dentry cache.
  * Returns -1 on error.
  */
 int tree_lookup(const char *path);
 
 /**
- * Returns a pointer to the first free `dirent_t` in the given data directory
- * block associated with the given directory inode `dd`.
+ * Splits `path` at its last '/', without copying: the parent directory is
+ * the first `parent_len` bytes of `path`, the root being "", and the entry
+ * name is the rest of `path`.
+ *
+ * Ex: "/" -> "", ""
+ * Ex: "/dir1" -> "", "dir1"
+ * Ex: "/dir1/dir2/file.txt" -> "/dir1/dir2", "file.txt"
+ *
+ * Returns a pointer to the entry name within `path`.
+ */
+const char *path_split(const char *path, size_t *parent_len);
+
+/**
+ * Resolves the parent directory of `path` and copies its entry name into
+ * `name`, in a single pass over the path.
+ * Returns the `inum` of the parent, or -1 if the parent is not a directory
+ * or the entry name is empty or too long.
+ */
+int path_lookup_parent(const char *path, char name[DIR_NAME_LENGTH]);
+
+/**
+ * Returns a pointer to the first free `dirent_t` in the data block of the
+ * given linear (not hashed) directory inode `dd`.
  * Returns NULL if none are available.
  */
 dirent_t *next_free_entry(inode_t *dd);
@@ -49,7 +76,8 @@ dirent_t *next_free_entry(inode_t *dd);
  * Adds a new entry to the given directory inode `dd`.
  * The new entry is specified by `name` and `inum`.
  * Does not allocate data block for the new entry.
- * Returns 0 on success and -1 on error.
+ * A directory that outgrows a few entries is converted to the hashed format.
+ * Returns 0 on success and -1 if the name exists or the directory is full.
  */
 int directory_put(inode_t *dd, const char *name, int inum);
 
@@ -70,6 +98,14 @@ int directory_delete(inode_t *dd, const char *name);
  */
 slist_t *directory_list(const char *path);
 
+/**
+ * Copies the entries of the directory `inum` into a new array, which the
+ * caller must free.
+ * Returns the array and sets `count` to its length, or returns NULL if out
+ * of memory.
+ */
+dirent_t *directory_entries(int inum, int *count);
+
 /**
  * Given a directory inode `dd`, prints the directory name followed by all the
  * entry names within that directory.
@@ -86,22 +122,6 @@ dirent_t *get_entry(dirent_t *dir_block, int ith_entry);
  */
 int get_num_entries(int size);
 
-/**
- * Given a path, return the path as a string
- * up to the latest parent directory.
- *
- * Ex: "/" -> "/"
- * Ex: "/dir1" -> "/"
- * Ex: "/dir1/dir2/file.txt" -> "/dir1/dir2"
- */
-char *get_parent_path(const char *path);
-
-/**
- * Returns the entry name given a `path`.
- * If the given `path` is "/", returns "".
- */
-char *get_entry_name(const char *path);
-
 /**
  * Returns the entry in the given directory inode with the specified name.
  */
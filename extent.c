@@ -0,0 +1,389 @@
+// Extent-based block mapping for inodes.
+//
+// The extent map is a B+tree keyed on logical block numbers. Its root is
+// stored inside the inode (`INODE_EXTENTS` slots), every other node fills a
+// whole disk block. Leaves (depth 0) hold extents, interior nodes hold index
+// entries pointing at their children. A full root moves its slots into a new
+// child and grows one level deeper; other full nodes split in half.
+
+#include "extent.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "journal.h"
+
+// Extents and index entries share the node slots.
+#define SLOT_SIZE sizeof(extent_t)
+#define NODE_SLOTS ((BLOCK_SIZE - sizeof(extent_header_t)) / SLOT_SIZE)
+
+_Static_assert(sizeof(extent_idx_t) == sizeof(extent_t),
+               "extent slots must be interchangeable");
+
+static void *slot(extent_header_t *eh, int i) {
+  return (char *)(eh + 1) + i * SLOT_SIZE;
+}
+
+static extent_t *leaf_entry(extent_header_t *eh, int i) { return slot(eh, i); }
+
+static extent_idx_t *index_entry(extent_header_t *eh, int i) {
+  return slot(eh, i);
+}
+
+// Both kinds of slots start with their logical block number.
+static int slot_lblk(extent_header_t *eh, int i) { return *(int *)slot(eh, i); }
+
+static extent_header_t *child_node(extent_idx_t *idx) {
+  return (extent_header_t *)blocks_get_block(idx->child);
+}
+
+static extent_header_t *root_node(inode_t *inode) {
+  return &inode->extent_root;
+}
+
+static int extent_end(const extent_t *ext) { return ext->lblk + ext->len; }
+
+// Journals the block that holds node `eh`, the inode's for the root.
+static void node_dirty(extent_header_t *eh) {
+  journal_dirty(eh, sizeof(extent_header_t));
+}
+
+/**
+ * Returns the index of the last slot of `eh` whose logical block is at most
+ * `lblk`, or -1 if every slot starts after `lblk`.
+ */
+static int node_search(extent_header_t *eh, int lblk) {
+  int lo = 0;
+  int hi = eh->count - 1;
+  int found = -1;
+
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (slot_lblk(eh, mid) <= lblk) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  return found;
+}
+
+static int node_next(extent_header_t *eh, int lblk, extent_t *ext) {
+  int i = node_search(eh, lblk);
+
+  if (eh->depth == 0) {
+    if (i >= 0 && extent_end(leaf_entry(eh, i)) > lblk) {
+      *ext = *leaf_entry(eh, i);
+      return 0;
+    }
+    if (i + 1 < eh->count) {
+      *ext = *leaf_entry(eh, i + 1);
+      return 0;
+    }
+    return -1;
+  }
+
+  // Children are never empty, so at most two of them are visited.
+  for (i = i < 0 ? 0 : i; i < eh->count; i++) {
+    if (node_next(child_node(index_entry(eh, i)), lblk, ext) == 0) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Returns the stored extent starting exactly at `lblk`, which must exist.
+ */
+static extent_t *node_find(extent_header_t *eh, int lblk) {
+  int i = node_search(eh, lblk);
+  assert(i >= 0);
+
+  if (eh->depth > 0) {
+    return node_find(child_node(index_entry(eh, i)), lblk);
+  }
+
+  assert(leaf_entry(eh, i)->lblk == lblk);
+  return leaf_entry(eh, i);
+}
+
+/**
+ * Puts `entry` into slot `i` of node `eh`, shifting the following slots.
+ * If the node is full, a root moves its slots into a new child and becomes
+ * one level deeper, while any other node is split in half.
+ * Returns 0 when done, 1 when the parent must add the index entry `split`
+ * for the new right sibling, and -1 if no block could be allocated.
+ */
+static int node_put(extent_header_t *eh, int is_root, int i, const void *entry,
+                    extent_idx_t *split) {
+  node_dirty(eh);
+  if (eh->count < eh->max) {
+    memmove(slot(eh, i + 1), slot(eh, i), (eh->count - i) * SLOT_SIZE);
+    memcpy(slot(eh, i), entry, SLOT_SIZE);
+    eh->count++;
+    return 0;
+  }
+
+  int bnum = alloc_block();
+  if (bnum == -1) {
+    return -1;
+  }
+
+  extent_header_t *node = (extent_header_t *)blocks_get_block(bnum);
+  node_dirty(node);
+  memset(node, 0, sizeof(extent_header_t));
+  node->max = NODE_SLOTS;
+  node->depth = eh->depth;
+
+  if (is_root) {
+    memcpy(slot(node, 0), slot(eh, 0), eh->count * SLOT_SIZE);
+    node->count = eh->count;
+    node_put(node, 0, i, entry, NULL);
+
+    eh->depth++;
+    eh->count = 1;
+    extent_idx_t *idx = index_entry(eh, 0);
+    memset(idx, 0, SLOT_SIZE);
+    idx->lblk = slot_lblk(node, 0);
+    idx->child = bnum;
+    return 0;
+  }
+
+  int half = eh->count / 2;
+  memcpy(slot(node, 0), slot(eh, half), (eh->count - half) * SLOT_SIZE);
+  node->count = eh->count - half;
+  eh->count = half;
+
+  if (i <= half) {
+    node_put(eh, 0, i, entry, NULL);
+  } else {
+    node_put(node, 0, i - half, entry, NULL);
+  }
+
+  memset(split, 0, SLOT_SIZE);
+  split->lblk = slot_lblk(node, 0);
+  split->child = bnum;
+  return 1;
+}
+
+static int node_insert(extent_header_t *eh, int is_root, const extent_t *ext,
+                       extent_idx_t *split) {
+  int i = node_search(eh, ext->lblk);
+
+  if (eh->depth == 0) {
+    if (i >= 0) {
+      extent_t *prev = leaf_entry(eh, i);
+      if (extent_end(prev) == ext->lblk &&
+          prev->pblk + prev->len == ext->pblk && prev->flags == 0 &&
+          ext->flags == 0) {
+        node_dirty(eh);
+        prev->len += ext->len;
+        return 0;
+      }
+    }
+    return node_put(eh, is_root, i + 1, ext, split);
+  }
+
+  if (i < 0) {
+    // The new extent becomes the smallest key of the first child.
+    i = 0;
+    node_dirty(eh);
+    index_entry(eh, 0)->lblk = ext->lblk;
+  }
+
+  extent_idx_t child_split;
+  int rv = node_insert(child_node(index_entry(eh, i)), 0, ext, &child_split);
+  if (rv != 1) {
+    return rv;
+  }
+
+  return node_put(eh, is_root, i + 1, &child_split, split);
+}
+
+/**
+ * Removes the extent starting exactly at `lblk` from the subtree `eh`,
+ * freeing the nodes that become empty.
+ * Returns 1 if `eh` itself became empty and 0 otherwise.
+ */
+static int node_delete(extent_header_t *eh, int lblk) {
+  int i = node_search(eh, lblk);
+  assert(i >= 0);
+
+  if (eh->depth > 0) {
+    extent_idx_t *idx = index_entry(eh, i);
+    if (!node_delete(child_node(idx), lblk)) {
+      return 0;
+    }
+    free_block(idx->child);
+  } else {
+    assert(leaf_entry(eh, i)->lblk == lblk);
+  }
+
+  node_dirty(eh);
+  memmove(slot(eh, i), slot(eh, i + 1), (eh->count - i - 1) * SLOT_SIZE);
+  eh->count--;
+  return eh->count == 0;
+}
+
+void extent_init(inode_t *inode) {
+  extent_header_t *root = root_node(inode);
+  node_dirty(root);
+  memset(root, 0, sizeof(extent_header_t) + INODE_EXTENTS * SLOT_SIZE);
+  root->max = INODE_EXTENTS;
+}
+
+int extent_next(inode_t *inode, int lblk, extent_t *ext) {
+  return node_next(root_node(inode), lblk, ext);
+}
+
+int extent_blocks(const extent_t *ext) {
+  if (ext->flags & EXTENT_COMPRESSED) {
+    return (EXTENT_CSIZE(ext) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  }
+  return ext->len;
+}
+
+int extent_map(inode_t *inode, int lblk, int *run) {
+  extent_t ext;
+  int found = extent_next(inode, lblk, &ext) == 0;
+
+  if (found && ext.lblk <= lblk) {
+    if (run != NULL) {
+      *run = extent_end(&ext) - lblk;
+    }
+    if (ext.flags & EXTENT_COMPRESSED) {
+      return -1;
+    }
+    return ext.pblk + (lblk - ext.lblk);
+  }
+
+  // `lblk` is in a hole, which lasts until the next extent.
+  if (run != NULL) {
+    *run = found ? ext.lblk - lblk : EXTENT_MAX_LBLK - lblk;
+  }
+  return 0;
+}
+
+int extent_insert(inode_t *inode, int lblk, int pblk, int len) {
+  extent_t ext = {.lblk = lblk, .pblk = pblk, .len = len, .flags = 0};
+  return node_insert(root_node(inode), 1, &ext, NULL);
+}
+
+int extent_insert_compressed(inode_t *inode, int lblk, int pblk, int len,
+                             int csize) {
+  extent_t ext = {.lblk = lblk,
+                  .pblk = pblk,
+                  .len = len,
+                  .flags = EXTENT_COMPRESSED | csize << EXTENT_CSIZE_SHIFT};
+  return node_insert(root_node(inode), 1, &ext, NULL);
+}
+
+void extent_decompressed(inode_t *inode, int lblk, int pblk) {
+  extent_t *stored = node_find(root_node(inode), lblk);
+  assert(stored->flags & EXTENT_COMPRESSED);
+  int old_pblk = stored->pblk;
+  int old_blocks = extent_blocks(stored);
+
+  journal_dirty(stored, sizeof(extent_t));
+  stored->pblk = pblk;
+  stored->flags = 0;
+  free_blocks(old_pblk, old_blocks);
+}
+
+int extent_replace(inode_t *inode, int lblk, int len, int pblk) {
+  extent_header_t *root = root_node(inode);
+  int end = lblk + len;
+  extent_t ext;
+  int found = extent_next(inode, lblk, &ext) == 0;
+  assert(found && ext.lblk <= lblk && end <= extent_end(&ext) &&
+         ext.flags == 0);
+
+  // Insert the pieces past the start of the extent first, so a failed
+  // allocation leaves the map untouched.
+  if (end < extent_end(&ext)) {
+    extent_t tail = {.lblk = end,
+                     .pblk = ext.pblk + (end - ext.lblk),
+                     .len = extent_end(&ext) - end,
+                     .flags = 0};
+    if (node_insert(root, 1, &tail, NULL) == -1) {
+      return -1;
+    }
+  }
+  if (lblk > ext.lblk) {
+    extent_t moved = {.lblk = lblk, .pblk = pblk, .len = len, .flags = 0};
+    if (node_insert(root, 1, &moved, NULL) == -1) {
+      if (end < extent_end(&ext)) {
+        node_delete(root, end);
+      }
+      return -1;
+    }
+  }
+
+  extent_t *stored = node_find(root, ext.lblk);
+  journal_dirty(stored, sizeof(extent_t));
+  if (lblk > ext.lblk) {
+    stored->len = lblk - ext.lblk;
+  } else {
+    stored->pblk = pblk;
+    stored->len = len;
+  }
+  return 0;
+}
+
+int extent_remove(inode_t *inode, int lblk, int len) {
+  extent_header_t *root = root_node(inode);
+  int end = len >= EXTENT_MAX_LBLK - lblk ? EXTENT_MAX_LBLK : lblk + len;
+  extent_t ext;
+
+  while (lblk < end && extent_next(inode, lblk, &ext) == 0 &&
+         ext.lblk < end) {
+    int from = ext.lblk > lblk ? ext.lblk : lblk;
+    int to = extent_end(&ext) < end ? extent_end(&ext) : end;
+
+    if (ext.flags & EXTENT_COMPRESSED) {
+      assert(from == ext.lblk && to == extent_end(&ext));
+      if (node_delete(root, ext.lblk)) {
+        extent_init(inode);
+      }
+      free_blocks(ext.pblk, extent_blocks(&ext));
+      lblk = to;
+      continue;
+    }
+
+    // Punching a hole in the middle splits the extent. Insert the tail
+    // first, so a failed allocation leaves the map untouched.
+    if (from > ext.lblk && to < extent_end(&ext)) {
+      extent_t tail = {.lblk = to,
+                       .pblk = ext.pblk + (to - ext.lblk),
+                       .len = extent_end(&ext) - to,
+                       .flags = ext.flags};
+      if (node_insert(root, 1, &tail, NULL) == -1) {
+        return -1;
+      }
+    }
+
+    if (from > ext.lblk) {
+      extent_t *stored = node_find(root, ext.lblk);
+      journal_dirty(stored, sizeof(extent_t));
+      stored->len = from - ext.lblk;
+    } else if (to < extent_end(&ext)) {
+      extent_t *stored = node_find(root, ext.lblk);
+      journal_dirty(stored, sizeof(extent_t));
+      stored->lblk = to;
+      stored->pblk += to - ext.lblk;
+      stored->len = extent_end(&ext) - to;
+    } else if (node_delete(root, ext.lblk)) {
+      extent_init(inode);
+    }
+
+    free_blocks(ext.pblk + (from - ext.lblk), to - from);
+    lblk = to;
+  }
+
+  return 0;
+}
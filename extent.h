@@ -0,0 +1,126 @@
+// Extent-based block mapping for inodes.
+//
+// A file's logical blocks are mapped to physical blocks by a sorted list of
+// extents (runs of contiguous blocks). Small files keep their extents inline in
+// the inode; fragmented files grow a B+tree of extent nodes whose root lives in
+// the inode. Mapping an offset to a block takes O(log n) in the number of
+// extents, no matter how large the file is.
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <limits.h>
+
+/**
+ * Maps `len` logical blocks starting at `lblk` to the physical blocks
+ * starting at `pblk`.
+ */
+typedef struct extent {
+  int lblk;   // first logical block of the file covered by this extent
+  int pblk;   // first physical block on disk
+  int len;    // number of blocks
+  int flags;  // EXTENT_* flags, and the compressed size if compressed
+} extent_t;
+
+// The extent holds its `len` blocks compressed, in the fewest physical
+// blocks that fit EXTENT_CSIZE() bytes. Compressed extents are never
+// merged, and can only be removed whole.
+#define EXTENT_COMPRESSED 0x1
+#define EXTENT_CSIZE_SHIFT 8
+#define EXTENT_CSIZE(ext) ((ext)->flags >> EXTENT_CSIZE_SHIFT)
+
+/**
+ * An index entry of an interior extent tree node.
+ * Has the same size as `extent_t` so both fit the same node slots.
+ */
+typedef struct extent_idx {
+  int lblk;   // smallest logical block that may be found in the child
+  int child;  // block number of the child node
+  int _reserved[2];
+} extent_idx_t;
+
+/**
+ * Header of an extent tree node. A node is a header followed by `max` slots
+ * of either extents (depth 0) or index entries (depth > 0).
+ */
+typedef struct extent_header {
+  short count;  // slots in use
+  short max;    // slots available
+  short depth;  // 0 if the slots hold extents
+  short _reserved;
+} extent_header_t;
+
+// Number of extent slots in the tree root stored inside an inode.
+#define INODE_EXTENTS 6
+
+// Logical block used to mean "until the end of the file".
+#define EXTENT_MAX_LBLK INT_MAX
+
+struct inode;
+
+/**
+ * Initializes an empty extent map in the given `inode`.
+ */
+void extent_init(struct inode *inode);
+
+/**
+ * Finds the first extent of `inode` that ends after logical block `lblk`,
+ * i.e. the extent containing `lblk` or, if `lblk` is in a hole, the next one.
+ * Returns 0 and fills `ext` on success, -1 if there is no such extent.
+ */
+int extent_next(struct inode *inode, int lblk, extent_t *ext);
+
+/**
+ * Returns the number of physical blocks that back `ext`.
+ */
+int extent_blocks(const extent_t *ext);
+
+/**
+ * Maps logical block `lblk` of `inode` to a physical block.
+ * If `run` is not NULL, it is set to the number of blocks from `lblk` that
+ * are mapped contiguously on disk, or that are left in a compressed extent.
+ * Returns the physical block number, -1 if `lblk` is in a compressed extent,
+ * or 0 if `lblk` is not mapped.
+ */
+int extent_map(struct inode *inode, int lblk, int *run);
+
+/**
+ * Maps the unmapped logical blocks [`lblk`, `lblk` + `len`) of `inode` to
+ * the physical blocks starting at `pblk`. Merges with the preceding extent
+ * when both are contiguous.
+ * Returns 0 on success and -1 if no block was left for the extent tree.
+ */
+int extent_insert(struct inode *inode, int lblk, int pblk, int len);
+
+/**
+ * Same as extent_insert(), for `len` blocks compressed into `csize` bytes
+ * at the physical blocks starting at `pblk`.
+ */
+int extent_insert_compressed(struct inode *inode, int lblk, int pblk, int len,
+                             int csize);
+
+/**
+ * Moves the compressed extent starting at `lblk` of `inode` to the
+ * uncompressed blocks starting at `pblk`, freeing the blocks it held.
+ */
+void extent_decompressed(struct inode *inode, int lblk, int pblk);
+
+/**
+ * Remaps the logical blocks [`lblk`, `lblk` + `len`) of `inode`, which lie
+ * in one uncompressed extent, to the physical blocks starting at `pblk`.
+ * The blocks they were mapped to are left allocated.
+ * Returns 0 on success and -1 if no block was left for the extent tree, in
+ * which case nothing changed.
+ */
+int extent_replace(struct inode *inode, int lblk, int len, int pblk);
+
+/**
+ * Unmaps the logical blocks [`lblk`, `lblk` + `len`) of `inode` and frees
+ * the physical blocks that backed them. Pass `EXTENT_MAX_LBLK` as `len` to
+ * unmap everything from `lblk` to the end of the file. Compressed extents
+ * must lie entirely inside or outside of the range.
+ * Returns 0 on success and -1 if no block was left for the extent tree.
+ */
+int extent_remove(struct inode *inode, int lblk, int len);
+
+#endif
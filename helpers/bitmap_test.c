@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <stdio.h>
 
 #include "bitmap.h"
@@ -26,5 +27,45 @@ int main(int argc, char **argv) {
   bitmap_put(bm, 255, 1);
   bitmap_print(bm, SIZE);
 
+  printf("\nSetting bits 3-70: \n");
+  bitmap_put_range(bm, 3, 68, 1);
+  bitmap_print(bm, SIZE);
+
+  // Set: 0, 2-70 and 255.
+  assert(bitmap_get(bm, 0) && !bitmap_get(bm, 1) && bitmap_get(bm, 2));
+  assert(bitmap_get(bm, 3) && bitmap_get(bm, 70) && !bitmap_get(bm, 71));
+  assert(!bitmap_get(bm, 254) && bitmap_get(bm, 255));
+  assert(bitmap_count(bm, SIZE) == 71);
+  assert(bitmap_find_zero(bm, SIZE, 0) == 1);
+  assert(bitmap_find_zero(bm, SIZE, 2) == 71);
+  assert(bitmap_find_zero(bm, SIZE, 250) == 250);
+  assert(bitmap_find_run(bm, SIZE, 0, 100) == 71);
+  assert(bitmap_find_run(bm, SIZE, 0, 185) == -1);
+
+  bitmap_summary_t sum;
+  bitmap_summary_init(&sum, bm, SIZE);
+  printf("\nClearing bits 10-19 through the summary: \n");
+  bitmap_summary_put(&sum, 10, 10, 0);
+  bitmap_print(bm, SIZE);
+  assert(bitmap_count(bm, SIZE) == 61);
+  assert(!bitmap_get(bm, 10) && !bitmap_get(bm, 19) && bitmap_get(bm, 20));
+  assert(bitmap_summary_find_zero(&sum, 5) == 10);
+  assert(bitmap_summary_find_run(&sum, 0, 8) == 10);
+  assert(bitmap_summary_find_run(&sum, 0, 11) == 71);
+  assert(bitmap_summary_run_length(&sum, 12, 100) == 8);
+  assert(bitmap_summary_run_length(&sum, 20, 100) == 0);
+
+  // The longest run is 71-254; a search for a shorter one stops at it.
+  int len;
+  assert(bitmap_summary_find_longest(&sum, 1000, &len) == 71 && len == 184);
+  assert(bitmap_summary_find_longest(&sum, 50, &len) == 71 && len == 50);
+
+  // Filling every bit leaves nothing to find.
+  bitmap_summary_put(&sum, 0, SIZE, 1);
+  assert(bitmap_count(bm, SIZE) == SIZE);
+  assert(bitmap_summary_find_zero(&sum, 0) == -1);
+  assert(bitmap_summary_find_run(&sum, 0, 1) == -1);
+  bitmap_summary_free(&sum);
+
   return 0;
 }
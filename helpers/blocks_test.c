@@ -6,7 +6,9 @@
 #define TEST_NAME "block_test.img"
 
 int main(int argc, char **argv) {
-  blocks_init(TEST_NAME);
+  if (blocks_init(TEST_NAME) != 0) {
+    return 1;
+  }
 
   printf("Block bitmap at the beginning:\n");
   bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
@@ -0,0 +1,113 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+
+// Room for incompressible input: a token byte, and one length byte per 255
+// literals.
+#define BOUND(len) ((len) + (len) / 255 + 16)
+
+/**
+ * Compresses the `len` bytes at `src` and decompresses them back.
+ * Returns the compressed size.
+ */
+static size_t round_trip(const void *src, size_t len) {
+  uint8_t *packed = malloc(BOUND(len));
+  uint8_t *out = malloc(len + 1);
+  size_t csize = compress_encode(src, len, packed, BOUND(len));
+  assert(csize > 0);
+  assert(compress_decode(packed, csize, out, len) == (long)len);
+  assert(memcmp(src, out, len) == 0);
+
+  // Decoding into too little room fails rather than overflowing.
+  if (len > 0) {
+    assert(compress_decode(packed, csize, out, len - 1) == -1);
+  }
+  free(packed);
+  free(out);
+  return csize;
+}
+
+static long decode(const uint8_t *src, size_t len) {
+  uint8_t out[64];
+  return compress_decode(src, len, out, sizeof(out));
+}
+
+int main(int argc, char **argv) {
+  size_t max = COMPRESS_MAX_INPUT;
+  uint8_t *buf = calloc(1, max);
+
+  // Empty input is a single empty token.
+  assert(round_trip(buf, 0) == 1);
+  assert(compress_encode(buf, 0, buf, 0) == 0);
+
+  // Incompressible input, of the largest size, is stored as literals and
+  // does not fit in less room than it takes.
+  srand(1);
+  for (size_t i = 0; i < max; i++) {
+    buf[i] = rand();
+  }
+  assert(!compress_worthwhile(buf, max));
+  assert(round_trip(buf, max) > max);
+  uint8_t *small = malloc(max);
+  assert(compress_encode(buf, max, small, max - 1) == 0);
+  free(small);
+
+  // Compressible input of the largest size: numbered lines of text.
+  for (size_t i = 0; i < max;) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "line %zu of the test input\n", i);
+    size_t take = max - i < (size_t)n ? max - i : (size_t)n;
+    memcpy(buf + i, line, take);
+    i += take;
+  }
+  assert(compress_worthwhile(buf, max));
+  assert(round_trip(buf, max) < max / 4);
+
+  // Matches overlapping their own output: runs of one byte, and of a
+  // short pattern, at lengths around where the token spills.
+  for (size_t len = 1; len < 600; len++) {
+    memset(buf, 'z', len);
+    round_trip(buf, len);
+    for (size_t i = 0; i < len; i++) {
+      buf[i] = "abc"[i % 3];
+    }
+    round_trip(buf, len);
+  }
+  memset(buf, 0, max);
+  assert(round_trip(buf, max) < 300);
+
+  // A literal and a match of 4 at offset 1, which overlaps.
+  const uint8_t valid[] = {0x10, 'a', 1, 0};
+  assert(decode(valid, sizeof(valid)) == 5);
+
+  // Streams that end early.
+  const uint8_t short_literals[] = {0x30, 'a'};
+  assert(decode(short_literals, sizeof(short_literals)) == -1);
+  const uint8_t short_offset[] = {0x10, 'a', 1};
+  assert(decode(short_offset, sizeof(short_offset)) == -1);
+  const uint8_t no_literal_length[] = {0xf0};
+  assert(decode(no_literal_length, sizeof(no_literal_length)) == -1);
+  const uint8_t no_match_length[] = {0x1f, 'a', 1, 0};
+  assert(decode(no_match_length, sizeof(no_match_length)) == -1);
+  const uint8_t long_literal_length[] = {0xf0, 255, 255};
+  assert(decode(long_literal_length, sizeof(long_literal_length)) == -1);
+
+  // Offsets before the start of the output, or of 0.
+  const uint8_t far_offset[] = {0x10, 'a', 2, 0};
+  assert(decode(far_offset, sizeof(far_offset)) == -1);
+  const uint8_t zero_offset[] = {0x10, 'a', 0, 0};
+  assert(decode(zero_offset, sizeof(zero_offset)) == -1);
+  const uint8_t huge_offset[] = {0x00, 0xff, 0xff};
+  assert(decode(huge_offset, sizeof(huge_offset)) == -1);
+
+  // A match longer than the room left.
+  const uint8_t long_match[] = {0x1f, 'a', 1, 0, 200};
+  assert(decode(long_match, sizeof(long_match)) == -1);
+
+  free(buf);
+  return 0;
+}
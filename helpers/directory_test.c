@@ -0,0 +1,129 @@
+// Fills a directory well past the linear format and through many bucket
+// splits, then checks that every entry can still be looked up, listed and
+// removed, before and after remounting.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "directory.h"
+#include "storage.h"
+
+#define TEST_NAME "directory_test.img"
+
+// Enough entries to split buckets many times over.
+#define ENTRIES 1500
+
+static int inums[ENTRIES];
+
+static void entry_path(char *path, int i) { sprintf(path, "/d/entry-%d", i); }
+
+// Returns the index of the entry `name`, or -1 if it is not one.
+static int entry_index(const char *name) {
+  int i;
+  char rest;
+  if (sscanf(name, "entry-%d%c", &i, &rest) != 1 || i < 0 || i >= ENTRIES) {
+    return -1;
+  }
+  return i;
+}
+
+// Checks that /d holds exactly the entries with `present` set.
+static void check_entries(const char *present) {
+  char path[64];
+  int expected = 0;
+  for (int i = 0; i < ENTRIES; i++) {
+    entry_path(path, i);
+    if (present[i]) {
+      assert(tree_lookup(path) == inums[i]);
+      expected++;
+    } else {
+      assert(tree_lookup(path) == -1);
+    }
+  }
+
+  int count;
+  dirent_t *entries = storage_list_inum(tree_lookup("/d"), "/d", &count);
+  assert(entries != NULL && count == expected);
+  char *seen = calloc(ENTRIES, 1);
+  for (int i = 0; i < count; i++) {
+    int index = entry_index(entries[i].name);
+    assert(index != -1 && present[index] && !seen[index]);
+    assert(entries[i].inum == inums[index]);
+    seen[index] = 1;
+  }
+  free(seen);
+  free(entries);
+}
+
+int main(int argc, char **argv) {
+  // Room for an inode per entry.
+  int fd = open(TEST_NAME, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  assert(fd != -1 && ftruncate(fd, 32 << 20) == 0);
+  close(fd);
+  assert(storage_init(TEST_NAME) == 0);
+
+  assert(storage_mknod("/d", 040755) == 0);
+  char path[64];
+  char present[ENTRIES];
+  for (int i = 0; i < ENTRIES; i++) {
+    entry_path(path, i);
+    assert(storage_mknod(path, 0100644) == 0);
+    inums[i] = tree_lookup(path);
+    assert(inums[i] != -1);
+    present[i] = 1;
+  }
+  entry_path(path, 0);
+  assert(storage_mknod(path, 0100644) == -EEXIST);
+
+  // A bucket holds 63 entries and splits at 75% load.
+  struct stat st;
+  assert(storage_stat("/d", &st) == 0);
+  assert(st.st_size == ENTRIES * sizeof(dirent_t));
+  assert(st.st_blocks * 512 / BLOCK_SIZE >= ENTRIES / 63);
+  printf("%d entries in %ld blocks\n", ENTRIES,
+         (long)(st.st_blocks * 512 / BLOCK_SIZE));
+  check_entries(present);
+
+  // Remove every third entry, so that every bucket loses some.
+  for (int i = 0; i < ENTRIES; i += 3) {
+    entry_path(path, i);
+    assert(storage_unlink(path) == 0);
+    assert(storage_unlink(path) != 0);
+    present[i] = 0;
+  }
+  check_entries(present);
+
+  blocks_free();
+  assert(storage_init(TEST_NAME) == 0);
+  check_entries(present);
+
+  // Put them back, with new inodes.
+  for (int i = 0; i < ENTRIES; i += 3) {
+    entry_path(path, i);
+    assert(storage_mknod(path, 0100644) == 0);
+    inums[i] = tree_lookup(path);
+    present[i] = 1;
+  }
+  check_entries(present);
+
+  // Empty the directory, then remove it.
+  for (int i = 0; i < ENTRIES; i++) {
+    entry_path(path, i);
+    assert(storage_unlink(path) == 0);
+    present[i] = 0;
+  }
+  check_entries(present);
+  assert(storage_unlink("/d") == 0);
+  assert(tree_lookup("/d") == -1);
+
+  blocks_free();
+  unlink(TEST_NAME);
+  return 0;
+}
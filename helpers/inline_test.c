@@ -0,0 +1,125 @@
+// Grows files across the inline limit and truncates them back, checking
+// their contents and where they are stored at every step.
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "storage.h"
+
+#define TEST_NAME "inline_test.img"
+
+// Largest file the tests write.
+#define MAX_SIZE 600
+
+// What each file should hold, and how long it is.
+static char expected[MAX_SIZE];
+static off_t expected_size;
+
+static void fill(char *buf, size_t n, int seed) {
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = 'a' + (seed + i) % 26;
+  }
+}
+
+// Checks that `path` holds `expected`, and is stored in blocks or not.
+static void check(const char *path, int in_blocks) {
+  char buf[MAX_SIZE + 10];
+  memset(buf, 'x', sizeof(buf));
+  assert(storage_read(path, buf, sizeof(buf), 0) == expected_size);
+  assert(memcmp(buf, expected, expected_size) == 0);
+
+  struct stat st;
+  assert(storage_flush(storage_open(path)) == 0);
+  assert(storage_stat(path, &st) == 0 && st.st_size == expected_size);
+  assert((st.st_blocks > 0) == in_blocks);
+}
+
+static void write_expected(const char *path, const char *buf, size_t n,
+                           off_t offset) {
+  assert(storage_write(path, buf, n, offset) == (int)n);
+  memcpy(expected + offset, buf, n);
+  if (offset + (off_t)n > expected_size) {
+    expected_size = offset + n;
+  }
+}
+
+static void truncate_expected(const char *path, off_t size) {
+  assert(storage_truncate(path, size) == 0);
+  if (size > expected_size) {
+    memset(expected + expected_size, 0, size - expected_size);
+  }
+  expected_size = size;
+}
+
+int main(int argc, char **argv) {
+  char buf[MAX_SIZE];
+  unlink(TEST_NAME);
+  assert(storage_init(TEST_NAME) == 0);
+
+  // Up to the limit, the file stays in its inode.
+  assert(storage_mknod("/grow", 0100644) == 0);
+  expected_size = 0;
+  fill(buf, INODE_INLINE_SIZE, 0);
+  write_expected("/grow", buf, 100, 0);
+  check("/grow", 0);
+  write_expected("/grow", buf + 100, INODE_INLINE_SIZE - 100, 100);
+  check("/grow", 0);
+
+  // One byte past it moves the contents to a block.
+  fill(buf, 1, 7);
+  write_expected("/grow", buf, 1, INODE_INLINE_SIZE);
+  check("/grow", 1);
+
+  // A write straddling the limit from the start.
+  assert(storage_mknod("/straddle", 0100644) == 0);
+  expected_size = 0;
+  fill(buf, 100, 3);
+  write_expected("/straddle", buf, 100, 0);
+  fill(buf, 200, 5);
+  write_expected("/straddle", buf, 200, 90);
+  check("/straddle", 1);
+
+  // Truncating back below the limit keeps the block, and the bytes up to
+  // the new end; growing again reads zeros past it.
+  truncate_expected("/straddle", 50);
+  check("/straddle", 1);
+  truncate_expected("/straddle", 400);
+  check("/straddle", 1);
+  fill(buf, 20, 11);
+  write_expected("/straddle", buf, 20, 10);
+  check("/straddle", 1);
+
+  // An inline file grown by truncation stays inline, its tail a hole, and
+  // shrinking it does not bring back what was cut.
+  assert(storage_mknod("/sparse", 0100644) == 0);
+  expected_size = 0;
+  fill(buf, 60, 13);
+  write_expected("/sparse", buf, 60, 0);
+  truncate_expected("/sparse", MAX_SIZE);
+  check("/sparse", 0);
+  truncate_expected("/sparse", 20);
+  truncate_expected("/sparse", 100);
+  check("/sparse", 0);
+
+  // Writing past the limit moves what the inode held to a block.
+  fill(buf, 10, 17);
+  write_expected("/sparse", buf, 10, 300);
+  check("/sparse", 1);
+
+  // Everything holds after remounting.
+  blocks_free();
+  assert(storage_init(TEST_NAME) == 0);
+  check("/sparse", 1);
+
+  assert(storage_unlink("/grow") == 0);
+  assert(storage_unlink("/straddle") == 0);
+  assert(storage_unlink("/sparse") == 0);
+  blocks_free();
+  unlink(TEST_NAME);
+  return 0;
+}
@@ -0,0 +1,201 @@
+// Crashes between a commit and its checkpoint, by mounting a copy of the
+// image taken before the commit with only the journal taken after it, and
+// checks that the last record is replayed whole, or ignored if torn. Then
+// runs transactions side by side on an image whose journal has room for few
+// of them at a time.
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "directory.h"
+#include "storage.h"
+
+#define TEST_NAME "journal_test.img"
+#define SMALL_NAME "journal_small.img"
+#define CRASH_NAME "journal_crash.img"
+#define IMAGE_SIZE (8 << 20)
+
+#define DATA_SIZE 6000
+
+static char data[DATA_SIZE];
+
+static char *read_image(const char *path) {
+  char *image = malloc(IMAGE_SIZE);
+  int fd = open(path, O_RDONLY);
+  assert(image != NULL && fd != -1);
+  assert(pread(fd, image, IMAGE_SIZE, 0) == IMAGE_SIZE);
+  close(fd);
+  return image;
+}
+
+static void write_image(const char *path, const char *image) {
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  assert(fd != -1);
+  assert(pwrite(fd, image, IMAGE_SIZE, 0) == IMAGE_SIZE);
+  close(fd);
+}
+
+// The state of the first commit: /a, holding `data`, and an empty /d.
+static void check_first(void) {
+  char buf[DATA_SIZE];
+  assert(storage_read("/a", buf, DATA_SIZE, 0) == DATA_SIZE);
+  assert(memcmp(buf, data, DATA_SIZE) == 0);
+  assert(tree_lookup("/d") != -1);
+  assert(tree_lookup("/b") == -1);
+  assert(tree_lookup("/d/a") == -1);
+}
+
+// The state of the second commit: /a moved to /d/a, and /b holding "hello".
+static void check_second(void) {
+  char buf[DATA_SIZE];
+  assert(tree_lookup("/a") == -1);
+  assert(storage_read("/d/a", buf, DATA_SIZE, 0) == DATA_SIZE);
+  assert(memcmp(buf, data, DATA_SIZE) == 0);
+  assert(storage_read("/b", buf, sizeof(buf), 0) == 5);
+  assert(memcmp(buf, "hello", 5) == 0);
+}
+
+#define THREADS 8
+#define FILES 6
+
+// Creates FILES files in the directory /`arg`, writes to each and renames
+// it.
+static void *make_files(void *arg) {
+  long t = (long)arg;
+  char path[64];
+  char moved[64];
+  for (int i = 0; i < FILES; i++) {
+    snprintf(path, sizeof(path), "/%ld/%d", t, i);
+    snprintf(moved, sizeof(moved), "/%ld/moved-%d", t, i);
+    assert(storage_mknod(path, 0100644) == 0);
+    assert(storage_write(path, data, DATA_SIZE - i, 0) == DATA_SIZE - i);
+    assert(storage_rename(path, moved) == 0);
+  }
+  return NULL;
+}
+
+// A 1 MiB image has a 16-block journal, which only ever holds one group
+// of transactions: commits make room for the next one as they go.
+static void test_small_journal(void) {
+  int fd = open(SMALL_NAME, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  assert(fd != -1 && ftruncate(fd, 1 << 20) == 0);
+  close(fd);
+  assert(storage_init(SMALL_NAME) == 0);
+  assert(get_superblock()->journal_blocks == 16);
+
+  pthread_t threads[THREADS];
+  for (long t = 0; t < THREADS; t++) {
+    char dir[16];
+    snprintf(dir, sizeof(dir), "/%ld", t);
+    assert(storage_mknod(dir, 040755) == 0);
+  }
+  for (long t = 0; t < THREADS; t++) {
+    assert(pthread_create(&threads[t], NULL, make_files, (void *)t) == 0);
+  }
+  for (int t = 0; t < THREADS; t++) {
+    assert(pthread_join(threads[t], NULL) == 0);
+  }
+  blocks_free();
+
+  assert(storage_init(SMALL_NAME) == 0);
+  char path[64];
+  char buf[DATA_SIZE];
+  for (int t = 0; t < THREADS; t++) {
+    for (int i = 0; i < FILES; i++) {
+      snprintf(path, sizeof(path), "/%d/%d", t, i);
+      assert(tree_lookup(path) == -1);
+      snprintf(path, sizeof(path), "/%d/moved-%d", t, i);
+      assert(storage_read(path, buf, sizeof(buf), 0) == DATA_SIZE - i);
+      assert(memcmp(buf, data, DATA_SIZE - i) == 0);
+    }
+  }
+  blocks_free();
+  unlink(SMALL_NAME);
+}
+
+int main(int argc, char **argv) {
+  // Commit only when asked to.
+  setenv("NUFS_COMMIT_INTERVAL", "3600000", 1);
+  for (int i = 0; i < DATA_SIZE; i++) {
+    data[i] = i * 7 + i / 4096;
+  }
+
+  int fd = open(TEST_NAME, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  assert(fd != -1 && ftruncate(fd, IMAGE_SIZE) == 0);
+  close(fd);
+  assert(storage_init(TEST_NAME) == 0);
+  int journal_bnum = get_superblock()->journal_bnum;
+  int journal_blocks = get_superblock()->journal_blocks;
+
+  assert(storage_mknod("/a", 0100644) == 0);
+  assert(storage_write("/a", data, DATA_SIZE, 0) == DATA_SIZE);
+  assert(storage_mknod("/d", 040755) == 0);
+  assert(blocks_sync() == 0);
+  char *before = read_image(TEST_NAME);
+
+  // Only metadata changes, an inline file among them, so that the record
+  // holds all of the second commit.
+  assert(storage_mknod("/b", 0100644) == 0);
+  assert(storage_write("/b", "hello", 5, 0) == 5);
+  assert(storage_rename("/a", "/d/a") == 0);
+  assert(blocks_sync() == 0);
+  char *after = read_image(TEST_NAME);
+  blocks_free();
+
+  // The blocks of the second record, the last one written.
+  int record[journal_blocks];
+  int count = 0;
+  for (int b = journal_bnum; b < journal_bnum + journal_blocks; b++) {
+    size_t off = (size_t)b * BLOCK_SIZE;
+    if (memcmp(before + off, after + off, BLOCK_SIZE) != 0) {
+      record[count++] = b;
+    }
+  }
+  assert(count >= 2);
+  char *crash = malloc(IMAGE_SIZE);
+
+  // Torn: the last logged block never made it. The record before is
+  // replayed instead, which changes nothing.
+  memcpy(crash, before, IMAGE_SIZE);
+  for (int i = 0; i < count - 1; i++) {
+    size_t off = (size_t)record[i] * BLOCK_SIZE;
+    memcpy(crash + off, after + off, BLOCK_SIZE);
+  }
+  write_image(CRASH_NAME, crash);
+  assert(storage_init(CRASH_NAME) == 0);
+  check_first();
+  blocks_free();
+
+  // Whole, but nothing written in place: replaying it finishes the commit.
+  memcpy(crash, before, IMAGE_SIZE);
+  for (int i = 0; i < count; i++) {
+    size_t off = (size_t)record[i] * BLOCK_SIZE;
+    memcpy(crash + off, after + off, BLOCK_SIZE);
+  }
+  write_image(CRASH_NAME, crash);
+  assert(storage_init(CRASH_NAME) == 0);
+  check_second();
+
+  // What happens after the replay is not undone by replaying again.
+  assert(storage_unlink("/b") == 0);
+  blocks_free();
+  assert(storage_init(CRASH_NAME) == 0);
+  assert(tree_lookup("/b") == -1);
+  assert(tree_lookup("/d/a") != -1);
+  blocks_free();
+
+  free(before);
+  free(after);
+  free(crash);
+  unlink(TEST_NAME);
+  unlink(CRASH_NAME);
+
+  test_small_journal();
+  return 0;
+}
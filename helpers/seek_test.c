@@ -0,0 +1,139 @@
+// Looks for data and holes, as the SEEK_DATA and SEEK_HOLE ioctls do, in
+// sparse, preallocated, inline and compressed files.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "storage.h"
+
+#define TEST_NAME "seek_test.img"
+
+#define BLOCK 4096
+
+static char buf[64 * BLOCK];
+
+static off_t seek_data(int inum, off_t offset) {
+  return storage_seek_inum(inum, offset, 0);
+}
+
+static off_t seek_hole(int inum, off_t offset) {
+  return storage_seek_inum(inum, offset, 1);
+}
+
+static int make_file(const char *path) {
+  assert(storage_mknod(path, 0100644) == 0);
+  int inum = storage_open(path);
+  assert(inum >= 0);
+  return inum;
+}
+
+static blkcnt_t blocks_of(int inum) {
+  struct stat st;
+  assert(storage_stat_inum(inum, &st) == 0);
+  return st.st_blocks * 512 / BLOCK;
+}
+
+// Data in blocks 0-1 and 10, a hole in between, and the end of the file
+// in the middle of block 10.
+static void check_sparse(int inum) {
+  off_t size = 10 * BLOCK + 100;
+  assert(seek_data(inum, 0) == 0);
+  assert(seek_data(inum, BLOCK + 5) == BLOCK + 5);
+  assert(seek_hole(inum, 0) == 2 * BLOCK);
+  assert(seek_hole(inum, 3 * BLOCK + 1) == 3 * BLOCK + 1);
+  assert(seek_data(inum, 2 * BLOCK) == 10 * BLOCK);
+  assert(seek_data(inum, 3 * BLOCK + 1) == 10 * BLOCK);
+  assert(seek_hole(inum, 10 * BLOCK) == size);
+  assert(seek_data(inum, size - 1) == size - 1);
+  assert(seek_data(inum, size) == -ENXIO);
+  assert(seek_hole(inum, size) == -ENXIO);
+  assert(seek_data(inum, -1) == -ENXIO);
+}
+
+int main(int argc, char **argv) {
+  memset(buf, 'x', sizeof(buf));
+  int fd = open(TEST_NAME, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  assert(fd != -1 && ftruncate(fd, 8 << 20) == 0);
+  close(fd);
+  assert(storage_init(TEST_NAME) == 0);
+
+  // Sparse, both while the written blocks are held in memory and once
+  // they are on disk.
+  int sparse = make_file("/sparse");
+  assert(storage_write_inum(sparse, buf, 2 * BLOCK, 0) == 2 * BLOCK);
+  assert(storage_write_inum(sparse, buf, 100, 10 * BLOCK) == 100);
+  check_sparse(sparse);
+  assert(storage_flush(sparse) == 0);
+  check_sparse(sparse);
+
+  // Growing by truncation adds a hole at the end.
+  assert(storage_truncate_inum(sparse, 20 * BLOCK) == 0);
+  assert(seek_hole(sparse, 10 * BLOCK) == 11 * BLOCK);
+  assert(seek_data(sparse, 11 * BLOCK) == -ENXIO);
+  assert(seek_hole(sparse, 20 * BLOCK - 1) == 20 * BLOCK - 1);
+
+  // Blocks preallocated past the end are not data, and the end of the
+  // file is still the last hole. Appends too big to be held in memory get
+  // blocks right away, and some more past the end.
+  int appended = make_file("/appended");
+  assert(storage_write_inum(appended, buf, 8 * BLOCK, 0) == 8 * BLOCK);
+  assert(storage_flush(appended) == 0);
+  size_t big = 300 * BLOCK;
+  char *big_buf = calloc(1, big);
+  assert(storage_write_inum(appended, big_buf, big, 8 * BLOCK) == (int)big);
+  assert(storage_write_inum(appended, buf, 10, 8 * BLOCK + big) == 10);
+  off_t end = 8 * BLOCK + big + 10;
+  assert(blocks_of(appended) > (end + BLOCK - 1) / BLOCK);
+  assert(seek_data(appended, 0) == 0);
+  assert(seek_data(appended, 100 * BLOCK) == 100 * BLOCK);
+  assert(seek_hole(appended, 0) == end);
+  assert(seek_data(appended, end) == -ENXIO);
+  assert(seek_hole(appended, end) == -ENXIO);
+  free(big_buf);
+
+  // Inline files hold data up to where their inode ends, then a hole.
+  int inline_file = make_file("/inline");
+  assert(storage_write_inum(inline_file, buf, 50, 0) == 50);
+  assert(blocks_of(inline_file) == 0);
+  assert(seek_data(inline_file, 10) == 10);
+  assert(seek_hole(inline_file, 0) == 50);
+  assert(seek_data(inline_file, 50) == -ENXIO);
+  assert(storage_truncate_inum(inline_file, 3 * BLOCK) == 0);
+  assert(blocks_of(inline_file) == 0);
+  assert(seek_hole(inline_file, 0) == 128);
+  assert(seek_hole(inline_file, 200) == 200);
+  assert(seek_data(inline_file, 200) == -ENXIO);
+
+  // Compressed clusters are data, the hole between them is not.
+  blocks_free();
+  setenv("NUFS_COMPRESS", "1", 1);
+  assert(storage_init(TEST_NAME) == 0);
+  int compressed = make_file("/compressed");
+  assert(storage_write_inum(compressed, buf, 16 * BLOCK, 0) == 16 * BLOCK);
+  assert(storage_write_inum(compressed, buf, 16 * BLOCK, 48 * BLOCK) ==
+         16 * BLOCK);
+  assert(storage_flush(compressed) == 0);
+  assert(blocks_of(compressed) < 8);
+  assert(seek_data(compressed, 0) == 0);
+  assert(seek_data(compressed, 5 * BLOCK + 3) == 5 * BLOCK + 3);
+  assert(seek_hole(compressed, 0) == 16 * BLOCK);
+  assert(seek_data(compressed, 16 * BLOCK) == 48 * BLOCK);
+  assert(seek_hole(compressed, 48 * BLOCK) == 64 * BLOCK);
+  assert(seek_data(compressed, 64 * BLOCK) == -ENXIO);
+
+  // The other files read the same in the new mount.
+  assert(storage_open("/sparse") == sparse);
+  assert(seek_data(sparse, 2 * BLOCK) == 10 * BLOCK);
+  assert(seek_hole(sparse, 10 * BLOCK) == 11 * BLOCK);
+
+  blocks_free();
+  unsetenv("NUFS_COMPRESS");
+  unlink(TEST_NAME);
+  return 0;
+}
@@ -0,0 +1,335 @@
+// Shares blocks between files, by cloning or copying ranges and by
+// deduplicating blocks as they are flushed, and checks that writes unshare
+// them and that every reference is dropped once the files are gone. Also
+// runs out of space partway through a flush, and checks what was written.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "storage.h"
+
+#define TEST_NAME "share_test.img"
+
+#define BLOCK 4096
+#define FILE_BLOCKS 8
+
+static char data[FILE_BLOCKS * BLOCK];
+
+// Returns the number of blocks in use, once freed blocks are released.
+static int used_blocks(void) {
+  assert(blocks_sync() == 0);
+  return bitmap_count(get_blocks_bitmap(), BLOCK_COUNT);
+}
+
+static int make_file(const char *path) {
+  assert(storage_mknod(path, 0100644) == 0);
+  int inum = storage_open(path);
+  assert(inum >= 0);
+  return inum;
+}
+
+// Checks that the file `inum` holds the `size` bytes at `expected`.
+static void check_contents(int inum, const char *expected, size_t size) {
+  char *buf = malloc(size + 1);
+  assert(storage_read_inum(inum, buf, size + 1, 0, NULL) == (int)size);
+  assert(memcmp(buf, expected, size) == 0);
+  free(buf);
+}
+
+static void test_clone(void) {
+  int src = make_file("/src");
+  int whole = make_file("/whole");
+  int part = make_file("/part");
+  int last = make_file("/last");
+  int empty = used_blocks();
+
+  // A source ending in a partial block, with a hole in its middle block.
+  off_t size = sizeof(data) - 1000;
+  char expected[sizeof(data)];
+  memcpy(expected, data, size);
+  memset(expected + 4 * BLOCK, 0, BLOCK);
+  assert(storage_write_inum(src, data, 4 * BLOCK, 0) == 4 * BLOCK);
+  assert(storage_write_inum(src, data + 5 * BLOCK, size - 5 * BLOCK,
+                            5 * BLOCK) == size - 5 * BLOCK);
+  assert(storage_flush(src) == 0);
+  int one_copy = used_blocks();
+
+  // Cloning the whole file, partial block included, takes no new block,
+  // and neither does cloning it again.
+  assert(storage_clone_inum(src, 0, whole, 0, 0) == 0);
+  assert(used_blocks() == one_copy);
+  check_contents(whole, expected, size);
+  assert(storage_clone_inum(src, 0, whole, 0, size) == 0);
+  assert(used_blocks() == one_copy);
+  check_contents(whole, expected, size);
+
+  // Cloning over blocks of a file frees them, and the source's hole
+  // replaces what the destination had there.
+  char other[sizeof(data)];
+  memset(other, 'o', sizeof(data));
+  assert(storage_write_inum(part, other, sizeof(data), 0) == sizeof(data));
+  assert(storage_flush(part) == 0);
+  assert(used_blocks() == one_copy + FILE_BLOCKS);
+  assert(storage_clone_inum(src, 3 * BLOCK, part, BLOCK, 3 * BLOCK) == 0);
+  memcpy(other + BLOCK, expected + 3 * BLOCK, 3 * BLOCK);
+  assert(used_blocks() == one_copy + FILE_BLOCKS - 3);
+  check_contents(part, other, sizeof(data));
+
+  // Ranges that are not aligned, or overlap, are refused.
+  assert(storage_clone_inum(src, 100, part, 0, BLOCK) == -EINVAL);
+  assert(storage_clone_inum(src, 0, part, 0, BLOCK + 1) == -EINVAL);
+  assert(storage_clone_inum(src, 0, src, BLOCK, 2 * BLOCK) == -EINVAL);
+
+  // Writing to a clone copies only the block written to.
+  assert(storage_write_inum(whole, "new", 3, BLOCK + 10) == 3);
+  assert(storage_flush(whole) == 0);
+  assert(used_blocks() == one_copy + FILE_BLOCKS - 3 + 1);
+  check_contents(src, expected, size);
+  memcpy(expected + BLOCK + 10, "new", 3);
+  check_contents(whole, expected, size);
+  memcpy(expected + BLOCK + 10, data + BLOCK + 10, 3);
+
+  // A pinned source that is unlinked can still be cloned from, and is
+  // freed with the last pin.
+  assert(storage_open_pinned("/src") == src);
+  assert(storage_unlink("/src") == 0);
+  assert(storage_clone_inum(src, 0, last, 0, 0) == 0);
+  storage_forget(src, 1);
+  check_contents(last, expected, size);
+
+  // Once every file is gone, so is every reference to their blocks.
+  assert(storage_unlink("/whole") == 0);
+  assert(storage_unlink("/part") == 0);
+  assert(storage_unlink("/last") == 0);
+  assert(used_blocks() == empty);
+}
+
+static void test_copy(void) {
+  int src = make_file("/src");
+  int lined_up = make_file("/lined-up");
+  int shifted = make_file("/shifted");
+  int empty = used_blocks();
+
+  // A source with a hole in block 4, and its last block still held in
+  // memory.
+  off_t size = sizeof(data) - 1000;
+  char expected[sizeof(data)];
+  memcpy(expected, data, size);
+  memset(expected + 4 * BLOCK, 0, BLOCK);
+  assert(storage_write_inum(src, data, 4 * BLOCK, 0) == 4 * BLOCK);
+  assert(storage_write_inum(src, data + 5 * BLOCK, 2 * BLOCK, 5 * BLOCK) ==
+         2 * BLOCK);
+  assert(storage_flush(src) == 0);
+  assert(storage_write_inum(src, data + 7 * BLOCK, size - 7 * BLOCK,
+                            7 * BLOCK) == size - 7 * BLOCK);
+
+  // Offsets that do not: everything is copied, over what the destination
+  // had, and up to the end of the source only.
+  char out[2 * sizeof(data)];
+  memset(out, 'o', sizeof(out));
+  assert(storage_write_inum(shifted, out, 3 * BLOCK, 0) == 3 * BLOCK);
+  assert(storage_copy_inum(src, 100, shifted, 2 * BLOCK + 5, size) ==
+         size - 100);
+  off_t shifted_size = 2 * BLOCK + 5 + size - 100;
+  memcpy(out + 2 * BLOCK + 5, expected + 100, size - 100);
+  check_contents(shifted, out, shifted_size);
+  assert(storage_copy_inum(src, size, shifted, 0, BLOCK) == 0);
+  assert(storage_copy_inum(src, 0, src, 100, BLOCK) == -EINVAL);
+
+  // Offsets that line up: the partial blocks at either end are copied,
+  // and the whole blocks between them shared.
+  assert(storage_flush(src) == 0);
+  int before = used_blocks();
+  off_t length = 6 * BLOCK;
+  assert(storage_copy_inum(src, 1000, lined_up, 1000, length) == length);
+  memset(out, 0, sizeof(out));
+  memcpy(out + 1000, expected + 1000, length);
+  check_contents(lined_up, out, 1000 + length);
+  // New blocks: the two partial ones, and one preallocated past the end
+  // when the last is appended.
+  assert(used_blocks() == before + 3);
+
+  // Writing to a shared block copies it, and leaves the source alone.
+  assert(storage_write_inum(lined_up, "new", 3, 2 * BLOCK) == 3);
+  check_contents(src, expected, size);
+
+  // A pinned source that is unlinked can still be copied from, and is
+  // freed with the last pin.
+  assert(storage_open_pinned("/src") == src);
+  assert(storage_unlink("/src") == 0);
+  assert(storage_copy_inum(src, 0, shifted, 0, size) == size);
+  storage_forget(src, 1);
+  memset(out, 'o', sizeof(out));
+  memcpy(out + 2 * BLOCK + 5, expected + 100, size - 100);
+  memcpy(out, expected, size);
+  check_contents(shifted, out, shifted_size);
+
+  assert(storage_unlink("/lined-up") == 0);
+  assert(storage_unlink("/shifted") == 0);
+  assert(used_blocks() == empty);
+}
+
+static void test_dedup(void) {
+  int a = make_file("/a");
+  int b = make_file("/b");
+  int empty = used_blocks();
+
+  // The second copy takes no block of its own.
+  assert(storage_write_inum(a, data, sizeof(data), 0) == sizeof(data));
+  assert(storage_flush(a) == 0);
+  int one_copy = used_blocks();
+  assert(one_copy >= empty + FILE_BLOCKS);
+  assert(storage_write_inum(b, data, sizeof(data), 0) == sizeof(data));
+  assert(storage_flush(b) == 0);
+  assert(used_blocks() == one_copy);
+  check_contents(a, data, sizeof(data));
+  check_contents(b, data, sizeof(data));
+
+  // Writing to a shared block copies it, and leaves the other file as it
+  // was.
+  char changed[sizeof(data)];
+  memcpy(changed, data, sizeof(data));
+  memset(changed + 2 * BLOCK + 100, 'z', 10);
+  assert(storage_write_inum(b, changed + 2 * BLOCK + 100, 10,
+                            2 * BLOCK + 100) == 10);
+  assert(storage_flush(b) == 0);
+  assert(used_blocks() == one_copy + 1);
+  check_contents(a, data, sizeof(data));
+  check_contents(b, changed, sizeof(data));
+
+  // Both files read the same after remounting. Dropping the first frees
+  // only the block the second no longer shares.
+  blocks_free();
+  assert(storage_init(TEST_NAME) == 0);
+  check_contents(a, data, sizeof(data));
+  check_contents(b, changed, sizeof(data));
+  assert(storage_unlink("/a") == 0);
+  assert(used_blocks() == one_copy);
+  check_contents(b, changed, sizeof(data));
+
+  // Once both are gone, so is every reference to their blocks.
+  assert(storage_unlink("/b") == 0);
+  assert(used_blocks() == empty);
+}
+
+// Fills `buf` with `size` bytes that do not compress.
+static void fill_random(char *buf, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    buf[i] = rand();
+  }
+}
+
+// Writes `blocks` blocks that do not compress to a new file `path`.
+static void make_random_file(const char *path, int blocks) {
+  int inum = make_file(path);
+  char *buf = malloc((size_t)blocks * BLOCK);
+  fill_random(buf, (size_t)blocks * BLOCK);
+  assert(storage_write_inum(inum, buf, (size_t)blocks * BLOCK, 0) ==
+         blocks * BLOCK);
+  assert(storage_flush(inum) == 0);
+  free(buf);
+}
+
+static void test_full_flush(void) {
+  int file = make_file("/file");
+
+  // Leave free only runs of 14, 14 and 4 blocks.
+  make_random_file("/run1", 14);
+  make_random_file("/gap1", 1);
+  make_random_file("/run2", 14);
+  make_random_file("/gap2", 1);
+  make_random_file("/run3", 4);
+  int fill = make_file("/fill");
+  char block[BLOCK];
+  for (off_t offset = 0;; offset += BLOCK) {
+    fill_random(block, BLOCK);
+    if (storage_write_inum(fill, block, BLOCK, offset) != BLOCK ||
+        storage_flush(fill) != 0) {
+      break;
+    }
+  }
+  assert(used_blocks() == BLOCK_COUNT);
+  char gap[BLOCK];
+  int gap1 = storage_open("/gap1");
+  assert(storage_read_inum(gap1, gap, BLOCK, 0, NULL) == BLOCK);
+  assert(storage_unlink("/run1") == 0);
+  assert(storage_unlink("/run2") == 0);
+  assert(storage_unlink("/run3") == 0);
+
+  // Two clusters: one that compresses to half a run, and one that
+  // compresses by too little to fit the other, which is wasted until the
+  // next commit, so that storing it plain runs out of space. Its first
+  // block is a copy of another file's, shared if blocks are deduplicated.
+  static char contents[32 * BLOCK];
+  fill_random(contents, 8 * BLOCK);
+  memcpy(contents + 16 * BLOCK, gap, BLOCK);
+  fill_random(contents + 17 * BLOCK, 13 * BLOCK);
+  assert(storage_write_inum(file, contents, sizeof(contents), 0) ==
+         sizeof(contents));
+  assert(storage_flush(file) == -ENOSPC);
+  check_contents(file, contents, sizeof(contents));
+
+  // Writes to any block of either cluster after that are kept, once there
+  // is room, and leave the other file alone.
+  assert(storage_unlink("/fill") == 0);
+  off_t offsets[] = {2 * BLOCK + 100, 16 * BLOCK + 100, 20 * BLOCK + 100};
+  for (int k = 0; k < 3; k++) {
+    memset(contents + offsets[k], 'x' + k, 10);
+    assert(storage_write_inum(file, contents + offsets[k], 10, offsets[k]) ==
+           10);
+  }
+  assert(storage_flush(file) == 0);
+  check_contents(file, contents, sizeof(contents));
+  check_contents(gap1, gap, BLOCK);
+  blocks_free();
+  assert(storage_init(TEST_NAME) == 0);
+  check_contents(file, contents, sizeof(contents));
+  check_contents(gap1, gap, BLOCK);
+
+  assert(storage_unlink("/file") == 0);
+  assert(storage_unlink("/gap1") == 0);
+  assert(storage_unlink("/gap2") == 0);
+}
+
+int main(int argc, char **argv) {
+  // Every block different, so that only other files can share them.
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = 'a' + i / BLOCK + i % 7;
+  }
+
+  int fd = open(TEST_NAME, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  assert(fd != -1 && ftruncate(fd, 8 << 20) == 0);
+  close(fd);
+  assert(storage_init(TEST_NAME) == 0);
+  test_clone();
+  test_copy();
+  blocks_free();
+
+  setenv("NUFS_DEDUP", "1", 1);
+  assert(storage_init(TEST_NAME) == 0);
+  test_dedup();
+  blocks_free();
+
+  unsetenv("NUFS_DEDUP");
+  setenv("NUFS_COMPRESS", "1", 1);
+  assert(storage_init(TEST_NAME) == 0);
+  test_full_flush();
+  blocks_free();
+
+  setenv("NUFS_DEDUP", "1", 1);
+  assert(storage_init(TEST_NAME) == 0);
+  test_full_flush();
+  blocks_free();
+
+  unsetenv("NUFS_DEDUP");
+  unsetenv("NUFS_COMPRESS");
+  unlink(TEST_NAME);
+  return 0;
+}
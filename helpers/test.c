@@ -8,13 +8,14 @@ int main() {
     char *path2 = "/dir1";
     char *path3 = "/dir1/dir2";
 
-    assert(strcmp(get_parent_path(path1), "/") == 0);
-    assert(strcmp(get_parent_path(path2), "/") == 0);
-    assert(strcmp(get_parent_path(path3), "/dir1") == 0);
+    size_t parent_len;
 
-    assert(strcmp(get_entry_name(path1), "") == 0);
-    assert(strcmp(get_entry_name(path2), "dir1") == 0);
-    assert(strcmp(get_entry_name(path3), "dir2") == 0);
+    assert(strcmp(path_split(path1, &parent_len), "") == 0);
+    assert(parent_len == 0);
+    assert(strcmp(path_split(path2, &parent_len), "dir1") == 0);
+    assert(parent_len == 0);
+    assert(strcmp(path_split(path3, &parent_len), "dir2") == 0);
+    assert(parent_len == 5 && strncmp(path3, "/dir1", parent_len) == 0);
 
     return 0;
 }
\ No newline at end of file
@@ -1,10 +1,54 @@
 #include "inode.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 #include "bitmap.h"
 #include "blocks.h"
 #include "constants.h"
+#include "journal.h"
+#include "trace.h"
+
+_Static_assert(sizeof(inode_t) == 256, "inodes must tile blocks");
+
+// Index of the free inodes bitmap, to find free inodes quickly.
+static bitmap_summary_t inode_summary;
+
+// Guards `inode_summary` and the inode hint in the superblock.
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A reader/writer lock for every inode, guarding its fields and, for a
+// directory, its entries. Locks are taken parent before child; see
+// storage.c for the order across unrelated directories.
+static pthread_rwlock_t *inode_locks = NULL;
+static int inode_lock_count = 0;
+
+// References to every inode held by the kernel, see inode_pin().
+static _Atomic int *inode_pins = NULL;
+
+/**
+ * Loads the free inodes bitmap of the mounted image.
+ */
+void inodes_init() {
+  bitmap_summary_free(&inode_summary);
+  bitmap_summary_init(&inode_summary, get_inode_bitmap(), INODE_COUNT);
+
+  for (int i = 0; i < inode_lock_count; i++) {
+    pthread_rwlock_destroy(&inode_locks[i]);
+  }
+  free(inode_locks);
+  inode_lock_count = INODE_COUNT;
+  inode_locks = malloc(inode_lock_count * sizeof(pthread_rwlock_t));
+  for (int i = 0; i < inode_lock_count; i++) {
+    pthread_rwlock_init(&inode_locks[i], NULL);
+  }
+
+  free((void *)inode_pins);
+  inode_pins = calloc(inode_lock_count, sizeof(*inode_pins));
+}
 
 /**
  * Prints the details of the given `inode`.
@@ -12,8 +56,9 @@
 void print_inode(inode_t *node) {
   printf("refs: %d\n", node->refs);
   printf("mode: %d\n", node->mode);
-  printf("size: %d\n", node->size);
-  printf("block: %d\n", node->block);
+  printf("size: %ld\n", (long)node->size);
+  printf("extents: %d (depth %d)\n", node->extent_root.count,
+         node->extent_root.depth);
 }
 
 /**
@@ -21,25 +66,39 @@ void print_inode(inode_t *node) {
  */
 inode_t *get_inode(int inum) {
   assert(0 <= inum && inum < INODE_COUNT);
-  void *ibm = get_inode_bitmap();
-  inode_t *inode_block = (inode_t *)blocks_get_block(INODES_BNUM);
-  return inode_block + (sizeof(inode_t *) * inum);
+  inode_t *inode_table = (inode_t *)blocks_get_block(INODES_BNUM);
+  return inode_table + inum;
+}
+
+/**
+ * Marks the bit of inode `inum` in the free inodes bitmap, the inode hint
+ * and the inode itself to be journaled.
+ */
+static void dirty_inode_alloc(int inum) {
+  journal_dirty((char *)get_inode_bitmap() + inum / 8, 1);
+  journal_dirty(get_superblock(), sizeof(superblock_t));
+  inode_dirty(inum);
 }
 
 /**
- * Allocates the next available inode spot and returns the index.
+ * Allocates the next available inode spot after the previous allocation
+ * and returns the index.
  * Returns -1 if a new inode cannot be allocated.
  */
 int alloc_inode() {
-  int inum = next_free_inode();
-
-  if (inum == -1) {
-    return -1;
+  pthread_mutex_lock(&alloc_lock);
+  int inum = bitmap_summary_find_zero(&inode_summary,
+                                      get_superblock()->inode_hint);
+  if (inum != -1) {
+    bitmap_summary_put(&inode_summary, inum, 1, 1);
+    get_superblock()->inode_hint = inum + 1;
+    dirty_inode_alloc(inum);
   }
+  pthread_mutex_unlock(&alloc_lock);
 
-  void *ibm = get_inode_bitmap();
-  bitmap_put(ibm, inum, 1);
-  printf("+ alloc_inode() -> %d\n", inum);
+  if (inum != -1) {
+    TRACE_EVENT(TRACE_ALLOC_INODE, inum, inum, 0, 0);
+  }
   return inum;
 }
 
@@ -48,24 +107,22 @@ int alloc_inode() {
  * Returns -1 if nothing is free.
  */
 int next_free_inode() {
-  void *ibm = get_inode_bitmap();
-
-  for (int i = 0; i < INODE_COUNT; i++) {
-    if (!bitmap_get(ibm, i)) {
-      return i;
-    }
-  }
-
-  return -1;
+  pthread_mutex_lock(&alloc_lock);
+  int inum = bitmap_summary_find_zero(&inode_summary,
+                                      get_superblock()->inode_hint);
+  pthread_mutex_unlock(&alloc_lock);
+  return inum;
 }
 
 /**
  * Frees the inode at the given index
  */
 void free_inode(int inum) {
-  void *ibm = get_inode_bitmap();
-  bitmap_put(ibm, inum, 0);
-  printf("+ free_inode(%d)\n", inum);
+  pthread_mutex_lock(&alloc_lock);
+  bitmap_summary_put(&inode_summary, inum, 1, 0);
+  dirty_inode_alloc(inum);
+  pthread_mutex_unlock(&alloc_lock);
+  TRACE_EVENT(TRACE_FREE_INODE, inum, inum, 0, 0);
 }
 
 /**
@@ -73,24 +130,100 @@ void free_inode(int inum) {
  */
 int is_dir(inode_t *inode) {
   assert(inode != NULL);
-  return inode->mode == DIR_MODE;
+  return S_ISDIR(inode->mode);
 }
 
 /**
- * Returns the inode of the block that holds the partial data from size.
- * Ex. inode->size = 5000 -> Returns the 2nd block of data
-*/
- int bnum_from_size(inode_t *inode, int size) {
-  inode_t *ret = inode;
-  if (size - BLOCK_SIZE < 0) {
-    return ret->block;
-  }
+ * Takes the lock of inode `inum` for reading.
+ */
+void inode_read_lock(int inum) {
+  assert(0 <= inum && inum < inode_lock_count);
+  pthread_rwlock_rdlock(&inode_locks[inum]);
+}
+
+/**
+ * Marks inode `inum` as changed by the running transaction.
+ */
+void inode_dirty(int inum) {
+  journal_dirty(get_inode(inum), sizeof(inode_t));
+  journal_dirty_inode(inum);
+}
 
-  while (size >= 0) {
-    size -= BLOCK_SIZE;
-    next_block_t *next_block = (next_block_t *) (((char *)ret) + BLOCK_SIZE - sizeof(next_block_t));
-    ret = get_inode(next_block->bnum);
+/**
+ * Takes the lock of inode `inum` for writing. The inode is journaled with
+ * the running transaction, since holding the lock is what allows changing
+ * it.
+ */
+void inode_write_lock(int inum) {
+  assert(0 <= inum && inum < inode_lock_count);
+  pthread_rwlock_wrlock(&inode_locks[inum]);
+  inode_dirty(inum);
+}
+
+/**
+ * Takes the lock of inode `inum` for writing, to change the contents of the
+ * file only. Unlike inode_write_lock(), leaves it to the caller to call
+ * inode_dirty() before changing the inode itself.
+ */
+void inode_write_lock_contents(int inum) {
+  assert(0 <= inum && inum < inode_lock_count);
+  pthread_rwlock_wrlock(&inode_locks[inum]);
+}
+
+/**
+ * Takes the lock of inode `inum` for writing if it is free, as
+ * inode_write_lock() does.
+ * Returns 1 if the lock was taken and 0 otherwise.
+ */
+int inode_try_write_lock(int inum) {
+  assert(0 <= inum && inum < inode_lock_count);
+  if (pthread_rwlock_trywrlock(&inode_locks[inum]) != 0) {
+    return 0;
   }
+  inode_dirty(inum);
+  return 1;
+}
+
+/**
+ * Takes the lock of inode `inum` for writing if it is free, as
+ * inode_write_lock_contents() does.
+ * Returns 1 if the lock was taken and 0 otherwise.
+ */
+int inode_try_write_lock_contents(int inum) {
+  assert(0 <= inum && inum < inode_lock_count);
+  return pthread_rwlock_trywrlock(&inode_locks[inum]) == 0;
+}
 
-  return ret->block;
-}
\ No newline at end of file
+/**
+ * Releases the lock of inode `inum`.
+ */
+void inode_unlock(int inum) { pthread_rwlock_unlock(&inode_locks[inum]); }
+
+/**
+ * Counts a reference to inode `inum` that outlives the current operation.
+ */
+void inode_pin(int inum) {
+  assert(0 <= inum && inum < inode_lock_count);
+  atomic_fetch_add_explicit(&inode_pins[inum], 1, memory_order_relaxed);
+}
+
+/**
+ * Drops `n` references to inode `inum` counted by inode_pin().
+ * Returns the number of references left.
+ */
+int inode_unpin(int inum, int n) {
+  assert(0 <= inum && inum < inode_lock_count);
+  int left =
+      atomic_fetch_sub_explicit(&inode_pins[inum], n, memory_order_relaxed) -
+      n;
+  assert(left >= 0);
+  return left;
+}
+
+/**
+ * Returns whether inode `inum` has references counted by inode_pin().
+ */
+int inode_pinned(int inum) {
+  assert(0 <= inum && inum < inode_lock_count);
+  return atomic_load_explicit(&inode_pins[inum], memory_order_relaxed) > 0;
+}
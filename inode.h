@@ -7,20 +7,34 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <stdint.h>
+
 #include "blocks.h"
+#include "extent.h"
+
+// Bytes of a file that can be stored in its inode.
+#define INODE_INLINE_SIZE 128
 
 typedef struct inode {
-  int refs;   // reference count
-  int mode;   // permission & type
-  int size;   // bytes
-  int block;  // single block pointer (if max file size <= 4K)
+  int refs;      // reference count
+  int mode;      // permission & type
+  int64_t size;  // bytes
+  extent_header_t extent_root;      // root of the block map
+  extent_t extents[INODE_EXTENTS];  // slots of the root, follow its header
+  int flags;                        // INODE_* flags
+  char _reserved[4];
+  char inline_data[INODE_INLINE_SIZE];  // contents, with INODE_INLINE
 } inode_t;
 
-typedef struct next_block {
-  int bnum; // the block index to the nextz block that stores the continuous data.
-} next_block_t;
+// The directory's entries are stored hashed rather than in a linear list.
+#define INODE_DIR_HASHED 0x1
 
+// The file's contents are stored in `inline_data`, and it has no blocks.
+// Bytes past the end of the file are zero, and bytes past
+// INODE_INLINE_SIZE are a hole.
+#define INODE_INLINE 0x2
 
+void inodes_init();
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
 int alloc_inode();
@@ -28,4 +42,16 @@ void free_inode(int inum);
 int next_free_inode();
 int is_dir(inode_t *inode);
 
+void inode_dirty(int inum);
+void inode_read_lock(int inum);
+void inode_write_lock(int inum);
+void inode_write_lock_contents(int inum);
+int inode_try_write_lock(int inum);
+int inode_try_write_lock_contents(int inum);
+void inode_unlock(int inum);
+
+void inode_pin(int inum);
+int inode_unpin(int inum, int n);
+int inode_pinned(int inum);
+
 #endif
@@ -0,0 +1,48 @@
+// ioctl()s on nufs files.
+//
+// FUSE 2 does not forward lseek(), so SEEK_DATA and SEEK_HOLE cannot reach
+// the filesystem. Tools that want to skip the holes of a sparse file ask
+// for them with these instead: they take an offset and replace it with the
+// offset that lseek() would have returned, or fail with ENXIO.
+//
+// FICLONE and FICLONERANGE do not reach FUSE filesystems either, since the
+// kernel handles them itself. NUFS_IOC_CLONE and NUFS_IOC_CLONE_RANGE stand
+// in for them: issued on the destination file, they make it share the
+// blocks of the source, named by its path from the root of the mount, so
+// that a copy costs no more than its metadata. Either file gets copies of
+// the blocks it writes to afterwards. NUFS_IOC_CLONE clones the whole
+// source to the start of the destination. Offsets are multiples of the
+// block size, and so is the length unless it reaches the end of the
+// source, past the end of the destination. A length of 0 means up to the
+// end of the source.
+//
+// FUSE 2 has no copy_file_range() either. NUFS_IOC_COPY_RANGE does its
+// work: it takes the same arguments as NUFS_IOC_CLONE_RANGE, without the
+// alignment rules, and replaces the length with the number of bytes
+// copied, fewer if the source ends first; a length of 0 copies nothing.
+// Whole blocks are shared when the offsets line up, and the rest is copied
+// within the filesystem.
+
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define NUFS_IOC_SEEK_DATA _IOWR('N', 1, int64_t)
+#define NUFS_IOC_SEEK_HOLE _IOWR('N', 2, int64_t)
+
+#define NUFS_PATH_MAX 4096
+
+typedef struct nufs_clone_range {
+  int64_t src_offset;
+  int64_t length;
+  int64_t dest_offset;
+  char src_path[NUFS_PATH_MAX];
+} nufs_clone_range_t;
+
+#define NUFS_IOC_CLONE _IOW('N', 3, char[NUFS_PATH_MAX])
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 4, nufs_clone_range_t)
+#define NUFS_IOC_COPY_RANGE _IOWR('N', 5, nufs_clone_range_t)
+
+#endif
@@ -0,0 +1,777 @@
+// Metadata write-ahead journal.
+//
+// The journal is a ring of records in its own region of the image. A
+// record is a header block, listing the home of every logged block,
+// followed by the logged blocks. Records are appended at `head` and the
+// ring restarts at its first block when the next record does not fit.
+//
+// A commit writes the file blocks in place and syncs, writes its record and
+// syncs, then writes the metadata blocks in place without syncing. The
+// next commit syncs before writing its record, so every record but the
+// last is always checkpointed, and mounting only ever replays the last one.
+// The records of a mount are numbered consecutively and carry the mount's
+// id, so the chain of records starting at the first block ends at the last
+// record written.
+
+#define _GNU_SOURCE
+#include "journal.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a  // "JRNL"
+
+// Commit interval when $NUFS_COMMIT_INTERVAL does not set one.
+static const int COMMIT_INTERVAL_MS = 5000;
+
+// Age at which modified file blocks are written back ahead of the next
+// commit, when $NUFS_DIRTY_EXPIRE does not set one.
+static const int DIRTY_EXPIRE_MS = 1000;
+
+// A transaction with this many file blocks to write is committed right
+// away, which also bounds the memory held by modified blocks.
+static const int MAX_DATA_BLOCKS = 8192;
+
+// Metadata blocks a transaction is taken to mark at most. A transaction
+// only starts while the open group has this much room left for it and for
+// every running one, so that the group fits in one record. The largest,
+// flushing a file's held blocks with dedup on, typically mark about half
+// as many.
+static const int TXN_MAX_BLOCKS = 32;
+
+typedef struct journal_header {
+  uint32_t magic;     // JOURNAL_MAGIC
+  uint32_t count;     // blocks logged after the header
+  uint64_t mount_id;  // same for every record of a mount
+  uint64_t seq;       // consecutive within a mount
+  uint64_t checksum;  // of the header and the logged blocks
+  int32_t bnums[];    // home of every logged block
+} journal_header_t;
+
+// A set of blocks modified by the running transaction.
+typedef struct dirty_set {
+  _Atomic uint64_t *bits;  // bit `b` is set while block `b` is in the set
+  int *bnums;              // the blocks of the set, in the order marked
+  uint64_t *times;         // when each block was marked, in milliseconds
+  int count;
+  int cap;
+} dirty_set_t;
+
+// Metadata blocks, journaled, and file blocks, written in place. A block
+// in both is journaled.
+static dirty_set_t meta;
+static dirty_set_t data;
+
+// Guards the block lists of the dirty sets. Nothing is locked while it is
+// held.
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The file each block of the data set belongs to.
+static _Atomic int *data_owners = NULL;
+
+// The last group in which the metadata of each inode changed.
+static _Atomic uint64_t *inode_groups = NULL;
+
+// Geometry of the journal region.
+static int journal_bnum = 0;
+static int journal_blocks = 0;
+
+// Most blocks a record can hold, and the room kept for each transaction.
+static int record_max = 0;
+static int txn_blocks = 0;
+
+// Where the next record goes, and what it is numbered.
+static int head = 0;
+static uint64_t mount_id = 0;
+static uint64_t seq = 0;
+
+// Whether the last commit wrote metadata in place that is not synced yet.
+static int checkpoint_pending = 0;
+
+// Serializes commits and write-backs, and guards the state above.
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The transactions that have not committed yet are group `open_group`,
+// groups up to `committed_group` are committed, and groups up to
+// `durable_group` are on disk.
+static _Atomic uint64_t open_group = 1;
+static uint64_t committed_group = 0;
+static _Atomic uint64_t durable_group = 0;
+static int committed_rv = 0;
+
+// Running transactions, and whether new ones wait.
+static pthread_mutex_t barrier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t barrier_cond = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+static int blocked = 0;
+static int full = 0;
+
+// Whether file blocks were written back since the last commit, and not
+// synced yet.
+static int written_back = 0;
+
+// The commit thread, started by the first transaction and woken early when
+// the running transactions are full.
+static pthread_t committer;
+static pthread_cond_t committer_cond = PTHREAD_COND_INITIALIZER;
+static int committer_started = 0;
+static int stopping = 0;
+
+// Called before commits, see journal_set_flush().
+static void (*flush_hook)() = NULL;
+
+// Whether the calling thread is the commit thread, whose transactions do
+// not wait for the commit it is about to make.
+static __thread int is_committer = 0;
+
+// Nesting depth of the transactions of the calling thread.
+static __thread int depth = 0;
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Returns a checksum of the header block `h`, taking its checksum field as
+ * 0, and of the `h->count` blocks at `blocks`.
+ */
+static uint64_t record_checksum(const journal_header_t *h,
+                                const void *blocks) {
+  const uint64_t *words = (const uint64_t *)h;
+  size_t skip = offsetof(journal_header_t, checksum) / sizeof(uint64_t);
+  uint64_t sum = 0xcbf29ce484222325;
+  for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+    sum = (sum ^ (i == skip ? 0 : words[i])) * 0x100000001b3;
+  }
+
+  words = blocks;
+  for (size_t i = 0; i < (size_t)h->count * BLOCK_SIZE / sizeof(uint64_t);
+       i++) {
+    sum = (sum ^ words[i]) * 0x100000001b3;
+  }
+  return sum;
+}
+
+static void set_init(dirty_set_t *set, int block_count) {
+  free((void *)set->bits);
+  free(set->bnums);
+  free(set->times);
+  set->bits = calloc((block_count + 63) / 64, sizeof(uint64_t));
+  set->bnums = NULL;
+  set->times = NULL;
+  set->count = 0;
+  set->cap = 0;
+  assert(set->bits != NULL);
+}
+
+static int set_has(dirty_set_t *set, int bnum) {
+  return (atomic_load_explicit(&set->bits[bnum / 64], memory_order_relaxed) >>
+          (bnum % 64)) & 1;
+}
+
+/**
+ * Adds block `bnum` to `set`.
+ * Returns 1 if it was not in the set yet and 0 otherwise.
+ */
+static int set_add(dirty_set_t *set, int bnum) {
+  uint64_t mask = (uint64_t)1 << (bnum % 64);
+  if (atomic_fetch_or(&set->bits[bnum / 64], mask) & mask) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&dirty_lock);
+  if (set->count == set->cap) {
+    set->cap = set->cap == 0 ? 64 : set->cap * 2;
+    set->bnums = realloc(set->bnums, set->cap * sizeof(int));
+    set->times = realloc(set->times, set->cap * sizeof(uint64_t));
+    assert(set->bnums != NULL && set->times != NULL);
+  }
+  set->bnums[set->count] = bnum;
+  set->times[set->count] = now_ms();
+  set->count++;
+  pthread_mutex_unlock(&dirty_lock);
+  return 1;
+}
+
+/**
+ * Removes block `bnum` from `set`, where it may stay listed.
+ * Returns 1 if it was in the set and 0 otherwise.
+ */
+static int set_claim(dirty_set_t *set, int bnum) {
+  uint64_t mask = (uint64_t)1 << (bnum % 64);
+  return (atomic_fetch_and(&set->bits[bnum / 64], ~mask) & mask) != 0;
+}
+
+static int compare_bnums(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Empties `set`, returning its blocks sorted and setting `count` to their
+ * number. The caller must free the list.
+ */
+static int *set_take(dirty_set_t *set, int *count) {
+  pthread_mutex_lock(&dirty_lock);
+  int *bnums = set->bnums;
+  int n = set->count;
+  free(set->times);
+  set->bnums = NULL;
+  set->times = NULL;
+  set->count = 0;
+  set->cap = 0;
+  pthread_mutex_unlock(&dirty_lock);
+
+  // Blocks that were written back or journaled after all were removed from
+  // the data set, but not from its list.
+  int kept = 0;
+  for (int i = 0; i < n; i++) {
+    if (set_claim(set, bnums[i])) {
+      bnums[kept++] = bnums[i];
+    }
+  }
+
+  qsort(bnums, kept, sizeof(int), compare_bnums);
+  *count = kept;
+  return bnums;
+}
+
+/**
+ * Writes the `n` blocks `bnums`, sorted, from `blocks` to their homes, a
+ * run of contiguous blocks at a time.
+ * Returns 0 on success and -1 on a write error.
+ */
+static int write_home(const int *bnums, const char *blocks, int n) {
+  for (int i = 0; i < n;) {
+    int run = 1;
+    while (i + run < n && bnums[i + run] == bnums[i] + run) {
+      run++;
+    }
+    if (blocks_write(bnums[i], blocks + (size_t)i * BLOCK_SIZE, run) == -1) {
+      return -1;
+    }
+    i += run;
+  }
+  return 0;
+}
+
+/**
+ * Writes the `n` file blocks `bnums`, sorted, in place from the mapping,
+ * then discards their in-memory copies. The caller keeps transactions out
+ * meanwhile, since copies are discarded a page, and so maybe several
+ * blocks, at a time.
+ * Returns 0 on success and -1 on a write error.
+ */
+static int write_data(const int *bnums, int n) {
+  for (int i = 0; i < n;) {
+    int run = 1;
+    while (i + run < n && bnums[i + run] == bnums[i] + run) {
+      run++;
+    }
+    if (blocks_write(bnums[i], blocks_get_block(bnums[i]), run) == -1) {
+      return -1;
+    }
+    blocks_drop(bnums[i], run);
+    i += run;
+  }
+  return 0;
+}
+
+/**
+ * Puts the `n` file blocks `bnums`, which could not be written, back into
+ * the data set.
+ */
+static void unclaim_data(const int *bnums, int n) {
+  for (int i = 0; i < n; i++) {
+    set_add(&data, bnums[i]);
+  }
+}
+
+/**
+ * Replays the last record of the journal, if any.
+ */
+static void replay() {
+  journal_header_t *h = malloc(BLOCK_SIZE);
+  journal_header_t *last = malloc(BLOCK_SIZE);
+  char *blocks = NULL;
+  char *last_blocks = NULL;
+  last->count = 0;
+
+  for (int off = 0; off < journal_blocks;) {
+    int rv = blocks_read(journal_bnum + off, h, 1);
+    assert(rv == 0);
+    if (h->magic != JOURNAL_MAGIC || h->count == 0 ||
+        h->count > (uint32_t)record_max ||
+        off + 1 + (int)h->count > journal_blocks ||
+        (off > 0 && (h->mount_id != last->mount_id ||
+                     h->seq != last->seq + 1))) {
+      break;
+    }
+
+    blocks = realloc(blocks, (size_t)h->count * BLOCK_SIZE);
+    rv = blocks_read(journal_bnum + off + 1, blocks, h->count);
+    assert(rv == 0);
+    if (record_checksum(h, blocks) != h->checksum) {
+      break;
+    }
+
+    journal_header_t *tmp_h = last;
+    last = h;
+    h = tmp_h;
+    char *tmp_blocks = last_blocks;
+    last_blocks = blocks;
+    blocks = tmp_blocks;
+    off += 1 + last->count;
+  }
+
+  // Every earlier record was written in place before this one was written.
+  if (last->count > 0) {
+    int rv = write_home(last->bnums, last_blocks, last->count);
+    assert(rv == 0 && blocks_flush() == 0);
+  }
+
+  free(h);
+  free(last);
+  free(blocks);
+  free(last_blocks);
+}
+
+void journal_init(const superblock_t *sb) {
+  journal_bnum = sb->journal_bnum;
+  journal_blocks = sb->journal_blocks;
+  record_max = (BLOCK_SIZE - sizeof(journal_header_t)) / sizeof(int32_t);
+  if (record_max > journal_blocks - 1) {
+    record_max = journal_blocks - 1;
+  }
+  // A small journal runs a single transaction per group.
+  txn_blocks = TXN_MAX_BLOCKS < record_max ? TXN_MAX_BLOCKS : record_max;
+
+  set_init(&meta, sb->block_count);
+  set_init(&data, sb->block_count);
+  free((void *)data_owners);
+  data_owners = calloc(sb->block_count, sizeof(int));
+  free((void *)inode_groups);
+  inode_groups = calloc(sb->inode_count, sizeof(uint64_t));
+  assert(data_owners != NULL && inode_groups != NULL);
+  atomic_store(&open_group, 1);
+  committed_group = 0;
+  atomic_store(&durable_group, 0);
+  replay();
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  mount_id = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^
+             ((uint64_t)getpid() << 32);
+  head = 0;
+  seq = 1;
+  checkpoint_pending = 0;
+}
+
+/**
+ * Waits until no transaction is running and keeps new ones from starting.
+ * Called with `barrier_lock` held.
+ */
+static void barrier_close() {
+  blocked = 1;
+  while (running > 0) {
+    pthread_cond_wait(&barrier_cond, &barrier_lock);
+  }
+}
+
+static void barrier_open() {
+  blocked = 0;
+  pthread_cond_broadcast(&barrier_cond);
+}
+
+/**
+ * Writes the record for the `n` metadata blocks `bnums`, whose contents are
+ * at `blocks`, and syncs.
+ * Returns 0 on success and -1 on a write error.
+ */
+static int write_record(const int *bnums, const char *blocks, int n) {
+  if (head + 1 + n > journal_blocks) {
+    head = 0;
+  }
+
+  journal_header_t *h = calloc(1, BLOCK_SIZE);
+  h->magic = JOURNAL_MAGIC;
+  h->count = n;
+  h->mount_id = mount_id;
+  h->seq = seq;
+  memcpy(h->bnums, bnums, n * sizeof(int32_t));
+  h->checksum = record_checksum(h, blocks);
+
+  int rv = blocks_write(journal_bnum + head, h, 1);
+  if (rv == 0) {
+    rv = blocks_write(journal_bnum + head + 1, blocks, n);
+  }
+  if (rv == 0) {
+    rv = blocks_flush();
+  }
+  free(h);
+
+  if (rv == 0) {
+    head += 1 + n;
+    seq++;
+  }
+  return rv;
+}
+
+/**
+ * Commits the running transactions. Called with `commit_lock` held.
+ * Returns 0 on success and -1 on a write error.
+ */
+static int commit() {
+  pthread_mutex_lock(&barrier_lock);
+  barrier_close();
+
+  // Blocks freed by the transactions become free with them.
+  blocks_release_deferred();
+
+  int meta_count;
+  int data_count;
+  int *meta_bnums = set_take(&meta, &meta_count);
+  int *data_bnums = set_take(&data, &data_count);
+
+  // File blocks go first, so that no committed metadata points at blocks
+  // that were never written.
+  int rv = write_data(data_bnums, data_count);
+  int data_written = data_count > 0 || written_back;
+  written_back = 0;
+
+  char *snapshot = malloc((size_t)meta_count * BLOCK_SIZE);
+  for (int i = 0; i < meta_count; i++) {
+    memcpy(snapshot + (size_t)i * BLOCK_SIZE, blocks_get_block(meta_bnums[i]),
+           BLOCK_SIZE);
+  }
+
+  uint64_t group = atomic_fetch_add(&open_group, 1);
+  committed_group = group;
+  full = 0;
+  barrier_open();
+  pthread_mutex_unlock(&barrier_lock);
+
+  // The record may overwrite the one whose blocks were last written in
+  // place, so those must be on disk before.
+  if (rv == 0 && (data_written || (checkpoint_pending && meta_count > 0))) {
+    rv = blocks_flush();
+    checkpoint_pending = 0;
+  }
+
+  // Transactions only start while the group has room for them.
+  assert(meta_count <= record_max);
+  if (rv == 0 && meta_count > 0) {
+    rv = write_record(meta_bnums, snapshot, meta_count);
+    if (rv == 0) {
+      rv = write_home(meta_bnums, snapshot, meta_count);
+      checkpoint_pending = 1;
+    }
+  }
+
+  free(snapshot);
+  free(meta_bnums);
+  free(data_bnums);
+  if (rv == 0) {
+    atomic_store(&durable_group, group);
+  }
+  return rv;
+}
+
+/**
+ * Writes the file blocks that were modified more than `expire_ms` ago in
+ * place, ahead of the commit that would write them.
+ *
+ * A commit hands the blocks its transactions freed back to the allocator
+ * before its record is on disk, and until then the last durable record
+ * still maps them to their old files. Waiting for the commit keeps their
+ * new contents from being written over the old ones in that window.
+ */
+static void write_expired(int expire_ms) {
+  uint64_t deadline = now_ms() - expire_ms;
+
+  pthread_mutex_lock(&commit_lock);
+  pthread_mutex_lock(&barrier_lock);
+  barrier_close();
+
+  // The list is in the order blocks were marked, so the expired blocks
+  // come first.
+  pthread_mutex_lock(&dirty_lock);
+  int expired = 0;
+  while (expired < data.count && data.times[expired] <= deadline) {
+    expired++;
+  }
+  int *bnums = malloc((expired + 1) * sizeof(int));
+  int n = 0;
+  for (int i = 0; i < expired; i++) {
+    if (set_claim(&data, data.bnums[i])) {
+      bnums[n++] = data.bnums[i];
+    }
+  }
+  data.count -= expired;
+  memmove(data.bnums, data.bnums + expired, data.count * sizeof(int));
+  memmove(data.times, data.times + expired, data.count * sizeof(uint64_t));
+  pthread_mutex_unlock(&dirty_lock);
+
+  qsort(bnums, n, sizeof(int), compare_bnums);
+  if (write_data(bnums, n) == -1) {
+    unclaim_data(bnums, n);
+  }
+  written_back |= n > 0;
+
+  barrier_open();
+  pthread_mutex_unlock(&barrier_lock);
+  pthread_mutex_unlock(&commit_lock);
+  free(bnums);
+}
+
+int journal_commit() {
+  assert(depth == 0);
+  if (flush_hook != NULL) {
+    flush_hook();
+  }
+  uint64_t group = atomic_load(&open_group);
+
+  // Another thread may have committed this group while this one waited.
+  pthread_mutex_lock(&commit_lock);
+  if (committed_group < group) {
+    committed_rv = commit();
+  }
+  int rv = committed_rv;
+  pthread_mutex_unlock(&commit_lock);
+  return rv;
+}
+
+/**
+ * Returns the number of milliseconds set by the environment variable
+ * `name`, or `fallback` if it sets none.
+ */
+static int env_ms(const char *name, int fallback) {
+  const char *env = getenv(name);
+  int ms = env != NULL ? atoi(env) : 0;
+  return ms > 0 ? ms : fallback;
+}
+
+// Commits every interval, and in between writes back the file blocks that
+// expired, checking twice per expiry period.
+static void *committer_main(void *arg) {
+  int interval_ms = env_ms("NUFS_COMMIT_INTERVAL", COMMIT_INTERVAL_MS);
+  int expire_ms = env_ms("NUFS_DIRTY_EXPIRE", DIRTY_EXPIRE_MS);
+  int tick_ms = expire_ms / 2 > 0 ? expire_ms / 2 : 1;
+  uint64_t next_commit = now_ms() + interval_ms;
+  is_committer = 1;
+
+  pthread_mutex_lock(&barrier_lock);
+  while (!stopping) {
+    uint64_t now = now_ms();
+    if (!full && now < next_commit) {
+      int wait_ms = next_commit - now < (uint64_t)tick_ms ? next_commit - now
+                                                          : tick_ms;
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += wait_ms / 1000;
+      ts.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&committer_cond, &barrier_lock, &ts);
+    }
+    if (stopping) {
+      break;
+    }
+
+    int commit_now = full || now_ms() >= next_commit;
+    pthread_mutex_unlock(&barrier_lock);
+    if (commit_now) {
+      journal_commit();
+      next_commit = now_ms() + interval_ms;
+    } else {
+      write_expired(expire_ms);
+    }
+    pthread_mutex_lock(&barrier_lock);
+  }
+  pthread_mutex_unlock(&barrier_lock);
+  return NULL;
+}
+
+void journal_set_flush(void (*flush)()) { flush_hook = flush; }
+
+void journal_stop() {
+  if (flush_hook != NULL) {
+    flush_hook();
+  }
+
+  pthread_mutex_lock(&barrier_lock);
+  int started = committer_started;
+  stopping = 1;
+  pthread_cond_signal(&committer_cond);
+  pthread_mutex_unlock(&barrier_lock);
+
+  if (started) {
+    pthread_join(committer, NULL);
+  }
+  journal_commit();
+
+  pthread_mutex_lock(&barrier_lock);
+  committer_started = 0;
+  stopping = 0;
+  pthread_mutex_unlock(&barrier_lock);
+}
+
+/**
+ * Returns whether the open group is empty, or has room for one more
+ * transaction besides the running ones. Called with `barrier_lock` held.
+ */
+static int group_has_room() {
+  pthread_mutex_lock(&dirty_lock);
+  int count = meta.count;
+  pthread_mutex_unlock(&dirty_lock);
+  return (count == 0 && running == 0) ||
+         count + (running + 1) * txn_blocks <= record_max;
+}
+
+/**
+ * Commits the open group unless it has room for another transaction by
+ * now.
+ */
+static void commit_full() {
+  pthread_mutex_lock(&commit_lock);
+  pthread_mutex_lock(&barrier_lock);
+  int has_room = group_has_room();
+  pthread_mutex_unlock(&barrier_lock);
+  if (!has_room) {
+    committed_rv = commit();
+  }
+  pthread_mutex_unlock(&commit_lock);
+}
+
+void journal_begin() {
+  if (depth > 0) {
+    depth++;
+    return;
+  }
+
+  pthread_mutex_lock(&barrier_lock);
+  // Started here rather than at mount, so that the thread is created in
+  // the process that serves requests.
+  if (!committer_started) {
+    int rv = pthread_create(&committer, NULL, committer_main, NULL);
+    assert(rv == 0);
+    committer_started = 1;
+  }
+  for (;;) {
+    if (blocked || (full && !is_committer)) {
+      pthread_cond_wait(&barrier_cond, &barrier_lock);
+    } else if (group_has_room()) {
+      break;
+    } else if (running > 0) {
+      // Wait for the running transactions to end, and commit then.
+      pthread_cond_wait(&barrier_cond, &barrier_lock);
+    } else {
+      pthread_mutex_unlock(&barrier_lock);
+      commit_full();
+      pthread_mutex_lock(&barrier_lock);
+    }
+  }
+  running++;
+  depth = 1;
+  pthread_mutex_unlock(&barrier_lock);
+}
+
+void journal_end() {
+  assert(depth > 0);
+  if (--depth > 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&dirty_lock);
+  int is_full = meta.count >= record_max / 2 || data.count >= MAX_DATA_BLOCKS;
+  pthread_mutex_unlock(&dirty_lock);
+
+  pthread_mutex_lock(&barrier_lock);
+  running--;
+  if (is_full && !full) {
+    full = 1;
+    pthread_cond_signal(&committer_cond);
+  }
+  if (running == 0) {
+    pthread_cond_broadcast(&barrier_cond);
+  }
+  pthread_mutex_unlock(&barrier_lock);
+}
+
+int journal_in_transaction() { return depth > 0; }
+
+void journal_dirty(const void *addr, size_t len) {
+  assert(len > 0);
+  size_t off = (const char *)addr - (const char *)blocks_get_block(0);
+  int last = (off + len - 1) / BLOCK_SIZE;
+  for (int bnum = off / BLOCK_SIZE; bnum <= last; bnum++) {
+    set_add(&meta, bnum);
+    atomic_fetch_and(&data.bits[bnum / 64], ~((uint64_t)1 << (bnum % 64)));
+  }
+}
+
+void journal_dirty_data(int inum, int bnum, int count) {
+  for (int i = bnum; i < bnum + count; i++) {
+    if (!set_has(&meta, i)) {
+      atomic_store_explicit(&data_owners[i], inum, memory_order_relaxed);
+      set_add(&data, i);
+    }
+  }
+}
+
+void journal_dirty_inode(int inum) {
+  atomic_store_explicit(&inode_groups[inum], atomic_load(&open_group),
+                        memory_order_relaxed);
+}
+
+int journal_write_file(int inum) {
+  if (atomic_load_explicit(&inode_groups[inum], memory_order_relaxed) >
+      atomic_load(&durable_group)) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&dirty_lock);
+  int *bnums = malloc((data.count + 1) * sizeof(int));
+  int n = 0;
+  for (int i = 0; i < data.count; i++) {
+    int bnum = data.bnums[i];
+    if (atomic_load_explicit(&data_owners[bnum], memory_order_relaxed) ==
+            inum &&
+        set_claim(&data, bnum)) {
+      bnums[n++] = bnum;
+    }
+  }
+  pthread_mutex_unlock(&dirty_lock);
+
+  qsort(bnums, n, sizeof(int), compare_bnums);
+  int rv = write_data(bnums, n);
+  if (rv == 0) {
+    rv = blocks_flush();
+  } else {
+    unclaim_data(bnums, n);
+  }
+  free(bnums);
+  return rv;
+}
+
+int journal_retry_alloc(int *retries) {
+  assert(depth == 0);
+  if (*retries >= 3 || !blocks_deferred()) {
+    return 0;
+  }
+  (*retries)++;
+  journal_commit();
+  return 1;
+}
@@ -0,0 +1,108 @@
+// Metadata write-ahead journal.
+//
+// The image is mapped privately, so nothing reaches the disk until the
+// journal writes it. Every operation that modifies the image runs as a
+// transaction and marks the blocks it changes: metadata blocks (bitmaps,
+// inodes, directories, extent nodes) with journal_dirty(), file contents
+// with journal_dirty_data(). Concurrent transactions are committed
+// together, every few seconds or when they grow large, and new ones wait
+// while the group could outgrow a journal record. A commit writes the
+// file contents in place, then one journal record holding every modified
+// metadata block, and only then the metadata blocks in place. Mounting
+// replays the last record, so an operation is either entirely on disk or
+// not at all. Changes made outside of a transaction are only safe while no
+// commit can run concurrently, as when mounting.
+//
+// Between commits, file blocks modified more than $NUFS_DIRTY_EXPIRE
+// milliseconds ago are written back in place, and journal_write_file()
+// writes those of a single file, so that syncing it does not wait for a
+// commit unless its metadata changed.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+#include "blocks.h"
+
+/**
+ * Replays the journal of the image described by `sb`, which is not mapped
+ * yet, and prepares it for new records.
+ */
+void journal_init(const superblock_t *sb);
+
+/**
+ * Commits what is left and stops the commit thread.
+ */
+void journal_stop();
+
+/**
+ * Sets `flush` to be called before every commit and before stopping,
+ * outside of any transaction, to turn changes held in memory into
+ * transactions.
+ */
+void journal_set_flush(void (*flush)());
+
+/**
+ * Starts a transaction, waiting for a commit in progress, and committing
+ * the running transactions first if they leave no room for another one in
+ * the journal. Transactions nest; only the outermost one counts. Must not
+ * be called while holding an inode lock, since commits wait for every
+ * transaction to end.
+ */
+void journal_begin();
+
+/**
+ * Ends the transaction started by journal_begin().
+ */
+void journal_end();
+
+/**
+ * Returns whether the calling thread is in a transaction.
+ */
+int journal_in_transaction();
+
+/**
+ * Marks the metadata blocks holding the `len` bytes at `addr`, a pointer
+ * into the mapped image, to be journaled with the running transaction.
+ */
+void journal_dirty(const void *addr, size_t len);
+
+/**
+ * Marks the `count` blocks starting at `bnum`, holding contents of the file
+ * `inum`, to be written in place before the running transaction commits.
+ */
+void journal_dirty_data(int inum, int bnum, int count);
+
+/**
+ * Records that the running transaction changes the metadata of the file
+ * `inum`: its inode, its extents or its directory entries.
+ */
+void journal_dirty_inode(int inum);
+
+/**
+ * Writes the modified blocks of the file `inum` to the disk, unless its
+ * metadata changed since the last commit. The caller holds a lock on it.
+ * Returns 0 on success, 1 if the file needs a commit instead and -1 on a
+ * write error.
+ */
+int journal_write_file(int inum);
+
+/**
+ * Commits the running transaction, along with every other one running
+ * concurrently and those the flush function starts, and waits until it is
+ * on disk.
+ * Returns 0 on success and -1 on a write error.
+ */
+int journal_commit();
+
+/**
+ * Decides whether an operation that ran out of space should be retried:
+ * blocks freed by the transactions not committed yet cannot be reused
+ * before they are, so commits them if there are any. Call outside of a
+ * transaction, with `retries` counting the previous attempts.
+ * Returns 1 if the operation should be retried and 0 otherwise.
+ */
+int journal_retry_alloc(int *retries);
+
+#endif
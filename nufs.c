@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <bsd/string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,15 +17,69 @@
 #include "blocks.h"
 #include "constants.h"
 #include "directory.h"
-#include "inode.h"
+#include "ioctl.h"
 #include "slist.h"
+#include "stats.h"
 #include "storage.h"
+#include "trace.h"
+
+// Times an operation for the stats and the trace.
+#define OP_BEGIN()                 \
+  uint64_t op_start = stats_now(); \
+  TRACE_BEGIN()
+#define OP_END(op, offset, size, rv)     \
+  stats_record(STATS_##op, op_start, rv); \
+  TRACE_END(TRACE_##op, offset, size, rv)
+
+// The stats directory and file are not on disk, see stats.h.
+enum { STATS_NODE_NONE, STATS_NODE_DIR, STATS_NODE_FILE, STATS_NODE_MISSING };
+
+// Returns which, if any, node of the stats directory `path` names.
+static int stats_node(const char *path) {
+  size_t len = strlen(STATS_DIR_PATH);
+  if (strncmp(path, STATS_DIR_PATH, len) != 0 ||
+      (path[len] != '\0' && path[len] != '/')) {
+    return STATS_NODE_NONE;
+  }
+  if (path[len] == '\0') {
+    return STATS_NODE_DIR;
+  }
+  return strcmp(path, STATS_FILE_PATH) == 0 ? STATS_NODE_FILE
+                                            : STATS_NODE_MISSING;
+}
+
+// The state of an open file, kept in fi->fh from open to release, so that
+// reads and writes do not resolve its path again. With FUSE's default of
+// hiding rather than removing open files that are unlinked, the inode stays
+// allocated for as long as the handle exists.
+typedef struct open_file {
+  int inum;                // the file, or -1 for the stats file
+  char *stats;             // the stats file's text, rendered when it was opened
+  size_t stats_len;        // the length of `stats`
+  storage_readahead_t ra;  // the reads so far, to read ahead
+} open_file_t;
+
+// Returns the open file of `fi`.
+static open_file_t *open_file_of(struct fuse_file_info *fi) {
+  return (open_file_t *)(uintptr_t)fi->fh;
+}
 
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
-  int rv = tree_lookup(path) == -1 ? -ENOENT : 0;
-  printf("access(%s, %04o) -> %d\n", path, mask, rv);
+  OP_BEGIN();
+  int rv;
+  switch (stats_node(path)) {
+    case STATS_NODE_NONE:
+      rv = tree_lookup(path) == -1 ? -ENOENT : 0;
+      break;
+    case STATS_NODE_MISSING:
+      rv = -ENOENT;
+      break;
+    default:
+      rv = (mask & W_OK) ? -EACCES : 0;
+  }
+  OP_END(ACCESS, mask, 0, rv);
   return rv;
 }
 
@@ -32,9 +87,21 @@ int nufs_access(const char *path, int mask) {
 // Implementation for: man 2 stat
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
-  int rv = storage_stat(path, st);
-  printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
-         st->st_size);
+  OP_BEGIN();
+  int rv = 0;
+  int node = stats_node(path);
+  if (node == STATS_NODE_NONE) {
+    rv = storage_stat(path, st);
+  } else if (node == STATS_NODE_MISSING) {
+    rv = -ENOENT;
+  } else {
+    // The size of the stats file is unknown until it is read.
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = node == STATS_NODE_DIR ? 040555 : 0100444;
+    st->st_nlink = 1;
+    st->st_uid = getuid();
+  }
+  OP_END(GETATTR, 0, rv < 0 ? 0 : st->st_size, rv);
   return rv;
 }
 
@@ -42,40 +109,69 @@ int nufs_getattr(const char *path, struct stat *st) {
 // lists the contents of a directory
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
+  OP_BEGIN();
   struct stat st;
   int rv;
 
+  // The mount is multithreaded: the directory, or its parent below, may be
+  // removed or renamed meanwhile.
   rv = nufs_getattr(path, &st);
-  assert(rv == 0);
+  if (rv < 0) {
+    OP_END(READDIR, offset, 0, rv);
+    return rv;
+  }
   filler(buf, SELF_REF, &st, 0);
 
+  if (stats_node(path) == STATS_NODE_DIR) {
+    rv = nufs_getattr("/", &st);
+    filler(buf, PARENT_REF, &st, 0);
+    rv = nufs_getattr(STATS_FILE_PATH, &st);
+    filler(buf, STATS_FILE_NAME, &st, 0);
+    OP_END(READDIR, offset, 0, rv);
+    return rv;
+  }
+
   int is_path_root = strcmp(path, "/") == 0;
 
   // We want parent reference if `path` is not root.
   if (!is_path_root) {
-    rv = nufs_getattr(get_parent_path(path), &st);
-    assert(rv == 0);
+    size_t parent_len;
+    path_split(path, &parent_len);
+    char parent[parent_len + 2];
+    memcpy(parent, path, parent_len);
+    strcpy(parent + parent_len, parent_len == 0 ? "/" : "");
+    rv = nufs_getattr(parent, &st);
+    if (rv < 0) {
+      OP_END(READDIR, offset, 0, rv);
+      return rv;
+    }
     filler(buf, PARENT_REF, &st, 0);
+  } else {
+    rv = nufs_getattr(STATS_DIR_PATH, &st);
+    filler(buf, STATS_DIR_NAME, &st, 0);
   }
 
-  // Linked list of entry names that are not one of the following:
-  // "", ".", ".."
-  slist_t *curr = storage_list(path);
-  s_print(curr);
+  int inum = tree_lookup(path);
+  if (inum == -1) {
+    OP_END(READDIR, offset, 0, -ENOENT);
+    return -ENOENT;
+  }
 
-  while (curr != NULL) {
-    char path_to_entry[DIR_NAME_LENGTH * 5];
-    strcpy(path_to_entry, path);
-    if (!is_path_root) {
-      strcat(path_to_entry, "/");
-    }
-    strcat(path_to_entry, curr->data);
-    rv = nufs_getattr(path_to_entry, &st);
-    filler(buf, curr->data, &st, 0);
-    curr = curr->next;
+  // Entries are stat'ed by the inode numbers the directory holds, rather
+  // than by looking up their paths.
+  int count = 0;
+  dirent_t *entries = storage_list_inum(inum, path, &count);
+  if (entries == NULL) {
+    OP_END(READDIR, offset, 0, -ENOMEM);
+    return -ENOMEM;
   }
+  for (int i = 0; i < count; i++) {
+    rv = storage_stat_inum(entries[i].inum, &st);
+    filler(buf, entries[i].name, &st, 0);
+  }
+  free(entries);
 
-  printf("readdir(%s) -> %d\n", path, rv);
+  OP_END(READDIR, offset, 0, rv);
   return rv;
 }
 
@@ -84,16 +180,26 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // Note, for this assignment, you can alternatively implement the create
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+  if (stats_node(path) != STATS_NODE_NONE) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
   int rv = storage_mknod(path, mode);
-  printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+  OP_END(MKNOD, mode, 0, rv);
   return rv;
 }
 
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode) {
-  int rv = nufs_mknod(path, mode | 040000, 0);
-  printf("mkdir(%s) -> %d\n", path, rv);
+  if (stats_node(path) != STATS_NODE_NONE) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
+  int rv = storage_mknod(path, mode | 040000);
+  OP_END(MKDIR, mode, 0, rv);
   return rv;
 }
 
@@ -110,8 +216,13 @@ int nufs_mkdir(const char *path, mode_t mode) {
 // 3. if ref == 0, deallocate the block
 // the data still stays in the block it's in, just removed from inode
 int nufs_unlink(const char *path) {
+  if (stats_node(path) != STATS_NODE_NONE) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
   int rv = storage_unlink(path);
-  printf("unlink(%s) -> %d\n", path, rv);
+  OP_END(UNLINK, 0, 0, rv);
   return rv;
 }
 
@@ -120,84 +231,259 @@ int nufs_unlink(const char *path) {
 // /a/file.txt = inode 1
 // return error if the file already exists
 int nufs_link(const char *from, const char *to) {
+  if (stats_node(from) != STATS_NODE_NONE ||
+      stats_node(to) != STATS_NODE_NONE) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
   int rv = storage_link(from, to);
-  printf("link(%s => %s) -> %d\n", from, to, rv);
+  OP_END(LINK, 0, 0, rv);
   return rv;
 }
 
 int nufs_rmdir(const char *path) {
+  if (stats_node(path) != STATS_NODE_NONE) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
   int rv = storage_unlink(path);
-  printf("rmdir(%s) -> %d\n", path, rv);
+  OP_END(RMDIR, 0, 0, rv);
   return rv;
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to) {
+  if (stats_node(from) != STATS_NODE_NONE ||
+      stats_node(to) != STATS_NODE_NONE) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
   int rv = storage_rename(from, to);
-  printf("rename(%s => %s) -> %d\n", from, to, rv);
+  OP_END(RENAME, 0, 0, rv);
   return rv;
 }
 
 int nufs_chmod(const char *path, mode_t mode) {
-  int inum = tree_lookup(path);
-  int rv = inum == -1 ? -1 : 0;
-
-  if (inum != -1) {
-    inode_t *inode = get_inode(inum);
-    inode->mode = mode;
+  if (stats_node(path) != STATS_NODE_NONE) {
+    return -EACCES;
   }
 
-  printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+  OP_BEGIN();
+  int rv = storage_chmod(path, mode);
+  OP_END(CHMOD, mode, 0, rv);
   return rv;
 }
 
 // Truncate the size of the entry at the given path
 int nufs_truncate(const char *path, off_t size) {
+  if (stats_node(path) != STATS_NODE_NONE) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
   int rv = storage_truncate(path, size);
-  printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+  OP_END(TRUNCATE, 0, size, rv);
   return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Opens the file at `path` and stores its handle in `fi`.
+static int open_file(const char *path, struct fuse_file_info *fi) {
+  open_file_t *file = calloc(1, sizeof(open_file_t));
+  if (file == NULL) {
+    return -ENOMEM;
+  }
+
+  int rv = 0;
+  switch (stats_node(path)) {
+    case STATS_NODE_NONE:
+      file->inum = storage_open(path);
+      rv = file->inum < 0 ? file->inum : 0;
+      break;
+    case STATS_NODE_FILE:
+      // Snapshot the stats, so that every read of this open file sees the
+      // same text.
+      file->inum = -1;
+      if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        rv = -EACCES;
+      } else if ((file->stats = stats_render(&file->stats_len)) == NULL) {
+        rv = -ENOMEM;
+      }
+      fi->direct_io = 1;
+      break;
+    case STATS_NODE_DIR:
+      file->inum = -1;
+      break;
+    default:
+      rv = -ENOENT;
+  }
+
+  if (rv < 0) {
+    free(file);
+    return rv;
+  }
+  fi->fh = (uintptr_t)file;
+  return 0;
+}
+
+// Resolves the file once; reads and writes use the handle from then on.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = nufs_access(path, 0);
-  printf("open(%s) -> %d\n", path, rv);
+  OP_BEGIN();
+  int rv = open_file(path, fi);
+  OP_END(OPEN, fi->flags, 0, rv);
   return rv;
 }
 
+// Creates and opens a file, for: man 2 creat
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  int rv = nufs_mknod(path, mode, 0);
+  return rv < 0 ? rv : nufs_open(path, fi);
+}
+
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  int rv = storage_read(path, buf, size, offset);
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  OP_BEGIN();
+  open_file_t *file = open_file_of(fi);
+  int rv;
+  if (file->inum == -1) {
+    rv = 0;
+    if (offset < file->stats_len) {
+      rv = file->stats_len - offset < size ? file->stats_len - offset : size;
+      memcpy(buf, file->stats + offset, rv);
+    }
+  } else {
+    TRACE_INUM(file->inum);
+    rv = storage_read_inum(file->inum, buf, size, offset, &file->ra);
+  }
+  OP_END(READ, offset, size, rv);
   return rv;
 }
 
 // Writes data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-  int rv = storage_write(path, buf, size, offset);
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  open_file_t *file = open_file_of(fi);
+  if (file->inum == -1) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
+  TRACE_INUM(file->inum);
+  int rv = storage_write_inum(file->inum, buf, size, offset);
+  OP_END(WRITE, offset, size, rv);
+  return rv;
+}
+
+// Truncates an open file, for: man 2 ftruncate
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  open_file_t *file = open_file_of(fi);
+  if (file->inum == -1) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
+  TRACE_INUM(file->inum);
+  int rv = storage_truncate_inum(file->inum, size);
+  OP_END(TRUNCATE, 0, size, rv);
+  return rv;
+}
+
+// Writes an open file back to the disk, for: man 2 fsync
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  open_file_t *file = open_file_of(fi);
+  if (file->inum == -1) {
+    return 0;
+  }
+
+  OP_BEGIN();
+  TRACE_INUM(file->inum);
+  int rv = storage_fsync(file->inum);
+  OP_END(FSYNC, datasync, 0, rv);
   return rv;
 }
 
+// Called when the last reference to an open file goes away.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  open_file_t *file = open_file_of(fi);
+  // The file's size is final for now, so its new blocks can be allocated.
+  if (file->inum != -1) {
+    storage_flush(file->inum);
+  }
+  free(file->stats);
+  free(file);
+  return 0;
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
+  if (stats_node(path) != STATS_NODE_NONE) {
+    return -EACCES;
+  }
+
+  OP_BEGIN();
   int rv = 0;
-  printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
-         ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+  OP_END(UTIMENS, 0, 0, rv);
   return rv;
 }
 
 // Extended operations
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  int rv = 0;
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+  unsigned int request = cmd;
+  int seek = request == NUFS_IOC_SEEK_DATA || request == NUFS_IOC_SEEK_HOLE;
+  int clone = request == NUFS_IOC_CLONE || request == NUFS_IOC_CLONE_RANGE;
+  int copy = request == NUFS_IOC_COPY_RANGE;
+  if ((flags & FUSE_IOCTL_DIR) || (!seek && !clone && !copy)) {
+    return -ENOTTY;
+  }
+  open_file_t *file = open_file_of(fi);
+  if (file->inum == -1) {
+    return seek ? -ENXIO : -EBADF;
+  }
+
+  OP_BEGIN();
+  TRACE_INUM(file->inum);
+  if (clone || copy) {
+    nufs_clone_range_t range = {0};
+    if (request == NUFS_IOC_CLONE) {
+      memcpy(range.src_path, data, NUFS_PATH_MAX);
+    } else {
+      memcpy(&range, data, sizeof(range));
+    }
+    range.src_path[NUFS_PATH_MAX - 1] = '\0';
+    // Keep the source from being freed if it is unlinked meanwhile.
+    int src = storage_open_pinned(range.src_path);
+    off_t rv = src;
+    if (src >= 0 && copy) {
+      rv = storage_copy_inum(src, range.src_offset, file->inum,
+                             range.dest_offset, range.length);
+    } else if (src >= 0) {
+      rv = storage_clone_inum(src, range.src_offset, file->inum,
+                              range.dest_offset, range.length);
+    }
+    if (src >= 0) {
+      storage_forget(src, 1);
+    }
+    OP_END(IOCTL, range.dest_offset, range.length, rv);
+    if (copy && rv >= 0) {
+      ((nufs_clone_range_t *)data)->length = rv;
+      rv = 0;
+    }
+    return rv;
+  }
+
+  int64_t *offset = data;
+  off_t pos = storage_seek_inum(file->inum, *offset,
+                                request == NUFS_IOC_SEEK_HOLE);
+  int rv = pos < 0 ? pos : 0;
+  if (pos >= 0) {
+    *offset = pos;
+  }
+  OP_END(IOCTL, *offset, 0, rv);
   return rv;
 }
 
@@ -207,7 +493,7 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->getattr = nufs_getattr;
   ops->readdir = nufs_readdir;
   ops->mknod = nufs_mknod;
-  // ops->create   = nufs_create; // alternative to mknod
+  ops->create = nufs_create;
   ops->mkdir = nufs_mkdir;
   ops->link = nufs_link;
   ops->unlink = nufs_unlink;
@@ -215,9 +501,12 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->rename = nufs_rename;
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
+  ops->ftruncate = nufs_ftruncate;
   ops->open = nufs_open;
   ops->read = nufs_read;
   ops->write = nufs_write;
+  ops->fsync = nufs_fsync;
+  ops->release = nufs_release;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
 };
@@ -228,9 +517,12 @@ int main(int argc, char *argv[]) {
   assert(argc > 2 && argc < 6);
 
   // should mount the block
-  storage_init(argv[--argc]);
+  if (storage_init(argv[--argc]) != 0) {
+    return 1;
+  }
   nufs_init_ops(&nufs_ops);
   int rv = fuse_main(argc, argv, &nufs_ops, NULL);
+  TRACE_DUMP();
   blocks_free();
   return rv;
 }
@@ -0,0 +1,633 @@
+// Low-level frontend: the FUSE operations on inode numbers.
+//
+// Where nufs.c gets a path for every call and resolves it again, this
+// frontend gets the inode numbers that its earlier replies handed to the
+// kernel, so it never builds or walks a path. Every entry it replies with
+// pins the inode in the storage layer until the kernel forgets it.
+//
+// FUSE inode 1 is the root, so nufs inode `inum` is FUSE inode `inum + 1`.
+// The stats directory and file, see stats.h, get FUSE inodes above every
+// nufs inode.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include "blocks.h"
+#include "constants.h"
+#include "directory.h"
+#include "ioctl.h"
+#include "stats.h"
+#include "storage.h"
+#include "trace.h"
+
+// Times an operation for the stats and the trace.
+#define OP_BEGIN()                 \
+  uint64_t op_start = stats_now(); \
+  TRACE_BEGIN()
+#define OP_END(op, offset, size, rv)     \
+  stats_record(STATS_##op, op_start, rv); \
+  TRACE_END(TRACE_##op, offset, size, rv)
+
+#define STATS_DIR_INO ((fuse_ino_t)1 << 32)
+#define STATS_FILE_INO (STATS_DIR_INO + 1)
+
+// Seconds the kernel may cache the attributes and entries replied with.
+static const double CACHE_TIMEOUT = 1.0;
+
+static fuse_ino_t ino_of(int inum) { return (fuse_ino_t)inum + FUSE_ROOT_ID; }
+
+static int inum_of(fuse_ino_t ino) { return (int)(ino - FUSE_ROOT_ID); }
+
+static int is_stats(fuse_ino_t ino) { return ino >= STATS_DIR_INO; }
+
+// The state of an open file, kept in fi->fh from open to release.
+typedef struct open_file {
+  int inum;                // the file, or -1 for the stats file
+  char *stats;             // the stats file's text, rendered when it was opened
+  size_t stats_len;        // the length of `stats`
+  storage_readahead_t ra;  // the reads so far, to read ahead
+} open_file_t;
+
+// An entry of an open directory.
+typedef struct dir_entry {
+  char name[DIR_NAME_LENGTH];
+  fuse_ino_t ino;
+} dir_entry_t;
+
+// The entries of an open directory, kept in fi->fh from opendir to
+// releasedir. They are copied on opendir, so that the offsets readdir hands
+// out stay valid while the directory changes.
+typedef struct open_dir {
+  dir_entry_t *entries;
+  int count;
+} open_dir_t;
+
+// Fills `st` with the attributes of `ino`.
+static int stat_ino(fuse_ino_t ino, struct stat *st) {
+  if (is_stats(ino)) {
+    // The size of the stats file is unknown until it is read.
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = ino == STATS_DIR_INO ? 040555 : 0100444;
+    st->st_nlink = 1;
+    st->st_uid = getuid();
+  } else {
+    int rv = storage_stat_inum(inum_of(ino), st);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  st->st_ino = ino;
+  return 0;
+}
+
+// Fills `e` with the entry for `ino`.
+static void fill_entry(struct fuse_entry_param *e, fuse_ino_t ino) {
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->ino = ino;
+  e->attr_timeout = CACHE_TIMEOUT;
+  e->entry_timeout = CACHE_TIMEOUT;
+  stat_ino(ino, &e->attr);
+}
+
+// Replies with the entry for `ino`, or with the error `rv` if negative.
+static void reply_entry(fuse_req_t req, int rv, fuse_ino_t ino) {
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+
+  struct fuse_entry_param e;
+  fill_entry(&e, ino);
+  fuse_reply_entry(req, &e);
+}
+
+void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  OP_BEGIN();
+  int rv = 0;
+  fuse_ino_t ino = 0;
+  if (parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR_NAME) == 0) {
+    ino = STATS_DIR_INO;
+  } else if (parent == STATS_DIR_INO) {
+    rv = strcmp(name, STATS_FILE_NAME) == 0 ? 0 : -ENOENT;
+    ino = STATS_FILE_INO;
+  } else {
+    rv = storage_lookup(inum_of(parent), name);
+    ino = ino_of(rv);
+    TRACE_INUM(rv);
+  }
+  OP_END(LOOKUP, 0, 0, rv);
+  reply_entry(req, rv, ino);
+}
+
+void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  if (!is_stats(ino)) {
+    storage_forget(inum_of(ino), nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi) {
+  OP_BEGIN();
+  struct stat st;
+  int rv = stat_ino(ino, &st);
+  OP_END(GETATTR, 0, rv < 0 ? 0 : st.st_size, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+  }
+}
+
+// Changes the mode and the size; times are not kept, as in nufs_utimens().
+void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                     int to_set, struct fuse_file_info *fi) {
+  if (is_stats(ino)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  int inum = inum_of(ino);
+  TRACE_INUM(inum);
+  int rv = 0;
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    rv = storage_chmod_inum(inum, attr->st_mode);
+  }
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+    rv = storage_truncate_inum(inum, attr->st_size);
+  }
+  OP_END(SETATTR, to_set, attr->st_size, rv);
+
+  struct stat st;
+  if (rv == 0) {
+    rv = stat_ino(ino, &st);
+  }
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+  }
+}
+
+void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   mode_t mode, dev_t rdev) {
+  if (is_stats(parent)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  int rv = storage_mknod_inum(inum_of(parent), name, mode);
+  TRACE_INUM(rv);
+  OP_END(MKNOD, mode, 0, rv);
+  reply_entry(req, rv, ino_of(rv));
+}
+
+void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   mode_t mode) {
+  if (is_stats(parent)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  int rv = storage_mknod_inum(inum_of(parent), name, mode | S_IFDIR);
+  TRACE_INUM(rv);
+  OP_END(MKDIR, mode, 0, rv);
+  reply_entry(req, rv, ino_of(rv));
+}
+
+void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  if (is_stats(parent)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  int rv = storage_unlink_inum(inum_of(parent), name);
+  OP_END(UNLINK, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  if (is_stats(parent)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  int rv = storage_unlink_inum(inum_of(parent), name);
+  OP_END(RMDIR, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// The kernel has checked that a directory is not moved below itself.
+void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    fuse_ino_t newparent, const char *newname) {
+  if (is_stats(parent) || is_stats(newparent)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  int rv = storage_rename_inum(inum_of(parent), name, inum_of(newparent),
+                               newname);
+  OP_END(RENAME, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                  const char *newname) {
+  if (is_stats(ino) || is_stats(newparent)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  TRACE_INUM(inum_of(ino));
+  int rv = storage_link_inum(inum_of(ino), inum_of(newparent), newname);
+  OP_END(LINK, 0, 0, rv);
+  reply_entry(req, rv, ino);
+}
+
+// Stores a handle for the file `ino` in `fi`.
+static int open_file(fuse_ino_t ino, struct fuse_file_info *fi) {
+  open_file_t *file = calloc(1, sizeof(open_file_t));
+  if (file == NULL) {
+    return -ENOMEM;
+  }
+
+  int rv = 0;
+  if (!is_stats(ino)) {
+    file->inum = inum_of(ino);
+  } else if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    rv = -EACCES;
+  } else {
+    // Snapshot the stats, so that every read of this open file sees the
+    // same text.
+    file->inum = -1;
+    file->stats = stats_render(&file->stats_len);
+    rv = file->stats == NULL ? -ENOMEM : 0;
+    fi->direct_io = 1;
+  }
+
+  if (rv < 0) {
+    free(file);
+    return rv;
+  }
+  fi->fh = (uintptr_t)file;
+  return 0;
+}
+
+static open_file_t *open_file_of(struct fuse_file_info *fi) {
+  return (open_file_t *)(uintptr_t)fi->fh;
+}
+
+void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  OP_BEGIN();
+  int rv = open_file(ino, fi);
+  OP_END(OPEN, fi->flags, 0, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_open(req, fi);
+  }
+}
+
+void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    mode_t mode, struct fuse_file_info *fi) {
+  if (is_stats(parent)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  int rv = storage_mknod_inum(inum_of(parent), name, mode);
+  TRACE_INUM(rv);
+  OP_END(MKNOD, mode, 0, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+
+  fuse_ino_t ino = ino_of(rv);
+  rv = open_file(ino, fi);
+  if (rv < 0) {
+    // The kernel never learns of the entry, so it will not forget it.
+    storage_forget(inum_of(ino), 1);
+    fuse_reply_err(req, -rv);
+    return;
+  }
+
+  struct fuse_entry_param e;
+  fill_entry(&e, ino);
+  fuse_reply_create(req, &e, fi);
+}
+
+void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                  struct fuse_file_info *fi) {
+  OP_BEGIN();
+  open_file_t *file = open_file_of(fi);
+  if (file->inum == -1) {
+    size_t len = (size_t)off < file->stats_len ? file->stats_len - off : 0;
+    len = len < size ? len : size;
+    OP_END(READ, off, size, len);
+    fuse_reply_buf(req, file->stats + off, len);
+    return;
+  }
+
+  char *buf = malloc(size);
+  int rv = buf == NULL ? -ENOMEM : 0;
+  if (rv == 0) {
+    TRACE_INUM(file->inum);
+    rv = storage_read_inum(file->inum, buf, size, off, &file->ra);
+  }
+  OP_END(READ, off, size, rv);
+
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_buf(req, buf, rv);
+  }
+  free(buf);
+}
+
+void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                   size_t size, off_t off, struct fuse_file_info *fi) {
+  open_file_t *file = open_file_of(fi);
+  if (file->inum == -1) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  OP_BEGIN();
+  TRACE_INUM(file->inum);
+  int rv = storage_write_inum(file->inum, buf, size, off);
+  OP_END(WRITE, off, size, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                   struct fuse_file_info *fi) {
+  open_file_t *file = open_file_of(fi);
+  if (file->inum == -1) {
+    fuse_reply_err(req, 0);
+    return;
+  }
+
+  OP_BEGIN();
+  TRACE_INUM(file->inum);
+  int rv = storage_fsync(file->inum);
+  OP_END(FSYNC, datasync, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+void nufs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi) {
+  open_file_t *file = open_file_of(fi);
+  // The file's size is final for now, so its new blocks can be allocated.
+  if (file->inum != -1) {
+    storage_flush(file->inum);
+  }
+  free(file->stats);
+  free(file);
+  fuse_reply_err(req, 0);
+}
+
+// Appends the entry `name` for `ino` to the open directory `dir`.
+static void add_entry(open_dir_t *dir, const char *name, fuse_ino_t ino) {
+  dir_entry_t *entry = &dir->entries[dir->count++];
+  strncpy(entry->name, name, DIR_NAME_LENGTH - 1);
+  entry->name[DIR_NAME_LENGTH - 1] = '\0';
+  entry->ino = ino;
+}
+
+void nufs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi) {
+  int count = 0;
+  dirent_t *entries = NULL;
+  if (!is_stats(ino)) {
+    entries = directory_entries(inum_of(ino), &count);
+    if (entries == NULL) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+  }
+
+  open_dir_t *dir = malloc(sizeof(open_dir_t));
+  if (dir != NULL) {
+    dir->count = 0;
+    dir->entries = malloc((count + 3) * sizeof(dir_entry_t));
+  }
+  if (dir == NULL || dir->entries == NULL) {
+    free(dir);
+    free(entries);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  // Directories do not record their parent; the kernel does not need it.
+  add_entry(dir, SELF_REF, ino);
+  add_entry(dir, PARENT_REF, ino == STATS_DIR_INO ? FUSE_ROOT_ID : ino);
+  if (ino == FUSE_ROOT_ID) {
+    add_entry(dir, STATS_DIR_NAME, STATS_DIR_INO);
+  } else if (ino == STATS_DIR_INO) {
+    add_entry(dir, STATS_FILE_NAME, STATS_FILE_INO);
+  }
+  for (int i = 0; i < count; i++) {
+    add_entry(dir, entries[i].name, ino_of(entries[i].inum));
+  }
+  free(entries);
+
+  fi->fh = (uintptr_t)dir;
+  fuse_reply_open(req, fi);
+}
+
+// Replies with the entries from the `off`th on that fit in `size` bytes.
+void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                     struct fuse_file_info *fi) {
+  open_dir_t *dir = (open_dir_t *)(uintptr_t)fi->fh;
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  OP_BEGIN();
+  size_t used = 0;
+  for (int i = off; i < dir->count; i++) {
+    struct stat st;
+    if (stat_ino(dir->entries[i].ino, &st) < 0) {
+      continue;
+    }
+    size_t len = fuse_add_direntry(req, buf + used, size - used,
+                                   dir->entries[i].name, &st, i + 1);
+    if (len > size - used) {
+      break;
+    }
+    used += len;
+  }
+  OP_END(READDIR, off, used, 0);
+
+  fuse_reply_buf(req, buf, used);
+  free(buf);
+}
+
+void nufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi) {
+  open_dir_t *dir = (open_dir_t *)(uintptr_t)fi->fh;
+  free(dir->entries);
+  free(dir);
+  fuse_reply_err(req, 0);
+}
+
+void nufs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+  fuse_reply_err(req, is_stats(ino) && (mask & W_OK) ? EACCES : 0);
+}
+
+void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                   struct fuse_file_info *fi, unsigned flags,
+                   const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+  unsigned int request = cmd;
+  int seek = request == NUFS_IOC_SEEK_DATA || request == NUFS_IOC_SEEK_HOLE;
+  int clone = request == NUFS_IOC_CLONE || request == NUFS_IOC_CLONE_RANGE;
+  int copy = request == NUFS_IOC_COPY_RANGE;
+  if ((flags & FUSE_IOCTL_DIR) || (!seek && !clone && !copy)) {
+    fuse_reply_err(req, ENOTTY);
+    return;
+  }
+  if (is_stats(ino)) {
+    fuse_reply_err(req, seek ? ENXIO : EBADF);
+    return;
+  }
+
+  OP_BEGIN();
+  int inum = inum_of(ino);
+  TRACE_INUM(inum);
+  if (clone || copy) {
+    nufs_clone_range_t range = {0};
+    if (request == NUFS_IOC_CLONE) {
+      memcpy(range.src_path, in_buf, NUFS_PATH_MAX);
+    } else {
+      memcpy(&range, in_buf, sizeof(range));
+    }
+    range.src_path[NUFS_PATH_MAX - 1] = '\0';
+    // Keep the source from being freed if it is unlinked meanwhile.
+    int src = storage_open_pinned(range.src_path);
+    off_t rv = src;
+    if (src >= 0 && copy) {
+      rv = storage_copy_inum(src, range.src_offset, inum, range.dest_offset,
+                             range.length);
+    } else if (src >= 0) {
+      rv = storage_clone_inum(src, range.src_offset, inum, range.dest_offset,
+                              range.length);
+    }
+    if (src >= 0) {
+      storage_forget(src, 1);
+    }
+    OP_END(IOCTL, range.dest_offset, range.length, rv);
+    if (rv < 0) {
+      fuse_reply_err(req, -rv);
+    } else if (copy) {
+      range.length = rv;
+      fuse_reply_ioctl(req, 0, &range, sizeof(range));
+    } else {
+      fuse_reply_ioctl(req, 0, NULL, 0);
+    }
+    return;
+  }
+
+  int64_t offset;
+  memcpy(&offset, in_buf, sizeof(offset));
+  off_t pos = storage_seek_inum(inum, offset, request == NUFS_IOC_SEEK_HOLE);
+  int rv = pos < 0 ? pos : 0;
+  OP_END(IOCTL, offset, 0, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  offset = pos;
+  fuse_reply_ioctl(req, 0, &offset, sizeof(offset));
+}
+
+void nufs_ll_init_ops(struct fuse_lowlevel_ops *ops) {
+  memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+  ops->lookup = nufs_ll_lookup;
+  ops->forget = nufs_ll_forget;
+  ops->getattr = nufs_ll_getattr;
+  ops->setattr = nufs_ll_setattr;
+  ops->mknod = nufs_ll_mknod;
+  ops->mkdir = nufs_ll_mkdir;
+  ops->unlink = nufs_ll_unlink;
+  ops->rmdir = nufs_ll_rmdir;
+  ops->rename = nufs_ll_rename;
+  ops->link = nufs_ll_link;
+  ops->open = nufs_ll_open;
+  ops->create = nufs_ll_create;
+  ops->read = nufs_ll_read;
+  ops->write = nufs_ll_write;
+  ops->fsync = nufs_ll_fsync;
+  ops->release = nufs_ll_release;
+  ops->opendir = nufs_ll_opendir;
+  ops->readdir = nufs_ll_readdir;
+  ops->releasedir = nufs_ll_releasedir;
+  ops->access = nufs_ll_access;
+  ops->ioctl = nufs_ll_ioctl;
+}
+
+struct fuse_lowlevel_ops nufs_ll_ops;
+
+int main(int argc, char *argv[]) {
+  assert(argc > 2 && argc < 6);
+
+  // should mount the block
+  if (storage_init(argv[--argc]) != 0) {
+    return 1;
+  }
+  nufs_ll_init_ops(&nufs_ll_ops);
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mountpoint;
+  int multithreaded;
+  int foreground;
+  int rv = -1;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) !=
+      -1) {
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch != NULL) {
+      struct fuse_session *se = fuse_lowlevel_new(&args, &nufs_ll_ops,
+                                                  sizeof(nufs_ll_ops), NULL);
+      if (se != NULL) {
+        if (fuse_set_signal_handlers(se) != -1) {
+          fuse_session_add_chan(se, ch);
+          fuse_daemonize(foreground);
+          rv = multithreaded ? fuse_session_loop_mt(se)
+                             : fuse_session_loop(se);
+          fuse_remove_signal_handlers(se);
+          fuse_session_remove_chan(ch);
+        }
+        fuse_session_destroy(se);
+      }
+      fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+  }
+  fuse_opt_free_args(&args);
+
+  TRACE_DUMP();
+  blocks_free();
+  return rv == 0 ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+// Reference table and dedup index.
+//
+// The reference table holds a word per block: the number of references
+// past the first, and whether the block is in the dedup index. An entry of
+// the index holds the full hash of a block's contents, so that lookups
+// only compare the contents of blocks whose hash matches. A block is found
+// again, to be taken out of the index, by hashing its contents, which
+// cannot have changed since it was indexed.
+
+#include "share.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "journal.h"
+
+#define SHARE_INDEXED 0x80000000u
+#define SHARE_REFS 0x7fffffffu
+
+typedef struct dedup_entry {
+  uint64_t hash;  // hash of the contents of the block
+  int bnum;       // block number, 0 if the entry is free
+  int _reserved;
+} dedup_entry_t;
+
+static int dedup = 0;
+
+// Guards the reference table and the dedup index.
+static pthread_mutex_t share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void share_init() {
+  const char *value = getenv("NUFS_DEDUP");
+  dedup = value != NULL && *value != '\0' && strcmp(value, "0") != 0;
+}
+
+int share_dedup_enabled() { return dedup; }
+
+static uint32_t *refs_word(int bnum) {
+  uint32_t *refs = blocks_get_block(get_superblock()->refs_bnum);
+  return &refs[bnum];
+}
+
+static uint64_t hash_block(const void *data) {
+  // Four independent lanes, so that the multiplies overlap.
+  const uint64_t k = 0x9e3779b97f4a7c15;
+  uint64_t lanes[4] = {1, 2, 3, 4};
+  const char *p = data;
+  for (int i = 0; i < BLOCK_SIZE; i += sizeof(lanes)) {
+    for (int l = 0; l < 4; l++) {
+      uint64_t w;
+      memcpy(&w, p + i + l * sizeof(w), sizeof(w));
+      lanes[l] = (lanes[l] ^ w) * k;
+      lanes[l] ^= lanes[l] >> 29;
+    }
+  }
+
+  uint64_t h = 0;
+  for (int l = 0; l < 4; l++) {
+    h = (h ^ lanes[l]) * k;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+/**
+ * Returns the first entry of the index bucket for `hash`, setting `count`
+ * to the number of entries in it.
+ */
+static dedup_entry_t *bucket(uint64_t hash, int *count) {
+  superblock_t *sb = get_superblock();
+  *count = BLOCK_SIZE / sizeof(dedup_entry_t);
+  return blocks_get_block(sb->index_bnum + hash % sb->index_blocks);
+}
+
+/**
+ * Takes the block `bnum` out of the dedup index if it is in it. The caller
+ * holds `share_lock`.
+ */
+static void unindex(int bnum) {
+  uint32_t *word = refs_word(bnum);
+  if (!(*word & SHARE_INDEXED)) {
+    return;
+  }
+
+  uint64_t hash = hash_block(blocks_get_block(bnum));
+  int count;
+  dedup_entry_t *entries = bucket(hash, &count);
+  for (int i = 0; i < count; i++) {
+    if (entries[i].bnum == bnum) {
+      journal_dirty(&entries[i], sizeof(dedup_entry_t));
+      memset(&entries[i], 0, sizeof(dedup_entry_t));
+      break;
+    }
+  }
+  journal_dirty(word, sizeof(*word));
+  *word &= ~SHARE_INDEXED;
+}
+
+void share_ref(int bnum, int n) {
+  pthread_mutex_lock(&share_lock);
+  for (int i = 0; i < n; i++) {
+    uint32_t *word = refs_word(bnum + i);
+    assert((*word & SHARE_REFS) < SHARE_REFS);
+    journal_dirty(word, sizeof(*word));
+    (*word)++;
+  }
+  pthread_mutex_unlock(&share_lock);
+}
+
+/**
+ * Does the work of share_release() if `drop` is set, and of
+ * share_exclusive() otherwise.
+ */
+static int leading_run(int bnum, int n, int *shared, int drop) {
+  assert(n > 0);
+  pthread_mutex_lock(&share_lock);
+  *shared = (*refs_word(bnum) & SHARE_REFS) != 0;
+  int run = 0;
+  for (; run < n; run++) {
+    uint32_t *word = refs_word(bnum + run);
+    if (((*word & SHARE_REFS) != 0) != *shared) {
+      break;
+    }
+    if (!*shared) {
+      unindex(bnum + run);
+    } else if (drop) {
+      journal_dirty(word, sizeof(*word));
+      (*word)--;
+    }
+  }
+  pthread_mutex_unlock(&share_lock);
+  return run;
+}
+
+int share_release(int bnum, int n, int *shared) {
+  return leading_run(bnum, n, shared, 1);
+}
+
+int share_exclusive(int bnum, int n, int *shared) {
+  return leading_run(bnum, n, shared, 0);
+}
+
+int share_find(const void *data) {
+  uint64_t hash = hash_block(data);
+  int count;
+  dedup_entry_t *entries = bucket(hash, &count);
+
+  pthread_mutex_lock(&share_lock);
+  int found = -1;
+  for (int i = 0; i < count && found == -1; i++) {
+    if (entries[i].bnum != 0 && entries[i].hash == hash &&
+        memcmp(blocks_get_block(entries[i].bnum), data, BLOCK_SIZE) == 0) {
+      found = entries[i].bnum;
+    }
+  }
+  if (found != -1) {
+    uint32_t *word = refs_word(found);
+    if ((*word & SHARE_REFS) == SHARE_REFS) {
+      found = -1;
+    } else {
+      journal_dirty(word, sizeof(*word));
+      (*word)++;
+    }
+  }
+  pthread_mutex_unlock(&share_lock);
+  return found;
+}
+
+void share_index(int bnum) {
+  uint64_t hash = hash_block(blocks_get_block(bnum));
+  int count;
+  dedup_entry_t *entries = bucket(hash, &count);
+
+  pthread_mutex_lock(&share_lock);
+  uint32_t *word = refs_word(bnum);
+  for (int i = 0; i < count && !(*word & SHARE_INDEXED); i++) {
+    if (entries[i].bnum == 0) {
+      journal_dirty(&entries[i], sizeof(dedup_entry_t));
+      entries[i].hash = hash;
+      entries[i].bnum = bnum;
+      journal_dirty(word, sizeof(*word));
+      *word |= SHARE_INDEXED;
+    }
+  }
+  pthread_mutex_unlock(&share_lock);
+}
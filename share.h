@@ -0,0 +1,68 @@
+// Blocks shared between files.
+//
+// A data block may back several files, or several blocks of one, once it is
+// deduplicated. The reference table, on disk next to the bitmaps, counts
+// the references to every block past the first: freeing a shared block
+// only drops a reference, and a file writes to a shared block by copying it
+// first.
+//
+// With $NUFS_DEDUP set, every block of file contents is looked up in the
+// dedup index as it is flushed, and shared with the block holding the same
+// contents if there is one. The index is a hash table on disk from the
+// contents of blocks to their numbers, whose buckets are blocks of entries;
+// a block whose bucket is full is simply not indexed. Indexed blocks are
+// never modified in place: writers take them out of the index first, with
+// share_exclusive(). Blocks stay shared, and indexed, when mounting without
+// $NUFS_DEDUP.
+
+#ifndef SHARE_H
+#define SHARE_H
+
+/**
+ * Reads the dedup setting from the environment.
+ */
+void share_init();
+
+/**
+ * Returns whether file contents are deduplicated as they are flushed.
+ */
+int share_dedup_enabled();
+
+/**
+ * Adds a reference to each of the `n` blocks starting at `bnum`, which are
+ * in use.
+ */
+void share_ref(int bnum, int n);
+
+/**
+ * Drops a reference to each of the leading blocks of the `n` starting at
+ * `bnum` that are either all shared or all referenced once, and sets
+ * `shared` to tell which. The caller frees the blocks referenced once,
+ * which are taken out of the dedup index.
+ * Returns the number of leading blocks, at least 1.
+ */
+int share_release(int bnum, int n, int *shared);
+
+/**
+ * Finds the leading blocks of the `n` starting at `bnum` that are either
+ * all shared or all referenced once, and sets `shared` to tell which. The
+ * blocks referenced once are taken out of the dedup index, so that their
+ * only file can write to them in place; the shared ones must be copied.
+ * Returns the number of leading blocks, at least 1.
+ */
+int share_exclusive(int bnum, int n, int *shared);
+
+/**
+ * Looks up the contents of a block, `data`, in the dedup index.
+ * Returns the number of a block holding the same contents, with a
+ * reference added for the caller, or -1 if none is indexed.
+ */
+int share_find(const void *data);
+
+/**
+ * Adds the block `bnum`, referenced once, to the dedup index, unless its
+ * bucket is full.
+ */
+void share_index(int bnum);
+
+#endif
@@ -0,0 +1,140 @@
+// Operation counters and latency histograms.
+//
+// Bucket `i` counts the events that took at most 2^(i + STATS_MIN_SHIFT)
+// nanoseconds, the last bucket those that took longer than any other.
+
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// The smallest bucket is 128ns, the largest about 1s.
+#define STATS_MIN_SHIFT 7
+#define STATS_BUCKETS 24
+
+typedef struct stats_histogram {
+  _Atomic uint64_t count;
+  _Atomic uint64_t errors;
+  _Atomic uint64_t sum_ns;
+  _Atomic uint64_t buckets[STATS_BUCKETS + 1];
+} stats_histogram_t;
+
+static stats_histogram_t histograms[STATS_METRIC_COUNT];
+
+// Name of each metric, in the `op` label of its family.
+static const char *metric_names[STATS_METRIC_COUNT] = {
+    [STATS_ACCESS] = "access",
+    [STATS_GETATTR] = "getattr",
+    [STATS_READDIR] = "readdir",
+    [STATS_MKNOD] = "mknod",
+    [STATS_MKDIR] = "mkdir",
+    [STATS_UNLINK] = "unlink",
+    [STATS_LINK] = "link",
+    [STATS_RMDIR] = "rmdir",
+    [STATS_RENAME] = "rename",
+    [STATS_CHMOD] = "chmod",
+    [STATS_TRUNCATE] = "truncate",
+    [STATS_OPEN] = "open",
+    [STATS_READ] = "read",
+    [STATS_WRITE] = "write",
+    [STATS_UTIMENS] = "utimens",
+    [STATS_IOCTL] = "ioctl",
+    [STATS_FSYNC] = "fsync",
+    [STATS_LOOKUP] = "lookup",
+    [STATS_SETATTR] = "setattr",
+    [STATS_PATH_LOOKUP] = "path_lookup",
+    [STATS_DIR_LOOKUP] = "dir_lookup",
+    [STATS_BITMAP_SCAN] = "bitmap_scan",
+    [STATS_ALLOC_BLOCKS] = "alloc_blocks",
+};
+
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns the bucket that counts an event which took `ns` nanoseconds.
+static int bucket_of(uint64_t ns) {
+  if (ns <= (1 << STATS_MIN_SHIFT)) {
+    return 0;
+  }
+  int bucket = 64 - __builtin_clzll(ns - 1) - STATS_MIN_SHIFT;
+  return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS;
+}
+
+void stats_record(stats_metric_t metric, uint64_t start, int result) {
+  uint64_t ns = stats_now() - start;
+  stats_histogram_t *h = &histograms[metric];
+
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->buckets[bucket_of(ns)], 1,
+                            memory_order_relaxed);
+  if (result < 0) {
+    atomic_fetch_add_explicit(&h->errors, 1, memory_order_relaxed);
+  }
+}
+
+/**
+ * Renders the histograms of the metrics [`from`, `to`), which are `what`,
+ * as the family `name`.
+ */
+static void render_family(FILE *out, const char *name, const char *what,
+                          int from, int to) {
+  fprintf(out, "# HELP %s_duration_seconds Latency of %s.\n", name, what);
+  fprintf(out, "# TYPE %s_duration_seconds histogram\n", name);
+  for (int m = from; m < to; m++) {
+    stats_histogram_t *h = &histograms[m];
+    uint64_t cumulative = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+      cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+      fprintf(out, "%s_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n",
+              name, metric_names[m], (1 << (i + STATS_MIN_SHIFT)) / 1e9,
+              (unsigned long long)cumulative);
+    }
+
+    // The count and the buckets are updated separately; keep them agreeing.
+    cumulative += atomic_load_explicit(&h->buckets[STATS_BUCKETS],
+                                       memory_order_relaxed);
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    count = count > cumulative ? count : cumulative;
+    uint64_t sum_ns = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+    fprintf(out, "%s_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+            name, metric_names[m], (unsigned long long)count);
+    fprintf(out, "%s_duration_seconds_sum{op=\"%s\"} %.9f\n", name,
+            metric_names[m], sum_ns / 1e9);
+    fprintf(out, "%s_duration_seconds_count{op=\"%s\"} %llu\n", name,
+            metric_names[m], (unsigned long long)count);
+  }
+
+  fprintf(out, "# HELP %s_errors_total Number of %s that failed.\n", name,
+          what);
+  fprintf(out, "# TYPE %s_errors_total counter\n", name);
+  for (int m = from; m < to; m++) {
+    uint64_t errors =
+        atomic_load_explicit(&histograms[m].errors, memory_order_relaxed);
+    fprintf(out, "%s_errors_total{op=\"%s\"} %llu\n", name, metric_names[m],
+            (unsigned long long)errors);
+  }
+}
+
+char *stats_render(size_t *len) {
+  char *text = NULL;
+  FILE *out = open_memstream(&text, len);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  render_family(out, "nufs_op", "FUSE operations", 0, STATS_PATH_LOOKUP);
+  render_family(out, "nufs_storage", "storage layer steps", STATS_PATH_LOOKUP,
+                STATS_METRIC_COUNT);
+
+  if (fclose(out) != 0) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
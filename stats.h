@@ -0,0 +1,68 @@
+// Operation counters and latency histograms.
+//
+// Every FUSE operation, and a few hot spots of the storage layer below it,
+// records its latency into a histogram with power-of-two buckets. The
+// counters are updated with relaxed atomics and never touch the disk image.
+// They are published in Prometheus text format through the read-only file
+// STATS_FILE_PATH.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_DIR_NAME ".nufs"
+#define STATS_FILE_NAME "stats"
+#define STATS_DIR_PATH "/" STATS_DIR_NAME
+#define STATS_FILE_PATH STATS_DIR_PATH "/" STATS_FILE_NAME
+
+typedef enum stats_metric {
+  // FUSE operations.
+  STATS_ACCESS,
+  STATS_GETATTR,
+  STATS_READDIR,
+  STATS_MKNOD,
+  STATS_MKDIR,
+  STATS_UNLINK,
+  STATS_LINK,
+  STATS_RMDIR,
+  STATS_RENAME,
+  STATS_CHMOD,
+  STATS_TRUNCATE,
+  STATS_OPEN,
+  STATS_READ,
+  STATS_WRITE,
+  STATS_UTIMENS,
+  STATS_IOCTL,
+  STATS_FSYNC,
+  STATS_LOOKUP,
+  STATS_SETATTR,
+  // Storage layer.
+  STATS_PATH_LOOKUP,
+  STATS_DIR_LOOKUP,
+  STATS_BITMAP_SCAN,
+  STATS_ALLOC_BLOCKS,
+  STATS_METRIC_COUNT
+} stats_metric_t;
+
+/**
+ * Returns the current time, to pass to stats_record() as `start`.
+ */
+uint64_t stats_now();
+
+/**
+ * Counts one `metric` event that started at `start`, failing if `result`
+ * is negative.
+ */
+void stats_record(stats_metric_t metric, uint64_t start, int result);
+
+/**
+ * Renders every metric in Prometheus text format into a new buffer, which
+ * the caller must free.
+ * Returns the buffer and sets `len` to its length, or returns NULL if out of
+ * memory.
+ */
+char *stats_render(size_t *len);
+
+#endif
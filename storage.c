@@ -2,173 +2,1916 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "bitmap.h"
+#include "compress.h"
 #include "constants.h"
+#include "dcache.h"
 #include "directory.h"
+#include "extent.h"
 #include "inode.h"
+#include "journal.h"
+#include "share.h"
+#include "trace.h"
 
-void storage_init(const char *path) {
-  blocks_init(path);
-  directory_init();
+/**
+ * Drops the cached lookups of `path`, and of every path below it if `tree`
+ * is set. A NULL `path` stands for a change made by inode number, which
+ * drops the whole cache.
+ */
+static void invalidate(const char *path, int tree) {
+  if (path == NULL) {
+    dcache_clear();
+  } else if (tree) {
+    dcache_invalidate_tree(path);
+  } else {
+    dcache_invalidate(path);
+  }
 }
 
-int storage_mknod(const char *path, int mode) {
-  int parent_inum = tree_lookup(get_parent_path(path));
-  if (parent_inum == -1) {
-    return -ENOENT;
+// Blocks written past the mapped blocks of a file are held in memory, and
+// only get disk blocks when the file is flushed: when it is closed or
+// synced, before periodic commits, or once too many are held. By then the
+// size of the file is known, so they can be allocated in one run. They are
+// reserved as they are written, so that allocating them cannot run out of
+// space.
+typedef struct delalloc {
+  int lblk;      // first logical block held
+  int count;     // blocks held, read in place of whatever they map to
+  int reserved;  // blocks reserved for them
+  int cap;       // blocks `data` has room for
+  char *data;
+} delalloc_t;
+
+// Most blocks held for a file, and for all of them.
+static const int DELALLOC_FILE_BLOCKS = 256;
+static const int DELALLOC_TOTAL_BLOCKS = 16384;
+
+// The blocks held for every file, guarded by the file's lock, and how many
+// there are in all.
+static delalloc_t *_Atomic *delallocs = NULL;
+static _Atomic int delalloc_total = 0;
+
+// With $NUFS_COMPRESS set, held blocks are compressed as they are flushed,
+// in clusters of this many that start at multiples of it, the last one of
+// a file possibly shorter. A cluster that saves a block is stored as one
+// compressed extent. Writing to it, or cutting it, first turns it back
+// into plain blocks.
+static const int CLUSTER_BLOCKS = 16;
+static int compress_clusters = 0;
+
+// Most bytes storage_copy_inum() writes at once.
+static const size_t COPY_CHUNK = 1 << 20;
+
+/**
+ * Discards the blocks held for the file `inum`, which the caller has locked
+ * for writing.
+ */
+static void delalloc_drop(int inum) {
+  delalloc_t *d = delallocs[inum];
+  if (d != NULL) {
+    blocks_unreserve(d->reserved);
+    atomic_fetch_sub(&delalloc_total, d->count);
+    free(d->data);
+    free(d);
+    delallocs[inum] = NULL;
   }
+}
 
-  char *entry_name = get_entry_name(path);
-  inode_t *parent_dd = get_inode(parent_inum);
+/**
+ * Frees the inode `inum` and its blocks, once no entry links to it and
+ * nothing pins it.
+ */
+static void release_inode(int inum) {
+  delalloc_drop(inum);
+  extent_remove(get_inode(inum), 0, EXTENT_MAX_LBLK);
+  free_inode(inum);
+}
 
-  // Check if a new entry can be made
-  int valid_block = next_free_block() != -1;
-  int valid_inode = next_free_inode() != -1;
-  int has_space = parent_dd->size + sizeof(dirent_t) <= BLOCK_SIZE;
-  if (!(valid_block && valid_inode && has_space)) {
-    return -ENOENT;
+/**
+ * Frees the inodes that were unlinked while pinned and never unpinned
+ * before the image was unmounted.
+ */
+static void reclaim_orphans() {
+  void *ibm = get_inode_bitmap();
+  for (int inum = 0; inum < INODE_COUNT; inum++) {
+    if (bitmap_get(ibm, inum) && get_inode(inum)->refs == 0) {
+      release_inode(inum);
+    }
   }
+}
+
+static void flush_all();
+static int unshare_range(int inum, off_t offset, size_t size);
+
+int storage_init(const char *path) {
+  if (blocks_init(path) != 0) {
+    return -1;
+  }
+  inodes_init();
+  directory_init();
+  // Lookups cached from an image mounted earlier no longer hold.
+  dcache_clear();
 
-  // Allocate data block for new entry
-  int new_entry_bnum = alloc_block();
+  free((void *)delallocs);
+  delallocs = calloc(INODE_COUNT, sizeof(delalloc_t *));
+  assert(delallocs != NULL);
+  delalloc_total = 0;
+  journal_set_flush(flush_all);
+
+  assert((size_t)CLUSTER_BLOCKS * BLOCK_SIZE <= COMPRESS_MAX_INPUT);
+  const char *compress = getenv("NUFS_COMPRESS");
+  compress_clusters =
+      compress != NULL && *compress != '\0' && strcmp(compress, "0") != 0;
+  share_init();
+
+  reclaim_orphans();
+  blocks_sync();
+  return 0;
+}
+
+/**
+ * Creates the entry `name` with the given `mode` in the directory
+ * `dir_inum`, which the caller has locked for writing.
+ * Returns the new inode number on success and a negative error code as
+ * storage_mknod() does otherwise.
+ */
+static int mknod_at(int dir_inum, const char *name, int mode) {
+  inode_t *parent_dd = get_inode(dir_inum);
+  if (parent_dd->refs == 0) {
+    // Removed since its path was resolved.
+    return -ENOENT;
+  }
+  if (directory_lookup(parent_dd, name) != -1) {
+    return -EEXIST;
+  }
 
-  // Allocate inode for new entry
-  int new_entry_inum = alloc_inode();
+  // Allocate the inode for the new entry, and a data block for a
+  // directory. A file starts out inline.
+  int new_entry_bnum = S_ISDIR(mode) ? alloc_block() : 0;
+  int new_entry_inum = new_entry_bnum == -1 ? -1 : alloc_inode();
+  if (new_entry_inum == -1) {
+    if (new_entry_bnum > 0) {
+      free_block(new_entry_bnum);
+    }
+    return -ENOSPC;
+  }
+  TRACE_INUM(new_entry_inum);
 
+  // No other thread can reach the new inode before it is in the directory.
   inode_t *entry_node = get_inode(new_entry_inum);
   entry_node->refs = 1;
   entry_node->mode = mode;
   entry_node->size = 0;
-  entry_node->block = new_entry_bnum;
+  entry_node->flags = new_entry_bnum == 0 ? INODE_INLINE : 0;
+  memset(entry_node->inline_data, 0, INODE_INLINE_SIZE);
+  extent_init(entry_node);
+  if (new_entry_bnum != 0) {
+    assert(extent_insert(entry_node, 0, new_entry_bnum, 1) == 0);
+    void *block = blocks_get_block(new_entry_bnum);
+    memset(block, 0, BLOCK_SIZE);
+    journal_dirty(block, BLOCK_SIZE);
+  }
+
+  if (directory_put(parent_dd, name, new_entry_inum) == -1) {
+    extent_remove(entry_node, 0, EXTENT_MAX_LBLK);
+    free_inode(new_entry_inum);
+    return -ENOSPC;
+  }
+
+  return new_entry_inum;
+}
+
+int storage_mknod(const char *path, int mode) {
+  char entry_name[DIR_NAME_LENGTH];
+  int parent_inum = path_lookup_parent(path, entry_name);
+  if (parent_inum == -1) {
+    return -ENOENT;
+  }
 
-  assert(directory_put(parent_dd, entry_name, new_entry_inum) != -1);
+  int inum;
+  int retries = 0;
+  do {
+    journal_begin();
+    inode_write_lock(parent_inum);
+    inum = mknod_at(parent_inum, entry_name, mode);
+    inode_unlock(parent_inum);
+    journal_end();
+  } while (inum == -ENOSPC && journal_retry_alloc(&retries));
 
+  if (inum < 0) {
+    return inum;
+  }
+  invalidate(path, 0);
   return 0;
 }
 
+int storage_mknod_inum(int dir_inum, const char *name, int mode) {
+  if (strlen(name) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+
+  int inum;
+  int retries = 0;
+  do {
+    journal_begin();
+    inode_write_lock(dir_inum);
+    inum = mknod_at(dir_inum, name, mode);
+    if (inum >= 0) {
+      inode_pin(inum);
+    }
+    inode_unlock(dir_inum);
+    journal_end();
+  } while (inum == -ENOSPC && journal_retry_alloc(&retries));
+
+  if (inum >= 0) {
+    invalidate(NULL, 0);
+  }
+  return inum;
+}
+
+int storage_lookup(int dir_inum, const char *name) {
+  inode_t *dd = get_inode(dir_inum);
+  inode_read_lock(dir_inum);
+  int inum = is_dir(dd) ? directory_lookup(dd, name) : -1;
+  if (inum != -1) {
+    inode_pin(inum);
+  }
+  inode_unlock(dir_inum);
+  return inum == -1 ? -ENOENT : inum;
+}
+
+void storage_forget(int inum, int count) {
+  journal_begin();
+  // Only freeing the inode changes it.
+  inode_write_lock_contents(inum);
+  if (inode_unpin(inum, count) == 0 && get_inode(inum)->refs == 0) {
+    inode_dirty(inum);
+    release_inode(inum);
+  }
+  inode_unlock(inum);
+  journal_end();
+}
+
 int storage_stat(const char *path, struct stat *st) {
   int inum = tree_lookup(path);
   if (inum == -1) {
     return -ENOENT;
   }
+  return storage_stat_inum(inum, st);
+}
+
+/**
+ * Returns the number of disk blocks that the file `inum`, which the caller
+ * has locked, takes or has reserved. Holes take none, so copy tools can
+ * tell a sparse file from its size.
+ */
+static blkcnt_t count_blocks(int inum, inode_t *inode) {
+  blkcnt_t count = 0;
+  extent_t ext;
+  for (int lblk = 0; extent_next(inode, lblk, &ext) == 0;
+       lblk = ext.lblk + ext.len) {
+    count += extent_blocks(&ext);
+  }
 
+  delalloc_t *d = delallocs[inum];
+  return d != NULL ? count + d->reserved : count;
+}
+
+int storage_stat_inum(int inum, struct stat *st) {
   memset(st, 0, sizeof(struct stat));
   inode_t *inode = get_inode(inum);
+  inode_read_lock(inum);
   st->st_mode = inode->mode;
   st->st_size = inode->size;
+  st->st_nlink = inode->refs;
+  st->st_blocks = count_blocks(inum, inode) * (BLOCK_SIZE / 512);
+  inode_unlock(inum);
   st->st_uid = getuid();
+  st->st_blksize = BLOCK_SIZE;
 
   return 0;
 }
 
+int storage_open(const char *path) {
+  int inum = tree_lookup(path);
+  return inum == -1 ? -ENOENT : inum;
+}
+
+int storage_open_pinned(const char *path) {
+  char name[DIR_NAME_LENGTH];
+  int parent_inum = path_lookup_parent(path, name);
+  if (parent_inum != -1) {
+    return storage_lookup(parent_inum, name);
+  }
+
+  // The root has no parent to lock, and is never freed.
+  int inum = storage_open(path);
+  if (inum >= 0) {
+    inode_pin(inum);
+  }
+  return inum;
+}
+
 int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-  int file_inum = tree_lookup(path);
-  if (file_inum == -1) {
-    return -ENOENT;
+  int inum = storage_open(path);
+  return inum < 0 ? inum : storage_read_inum(inum, buf, size, offset, NULL);
+}
+
+// Reading ahead starts with this many blocks, and doubles up to the maximum
+// for as long as the reads stay sequential. Reads that keep going past the
+// maximum are taken for a scan, and the blocks they leave behind are let go
+// first.
+static const int READAHEAD_MIN_BLOCKS = 32;
+static const int READAHEAD_MAX_BLOCKS = 512;
+
+/**
+ * Gives `advice` for the blocks backing blocks [`start`, `end`) of the
+ * given `inode`, skipping holes.
+ */
+static void advise_range(inode_t *inode, int start, int end,
+                         blocks_advice_t advice) {
+  for (int lblk = start; lblk < end;) {
+    int run;
+    int bnum = extent_map(inode, lblk, &run);
+    run = run < end - lblk ? run : end - lblk;
+    if (bnum > 0) {
+      blocks_advise(bnum, run, advice);
+    } else if (bnum == -1) {
+      // A compressed cluster is read whole.
+      extent_t ext;
+      extent_next(inode, lblk, &ext);
+      blocks_advise(ext.pblk, extent_blocks(&ext), advice);
+    }
+    lblk += run;
+  }
+}
+
+/**
+ * Accounts a read of the bytes [`offset`, `end`) of the given `inode` in
+ * `ra`, and once half of the blocks requested ahead of sequential reads
+ * are consumed, requests the next window. Does nothing if another read is
+ * updating `ra`.
+ * Returns 1 if the reads scan the file and 0 otherwise.
+ */
+static int read_ahead(inode_t *inode, storage_readahead_t *ra, off_t offset,
+                      off_t end) {
+  if (atomic_exchange_explicit(&ra->busy, 1, memory_order_acquire)) {
+    return 0;
+  }
+
+  int window = ra->window;
+  off_t ahead = ra->ahead;
+  if (offset != ra->next) {
+    window = 0;
+    ahead = 0;
+  } else if (ahead < end + (off_t)window * BLOCK_SIZE / 2) {
+    window = window == 0 ? READAHEAD_MIN_BLOCKS : window * 2;
+    window = window < READAHEAD_MAX_BLOCKS ? window : READAHEAD_MAX_BLOCKS;
+
+    int eof = bytes_to_blocks(inode->size);
+    int from = bytes_to_blocks(ahead > end ? ahead : end);
+    int to = bytes_to_blocks(end) + window;
+    to = to < eof ? to : eof;
+    advise_range(inode, from, to, BLOCKS_WILLNEED);
+    ahead = (off_t)to * BLOCK_SIZE;
   }
 
+  ra->next = end;
+  ra->window = window;
+  ra->ahead = ahead;
+  atomic_store_explicit(&ra->busy, 0, memory_order_release);
+  return window == READAHEAD_MAX_BLOCKS;
+}
+
+/**
+ * Decompresses the cluster `ext` into `data`, which has room for its
+ * blocks.
+ * Returns 0 on success and -1 if it is corrupt.
+ */
+static int read_cluster(const extent_t *ext, char *data) {
+  size_t len = (size_t)ext->len * BLOCK_SIZE;
+  long got = compress_decode(blocks_get_block(ext->pblk), EXTENT_CSIZE(ext),
+                             data, len);
+  return got == (long)len ? 0 : -1;
+}
+
+/**
+ * Does the work of storage_read_inum() once the file is locked.
+ */
+static int read_at(int file_inum, char *buf, size_t size, off_t offset,
+                   storage_readahead_t *ra) {
   inode_t *file_node = get_inode(file_inum);
-  char *file_block = (char *)blocks_get_block(file_node->block);
-  memcpy(buf, file_block + offset, size);
+  if (offset >= file_node->size) {
+    size = 0;
+  } else if (offset + size > file_node->size) {
+    size = file_node->size - offset;
+  }
+
+  if (file_node->flags & INODE_INLINE) {
+    size_t inline_size = offset < INODE_INLINE_SIZE
+                             ? INODE_INLINE_SIZE - offset
+                             : 0;
+    inline_size = inline_size < size ? inline_size : size;
+    memcpy(buf, file_node->inline_data + offset, inline_size);
+    memset(buf + inline_size, 0, size - inline_size);
+    return size;
+  }
+
+  int scan = 0;
+  if (ra != NULL && size > 0) {
+    scan = read_ahead(file_node, ra, offset, offset + size);
+  }
+
+  // Blocks held in memory are read from there.
+  delalloc_t *d = delallocs[file_inum];
+  off_t held_start = d != NULL ? (off_t)d->lblk * BLOCK_SIZE : 0;
+  off_t held_end = d != NULL ? held_start + (off_t)d->count * BLOCK_SIZE : 0;
+
+  // The last compressed cluster read, decompressed.
+  char *cluster = NULL;
+  int cluster_lblk = -1;
+  int rv = size;
+
+  // Copy a whole run of contiguous blocks at a time; holes read as zeros.
+  for (size_t done = 0; done < size;) {
+    off_t pos = offset + done;
+    if (held_start <= pos && pos < held_end) {
+      size_t chunk = held_end - pos;
+      chunk = chunk < size - done ? chunk : size - done;
+      memcpy(buf + done, d->data + (pos - held_start), chunk);
+      done += chunk;
+      continue;
+    }
+
+    int run;
+    int bnum = extent_map(file_node, pos / BLOCK_SIZE, &run);
+    size_t chunk = (size_t)run * BLOCK_SIZE - pos % BLOCK_SIZE;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+    if (pos < held_start && chunk > held_start - pos) {
+      chunk = held_start - pos;
+    }
+
+    if (bnum == 0) {
+      memset(buf + done, 0, chunk);
+    } else if (bnum == -1) {
+      extent_t ext;
+      extent_next(file_node, pos / BLOCK_SIZE, &ext);
+      if (cluster == NULL) {
+        cluster = malloc((size_t)CLUSTER_BLOCKS * BLOCK_SIZE);
+        assert(cluster != NULL);
+      }
+      if (cluster_lblk != ext.lblk && read_cluster(&ext, cluster) == -1) {
+        rv = -EIO;
+        break;
+      }
+      cluster_lblk = ext.lblk;
+      memcpy(buf + done, cluster + (pos - (off_t)ext.lblk * BLOCK_SIZE),
+             chunk);
+    } else {
+      char *file_block = (char *)blocks_get_block(bnum);
+      memcpy(buf + done, file_block + pos % BLOCK_SIZE, chunk);
+    }
+    done += chunk;
+  }
+  free(cluster);
+
+  // The blocks a scan read in full are not read again soon.
+  if (scan) {
+    advise_range(file_node, offset / BLOCK_SIZE, (offset + size) / BLOCK_SIZE,
+                 BLOCKS_COLD);
+  }
+  return rv;
+}
+
+int storage_read_inum(int file_inum, char *buf, size_t size, off_t offset,
+                      storage_readahead_t *ra) {
+  inode_read_lock(file_inum);
+  int rv = read_at(file_inum, buf, size, offset, ra);
+  inode_unlock(file_inum);
+  return rv;
+}
+
+/**
+ * Returns whether logical block `lblk` of the file `inum`, which the caller
+ * has locked, holds data, and sets `run` to the number of blocks from there
+ * that do too, or that do not.
+ */
+static int block_has_data(int inum, inode_t *inode, int lblk, int *run) {
+  delalloc_t *d = delallocs[inum];
+  int held_end = d != NULL ? d->lblk + d->count : 0;
+  if (d != NULL && d->lblk <= lblk && lblk < held_end) {
+    *run = held_end - lblk;
+    return 1;
+  }
+
+  int mapped = extent_map(inode, lblk, run) != 0;
+  if (!mapped) {
+    extent_t ext;
+    *run = extent_next(inode, lblk, &ext) == 0 ? ext.lblk - lblk
+                                                : EXTENT_MAX_LBLK - lblk;
+  }
+  // Held blocks cover whatever is mapped under them.
+  if (d != NULL && lblk < d->lblk && *run > d->lblk - lblk) {
+    *run = d->lblk - lblk;
+  }
+  return mapped;
+}
+
+off_t storage_seek_inum(int inum, off_t offset, int hole) {
+  inode_t *inode = get_inode(inum);
+  inode_read_lock(inum);
+  off_t size = inode->size;
+  off_t rv;
+
+  if (offset < 0 || offset >= size) {
+    rv = -ENXIO;
+  } else if (inode->flags & INODE_INLINE) {
+    // Inline files hold data up to INODE_INLINE_SIZE, then a hole.
+    off_t data_end = size < INODE_INLINE_SIZE ? size : INODE_INLINE_SIZE;
+    if (hole) {
+      rv = offset < data_end ? data_end : offset;
+    } else {
+      rv = offset < data_end ? offset : -ENXIO;
+    }
+  } else {
+    // Skip whole runs of blocks until one has data, or has none; the end of
+    // the file counts as a hole.
+    int lblk = offset / BLOCK_SIZE;
+    int eof = bytes_to_blocks(size);
+    int run;
+    while (lblk < eof && block_has_data(inum, inode, lblk, &run) == hole) {
+      lblk = run < eof - lblk ? lblk + run : eof;
+    }
+
+    off_t pos = (off_t)lblk * BLOCK_SIZE;
+    pos = pos > offset ? pos : offset;
+    if (pos >= size) {
+      rv = hole ? size : -ENXIO;
+    } else {
+      rv = pos;
+    }
+  }
+
+  inode_unlock(inum);
+  return rv;
+}
+
+// A file that grows at its end gets up to this many blocks allocated past
+// the end, so that files appended to side by side do not interleave.
+static const int PREALLOC_MAX_BLOCKS = 64;
+
+/**
+ * Releases the blocks preallocated past the end of every file but `keep`,
+ * skipping the files that other threads have locked. Only the files that
+ * had some are journaled.
+ * Returns the number of files that had preallocated blocks.
+ */
+static int reclaim_prealloc(inode_t *keep) {
+  void *ibm = get_inode_bitmap();
+  int released = 0;
+
+  for (int inum = 0; inum < INODE_COUNT; inum++) {
+    inode_t *inode = get_inode(inum);
+    if (!bitmap_get(ibm, inum) || inode == keep ||
+        !inode_try_write_lock_contents(inum)) {
+      continue;
+    }
+
+    int eof = bytes_to_blocks(inode->size);
+    extent_t ext;
+    if (!is_dir(inode) && extent_next(inode, eof, &ext) == 0) {
+      inode_dirty(inum);
+      extent_remove(inode, eof, EXTENT_MAX_LBLK);
+      released++;
+    }
+    inode_unlock(inum);
+  }
+
+  return released;
+}
+
+/**
+ * Backs the bytes [`offset`, `offset` + `size`) of file `inum` with disk
+ * blocks, allocating zeroed blocks where none are mapped yet.
+ * Each hole is filled with as few contiguous runs as possible, placed right
+ * after the block that precedes it in the file.
+ * Returns 0 on success and -ENOSPC if the disk is full.
+ */
+static int alloc_range(int inum, off_t offset, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+
+  inode_t *inode = get_inode(inum);
+  int end = (offset + size - 1) / BLOCK_SIZE + 1;
+  int eof = bytes_to_blocks(inode->size);
+
+  // Upper bound on a run, lowered when the extent tree needs a block.
+  int limit = EXTENT_MAX_LBLK;
+
+  for (int lblk = offset / BLOCK_SIZE; lblk < end;) {
+    int run;
+    if (extent_map(inode, lblk, &run) != 0) {
+      lblk += run;
+      continue;
+    }
+
+    inode_dirty(inum);
+    int want = end - lblk < run ? end - lblk : run;
+    if (lblk >= eof && want < run) {
+      // Appending: preallocate as much again as the file already has.
+      int extra = eof < PREALLOC_MAX_BLOCKS ? eof : PREALLOC_MAX_BLOCKS;
+      want = run - want < extra ? run : want + extra;
+    }
+    want = want < limit ? want : limit;
+
+    int prev = lblk > 0 ? extent_map(inode, lblk - 1, NULL) : 0;
+    int count;
+    int bnum = alloc_blocks(want, prev > 0 ? prev + 1 : -1, &count);
+    if (bnum == -1 && reclaim_prealloc(inode) > 0) {
+      bnum = alloc_blocks(want, prev > 0 ? prev + 1 : -1, &count);
+    }
+    if (bnum == -1) {
+      return -ENOSPC;
+    }
+
+    if (extent_insert(inode, lblk, bnum, count) == -1) {
+      // Leave a block free for the extent tree and try again.
+      free_blocks(bnum, count);
+      if (count == 1) {
+        return -ENOSPC;
+      }
+      limit = count - 1;
+      continue;
+    }
+
+    memset(blocks_get_block(bnum), 0, (size_t)count * BLOCK_SIZE);
+    journal_dirty_data(inum, bnum, count);
+    lblk += count;
+    limit = EXTENT_MAX_LBLK;
+  }
+
+  return 0;
+}
+
+/**
+ * Turns the compressed cluster `ext` of the file `inum`, which the caller
+ * has locked for writing, back into plain blocks.
+ * Returns 0 on success, -ENOSPC if the disk is full and -EIO if the
+ * cluster is corrupt.
+ */
+static int decompress_cluster(int inum, const extent_t *ext) {
+  inode_t *inode = get_inode(inum);
+  int count;
+  int bnum = alloc_blocks(ext->len, ext->pblk, &count);
+  if (bnum == -1 && reclaim_prealloc(inode) > 0) {
+    bnum = alloc_blocks(ext->len, ext->pblk, &count);
+  }
+  if (bnum == -1) {
+    return -ENOSPC;
+  }
+  if (count < ext->len) {
+    free_blocks(bnum, count);
+    return -ENOSPC;
+  }
+
+  if (read_cluster(ext, (char *)blocks_get_block(bnum)) == -1) {
+    free_blocks(bnum, count);
+    return -EIO;
+  }
+  inode_dirty(inum);
+  extent_decompressed(inode, ext->lblk, bnum);
+  journal_dirty_data(inum, bnum, count);
+  return 0;
+}
 
+/**
+ * Turns the compressed clusters that hold any of the bytes [`offset`,
+ * `offset` + `size`) of the file `inum`, which the caller has locked for
+ * writing, back into plain blocks.
+ * Returns 0 on success and a negative error code as decompress_cluster()
+ * does otherwise.
+ */
+static int decompress_range(int inum, off_t offset, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+
+  inode_t *inode = get_inode(inum);
+  int end = (offset + size - 1) / BLOCK_SIZE + 1;
+  extent_t ext;
+  for (int lblk = offset / BLOCK_SIZE;
+       extent_next(inode, lblk, &ext) == 0 && ext.lblk < end;
+       lblk = ext.lblk + ext.len) {
+    if (ext.flags & EXTENT_COMPRESSED) {
+      int rv = decompress_cluster(inum, &ext);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Stores the `n` blocks held at index `i` for the file `inum`, which the
+ * caller has locked for writing, as one compressed cluster, if they are a
+ * whole cluster or the last two or more blocks of the file, and compress by
+ * a block or more.
+ * Returns 1 if they are stored that way, and 0 if they are to be stored as
+ * they are.
+ */
+static int flush_compressed(int inum, delalloc_t *d, int i, int n) {
+  inode_t *inode = get_inode(inum);
+  int lblk = d->lblk + i;
+  extent_t ext;
+  if (extent_next(inode, lblk, &ext) == 0 && ext.lblk < lblk + n) {
+    // Allocated in part by an earlier flush that ran out of space, which
+    // stores compressed clusters whole or not at all: write the blocks
+    // over in place.
+    assert(!(ext.flags & EXTENT_COMPRESSED));
+    return 0;
+  }
+  // A single block cannot compress by a block.
+  if (n < 2 || lblk % CLUSTER_BLOCKS != 0 ||
+      (n < CLUSTER_BLOCKS && lblk + n < bytes_to_blocks(inode->size))) {
+    return 0;
+  }
+
+  const char *data = d->data + (size_t)i * BLOCK_SIZE;
+  size_t len = (size_t)n * BLOCK_SIZE;
+  if (!compress_worthwhile(data, len)) {
+    return 0;
+  }
+  char *packed = malloc(len - BLOCK_SIZE);
+  assert(packed != NULL);
+  size_t csize = compress_encode(data, len, packed, len - BLOCK_SIZE);
+
+  int want = bytes_to_blocks(csize);
+  int prev = lblk > 0 ? extent_map(inode, lblk - 1, NULL) : 0;
+  int count = 0;
+  int bnum = csize == 0 ? -1 : alloc_blocks(want, prev > 0 ? prev + 1 : -1,
+                                            &count);
+  if (bnum != -1 &&
+      (count < want ||
+       extent_insert_compressed(inode, lblk, bnum, n, csize) == -1)) {
+    free_blocks(bnum, count);
+    bnum = -1;
+  }
+  if (bnum != -1) {
+    inode_dirty(inum);
+    char *block = (char *)blocks_get_block(bnum);
+    memcpy(block, packed, csize);
+    memset(block + csize, 0, (size_t)want * BLOCK_SIZE - csize);
+    journal_dirty_data(inum, bnum, want);
+  }
+  free(packed);
+  return bnum != -1;
+}
+
+/**
+ * Shares the block held at index `i` for the file `inum`, which the caller
+ * has locked for writing, with a block on disk holding the same contents,
+ * if the dedup index has one.
+ * Returns 1 if it is shared, 0 if it is to be written out, and -ENOSPC if
+ * no block was left for the extent tree.
+ */
+static int dedup_held(int inum, delalloc_t *d, int i) {
+  inode_t *inode = get_inode(inum);
+  int lblk = d->lblk + i;
+  if (extent_map(inode, lblk, NULL) != 0) {
+    return 0;
+  }
+
+  int bnum = share_find(d->data + (size_t)i * BLOCK_SIZE);
+  if (bnum == -1) {
+    return 0;
+  }
+  if (extent_insert(inode, lblk, bnum, 1) == -1) {
+    free_blocks(bnum, 1);
+    return -ENOSPC;
+  }
+  inode_dirty(inum);
+  return 1;
+}
+
+/**
+ * Allocates disk blocks for the `n` blocks held at index `i` for the file
+ * `inum`, which the caller has locked for writing, moves them there and
+ * adds them to the dedup index if blocks are deduplicated.
+ * Returns 0 on success and -ENOSPC if the disk is full.
+ */
+static int write_held(int inum, delalloc_t *d, int i, int n) {
+  // Blocks an earlier flush that ran out of space stored, then shared or
+  // indexed, are written over like any block written in place.
+  off_t offset = (off_t)(d->lblk + i) * BLOCK_SIZE;
+  int rv = unshare_range(inum, offset, (size_t)n * BLOCK_SIZE);
+  if (rv == 0) {
+    rv = alloc_range(inum, offset, (size_t)n * BLOCK_SIZE);
+  }
+  if (rv < 0) {
+    return rv;
+  }
+
+  inode_t *inode = get_inode(inum);
+  for (int end = i + n; i < end;) {
+    int run;
+    int bnum = extent_map(inode, d->lblk + i, &run);
+    run = run < end - i ? run : end - i;
+    memcpy(blocks_get_block(bnum), d->data + (size_t)i * BLOCK_SIZE,
+           (size_t)run * BLOCK_SIZE);
+    journal_dirty_data(inum, bnum, run);
+    for (int k = 0; share_dedup_enabled() && k < run; k++) {
+      share_index(bnum + k);
+    }
+    i += run;
+  }
+  return 0;
+}
+
+/**
+ * Stores the `n` blocks held at index `i` for the file `inum`, which the
+ * caller has locked for writing, as plain blocks, sharing those found in
+ * the dedup index if blocks are deduplicated.
+ * Returns 0 on success and -ENOSPC if the disk is full.
+ */
+static int flush_plain(int inum, delalloc_t *d, int i, int n) {
+  if (!share_dedup_enabled()) {
+    return write_held(inum, d, i, n);
+  }
+
+  // Blocks are indexed one by one, so that the next ones can share them.
+  // Each is placed right after the previous one all the same.
+  for (int end = i + n; i < end; i++) {
+    int rv = dedup_held(inum, d, i);
+    if (rv == 0) {
+      rv = write_held(inum, d, i, 1);
+    }
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Stops holding the first `n` blocks held in `d`, fewer than it holds,
+ * which are stored.
+ */
+static void delalloc_advance(delalloc_t *d, int n) {
+  if (n == 0) {
+    return;
+  }
+  d->lblk += n;
+  d->count -= n;
+  memmove(d->data, d->data + (size_t)n * BLOCK_SIZE,
+          (size_t)d->count * BLOCK_SIZE);
+  atomic_fetch_sub(&delalloc_total, n);
+  if (d->reserved > d->count) {
+    blocks_unreserve(d->reserved - d->count);
+    d->reserved = d->count;
+  }
+}
+
+/**
+ * Allocates disk blocks for the blocks held for the file `inum`, which the
+ * caller has locked for writing, and moves them there, compressed or
+ * deduplicated if enabled. If the disk fills up partway, the blocks that
+ * could not be stored stay held.
+ * Returns 0 on success and -ENOSPC if the disk is full.
+ */
+static int delalloc_flush(int inum) {
+  delalloc_t *d = delallocs[inum];
+  if (d == NULL) {
+    return 0;
+  }
+
+  blocks_spend_reserved(d->reserved);
+  int rv = 0;
+  int i = 0;
+  while (rv == 0 && i < d->count) {
+    int n = d->count - i;
+    if (compress_clusters) {
+      int lblk = d->lblk + i;
+      int next = (lblk / CLUSTER_BLOCKS + 1) * CLUSTER_BLOCKS;
+      n = n < next - lblk ? n : next - lblk;
+    }
+    if (!compress_clusters || !flush_compressed(inum, d, i, n)) {
+      rv = flush_plain(inum, d, i, n);
+    }
+    if (rv == 0) {
+      i += n;
+    }
+  }
+  d->reserved = blocks_unspend_reserved();
+  if (rv < 0) {
+    // The blocks stored before running out of space stop being held, so
+    // that later writes to them go to the disk, as for any stored block.
+    delalloc_advance(d, i);
+    return rv;
+  }
+
+  delalloc_drop(inum);
+  return 0;
+}
+
+/**
+ * Holds the `size` bytes from `buf` at `offset` of the file `inum`, which
+ * the caller has locked for writing, in memory if no block at or past
+ * `offset` is mapped, flushing the blocks held so far if they cannot be
+ * extended.
+ * Returns the number of bytes held, 0 if they are to be written in place,
+ * or -ENOSPC if the disk is full.
+ */
+static int delalloc_write(int inum, const char *buf, size_t size,
+                          off_t offset) {
+  if (size == 0) {
+    return 0;
+  }
+
+  delalloc_t *d = delallocs[inum];
+  int first = offset / BLOCK_SIZE;
+  int end = (offset + size - 1) / BLOCK_SIZE + 1;
+  if (d != NULL && end <= d->lblk) {
+    return 0;
+  }
+  if (d != NULL && (first < d->lblk || first > d->lblk + d->count ||
+                    end - d->lblk > DELALLOC_FILE_BLOCKS)) {
+    int rv = delalloc_flush(inum);
+    if (rv < 0) {
+      return rv;
+    }
+    d = NULL;
+  }
+
+  if (d == NULL) {
+    extent_t ext;
+    if (end - first > DELALLOC_FILE_BLOCKS ||
+        atomic_load(&delalloc_total) + (end - first) > DELALLOC_TOTAL_BLOCKS ||
+        extent_next(get_inode(inum), first, &ext) == 0) {
+      return 0;
+    }
+    d = calloc(1, sizeof(delalloc_t));
+    assert(d != NULL);
+    d->lblk = first;
+    delallocs[inum] = d;
+  }
+
+  int added = end - d->lblk - d->count;
+  if (added > 0) {
+    if (blocks_reserve(added) == -1) {
+      if (d->count == 0) {
+        delalloc_drop(inum);
+      }
+      return -ENOSPC;
+    }
+    if (d->count + added > d->cap) {
+      d->cap = d->cap * 2 > d->count + added ? d->cap * 2 : d->count + added;
+      d->data = realloc(d->data, (size_t)d->cap * BLOCK_SIZE);
+      assert(d->data != NULL);
+    }
+    memset(d->data + (size_t)d->count * BLOCK_SIZE, 0,
+           (size_t)added * BLOCK_SIZE);
+    d->count += added;
+    d->reserved += added;
+    atomic_fetch_add(&delalloc_total, added);
+  }
+
+  memcpy(d->data + (offset - (off_t)d->lblk * BLOCK_SIZE), buf, size);
   return size;
 }
 
+/**
+ * Drops the blocks held for the file `inum`, which the caller has locked
+ * for writing, past its new `size`.
+ */
+static void delalloc_truncate(int inum, off_t size) {
+  delalloc_t *d = delallocs[inum];
+  if (d == NULL) {
+    return;
+  }
+
+  int keep = bytes_to_blocks(size) - d->lblk;
+  if (keep <= 0) {
+    delalloc_drop(inum);
+    return;
+  }
+  if (keep < d->count) {
+    atomic_fetch_sub(&delalloc_total, d->count - keep);
+    d->count = keep;
+  }
+  if (d->reserved > d->count) {
+    blocks_unreserve(d->reserved - d->count);
+    d->reserved = d->count;
+  }
+
+  // Clear the rest of the last block, as for a block on disk.
+  off_t from = size - (off_t)d->lblk * BLOCK_SIZE;
+  if (from < (off_t)d->count * BLOCK_SIZE) {
+    memset(d->data + from, 0, (size_t)d->count * BLOCK_SIZE - from);
+  }
+}
+
+int storage_flush(int inum) {
+  if (delallocs[inum] == NULL) {
+    return 0;
+  }
+
+  journal_begin();
+  inode_write_lock_contents(inum);
+  int rv = delalloc_flush(inum);
+  inode_unlock(inum);
+  journal_end();
+  return rv;
+}
+
+/**
+ * Flushes the blocks held for every file, as the journal does before
+ * commits, so that no file size is committed without its contents.
+ */
+static void flush_all() {
+  for (int inum = 0;
+       atomic_load(&delalloc_total) > 0 && inum < INODE_COUNT; inum++) {
+    if (delallocs[inum] != NULL) {
+      storage_flush(inum);
+    }
+  }
+}
+
 int storage_write(const char *path, const char *buf, size_t size,
                   off_t offset) {
-  int file_inum = tree_lookup(path);
-  if (file_inum == -1 || size > BLOCK_SIZE) {
-    return -ENOENT;
+  int inum = storage_open(path);
+  return inum < 0 ? inum : storage_write_inum(inum, buf, size, offset);
+}
+
+/**
+ * Moves the `n` shared blocks starting at `bnum`, mapped at `lblk` of the
+ * file `inum`, which the caller has locked for writing, to copies of its
+ * own.
+ * Returns the number of blocks moved, at least 1, or -ENOSPC if the disk is
+ * full.
+ */
+static int copy_shared(int inum, int lblk, int bnum, int n) {
+  inode_t *inode = get_inode(inum);
+  int prev = lblk > 0 ? extent_map(inode, lblk - 1, NULL) : 0;
+  int count;
+  int copy = alloc_blocks(n, prev > 0 ? prev + 1 : -1, &count);
+  if (copy == -1 && reclaim_prealloc(inode) > 0) {
+    copy = alloc_blocks(n, prev > 0 ? prev + 1 : -1, &count);
+  }
+  if (copy == -1) {
+    return -ENOSPC;
   }
 
-  inode_t *file_node = get_inode(file_inum);
-  assert(!is_dir(file_node));
+  memcpy(blocks_get_block(copy), blocks_get_block(bnum),
+         (size_t)count * BLOCK_SIZE);
+  if (extent_replace(inode, lblk, count, copy) == -1) {
+    free_blocks(copy, count);
+    return -ENOSPC;
+  }
+  inode_dirty(inum);
+  journal_dirty_data(inum, copy, count);
+  free_blocks(bnum, count);
+  return count;
+}
+
+/**
+ * Prepares the blocks that back any of the bytes [`offset`, `offset` +
+ * `size`) of the file `inum`, which the caller has locked for writing, for
+ * being written in place: shared blocks are copied, and the others taken
+ * out of the dedup index.
+ * Returns 0 on success and -ENOSPC if the disk is full.
+ */
+static int unshare_range(int inum, off_t offset, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
 
-  if (file_node->size < size + offset) {
-    storage_truncate(path, size + offset);
+  inode_t *inode = get_inode(inum);
+  int end = (offset + size - 1) / BLOCK_SIZE + 1;
+  for (int lblk = offset / BLOCK_SIZE; lblk < end;) {
+    int run;
+    int bnum = extent_map(inode, lblk, &run);
+    run = run < end - lblk ? run : end - lblk;
+    if (bnum > 0) {
+      int shared;
+      run = share_exclusive(bnum, run, &shared);
+      if (shared) {
+        run = copy_shared(inum, lblk, bnum, run);
+        if (run < 0) {
+          return run;
+        }
+      }
+    }
+    lblk += run;
   }
+  return 0;
+}
 
-  char *file_block = (char *)blocks_get_block(file_node->block);
-  memcpy(file_block + offset, buf, size);
+/**
+ * Moves the contents of the inline file `inum`, which the caller has locked
+ * for writing, to a data block.
+ * Returns 0 on success and -ENOSPC if the disk is full.
+ */
+static int uninline(int inum) {
+  inode_t *inode = get_inode(inum);
+  int size = inode->size < INODE_INLINE_SIZE ? inode->size : INODE_INLINE_SIZE;
+  char data[INODE_INLINE_SIZE];
+  memcpy(data, inode->inline_data, size);
+
+  inode_dirty(inum);
+  inode->flags &= ~INODE_INLINE;
+  memset(inode->inline_data, 0, INODE_INLINE_SIZE);
+
+  // Trailing zeros are left as a hole.
+  while (size > 0 && data[size - 1] == 0) {
+    size--;
+  }
+  if (size == 0) {
+    return 0;
+  }
+
+  // The contents are held in memory like any other write, if they can be.
+  int rv = delalloc_write(inum, data, size, 0);
+  if (rv == 0) {
+    rv = alloc_range(inum, 0, size);
+    if (rv == 0) {
+      memcpy(blocks_get_block(extent_map(inode, 0, NULL)), data, size);
+    }
+  }
+  if (rv < 0) {
+    inode->flags |= INODE_INLINE;
+    memcpy(inode->inline_data, data, size);
+    return rv;
+  }
+  return 0;
+}
+
+/**
+ * Writes `size` bytes from `buf` at `offset` in the file `inum`, which the
+ * caller has locked for writing.
+ * Returns the number of bytes written, or -ENOSPC if the disk is full.
+ */
+static int write_at(int inum, const char *buf, size_t size, off_t offset) {
+  inode_t *file_node = get_inode(inum);
+  if (file_node->flags & INODE_INLINE) {
+    if (offset + size <= INODE_INLINE_SIZE) {
+      inode_dirty(inum);
+      memcpy(file_node->inline_data + offset, buf, size);
+      if (file_node->size < offset + size) {
+        file_node->size = offset + size;
+      }
+      return size;
+    }
+
+    int rv = uninline(inum);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  int held = delalloc_write(inum, buf, size, offset);
+  if (held < 0) {
+    return held;
+  }
+
+  if (held == 0) {
+    int rv = decompress_range(inum, offset, size);
+    if (rv == 0) {
+      rv = alloc_range(inum, offset, size);
+    }
+    if (rv == 0) {
+      rv = unshare_range(inum, offset, size);
+    }
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  for (size_t done = held; done < size;) {
+    off_t pos = offset + done;
+    int run;
+    int bnum = extent_map(file_node, pos / BLOCK_SIZE, &run);
+    size_t chunk = (size_t)run * BLOCK_SIZE - pos % BLOCK_SIZE;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+
+    char *file_block = (char *)blocks_get_block(bnum);
+    memcpy(file_block + pos % BLOCK_SIZE, buf + done, chunk);
+    journal_dirty_data(inum, bnum, bytes_to_blocks(pos % BLOCK_SIZE + chunk));
+    done += chunk;
+  }
+
+  if (file_node->size < offset + size) {
+    inode_dirty(inum);
+    file_node->size = offset + size;
+  }
 
   return size;
 }
 
+int storage_write_inum(int file_inum, const char *buf, size_t size,
+                       off_t offset) {
+  inode_t *file_node = get_inode(file_inum);
+  assert(!is_dir(file_node));
+
+  int rv;
+  int retries = 0;
+  do {
+    journal_begin();
+    // Overwrites leave the inode alone, so that syncing them needs no
+    // commit.
+    inode_write_lock_contents(file_inum);
+    rv = write_at(file_inum, buf, size, offset);
+    inode_unlock(file_inum);
+    journal_end();
+  } while (rv == -ENOSPC && journal_retry_alloc(&retries));
+  return rv;
+}
+
 int storage_truncate(const char *path, off_t size) {
+  int inum = storage_open(path);
+  return inum < 0 ? inum : storage_truncate_inum(inum, size);
+}
+
+int storage_truncate_inum(int inum, off_t size) {
   assert(size >= 0);
 
-  int inum = tree_lookup(path);
-  if (inum == -1) {
-    return -ENOENT;
+  inode_t *inode = get_inode(inum);
+  journal_begin();
+  inode_write_lock(inum);
+
+  // A compressed cluster is only ever removed whole, and the last block
+  // must be plain, and not shared, to be cleared.
+  int cut = bytes_to_blocks(size);
+  int tail = size % BLOCK_SIZE;
+  int rv = 0;
+  extent_t ext;
+  if (size < inode->size && cut > 0 && extent_next(inode, cut - 1, &ext) == 0 &&
+      ext.lblk < cut && (ext.flags & EXTENT_COMPRESSED) &&
+      (tail != 0 || ext.lblk + ext.len > cut)) {
+    rv = decompress_cluster(inum, &ext);
+  }
+  if (rv == 0 && size < inode->size && tail != 0 &&
+      !(inode->flags & INODE_INLINE)) {
+    rv = unshare_range(inum, size, BLOCK_SIZE - tail);
+  }
+  if (rv < 0) {
+    inode_unlock(inum);
+    journal_end();
+    return rv;
   }
 
-  inode_t *inode = get_inode(inum);
-  inode->size = size;
+  // Growing leaves a hole that reads back as zeros. Shrinking releases the
+  // blocks past the new end and clears the rest of the last block, so that
+  // growing the file again does not resurrect old data.
+  if (size < inode->size) {
+    delalloc_truncate(inum, size);
+  }
+  if (size < inode->size && (inode->flags & INODE_INLINE)) {
+    if (size < INODE_INLINE_SIZE) {
+      memset(inode->inline_data + size, 0, INODE_INLINE_SIZE - size);
+    }
+  } else if (size < inode->size) {
+    extent_remove(inode, cut, EXTENT_MAX_LBLK);
 
-  if (inode->size == 0) {
-    free_block(inode->block);
+    int bnum = tail == 0 ? 0 : extent_map(inode, size / BLOCK_SIZE, NULL);
+    if (bnum != 0) {
+      memset((char *)blocks_get_block(bnum) + tail, 0, BLOCK_SIZE - tail);
+      journal_dirty_data(inum, bnum, 1);
+    }
   }
 
+  inode->size = size;
+  inode_unlock(inum);
+  journal_end();
   return 0;
 }
 
-int storage_unlink(const char *path) {
-  int inum = tree_lookup(path);
+int storage_fsync(int inum) {
+  // Writing the file's blocks is enough if nothing else about it changed.
+  // Otherwise, commits every operation so far, whichever file it changed.
+  int rv = storage_flush(inum);
+  if (rv < 0) {
+    return rv;
+  }
+  inode_read_lock(inum);
+  rv = journal_write_file(inum);
+  inode_unlock(inum);
+  if (rv == 1) {
+    rv = blocks_sync();
+  }
+  return rv == 0 ? 0 : -EIO;
+}
+
+/**
+ * Removes the entry `name` from the directory `dir_inum`, `path` being the
+ * path of the entry or NULL. The caller has locked the directory for
+ * writing.
+ */
+static int unlink_at(int dir_inum, const char *name, const char *path) {
+  inode_t *dd = get_inode(dir_inum);
+  int inum = directory_lookup(dd, name);
   if (inum == -1) {
     return -1;
   }
+  TRACE_INUM(inum);
 
-  // "Delete" entry from parent directory by renaming to ""
-  inode_t *dd = get_inode(tree_lookup(get_parent_path(path)));
-  assert(directory_delete(dd, get_entry_name(path)) == 0);
+  // Delete entry from parent directory
+  assert(directory_delete(dd, name) == 0);
 
   inode_t *inode = get_inode(inum);
+  inode_write_lock(inum);
   inode->refs--;
 
+  // Nothing below a removed directory can be reached through it anymore.
+  invalidate(path, is_dir(inode));
+
   // If new decremented ref count reaches 0,
-  // free block and inode for that entry.
-  if (inode->refs == 0) {
-    free_block(inode->block);
-    free_inode(inum);
+  // free block and inode for that entry, unless it is still pinned.
+  if (inode->refs == 0 && !inode_pinned(inum)) {
+    release_inode(inum);
   }
+  inode_unlock(inum);
 
   return 0;
 }
 
+/**
+ * Adds the entry `name` for `inum` to the directory `dir_inum`, `path`
+ * being the path of the new entry or NULL. The caller has locked the
+ * directory for writing.
+ */
+static int link_at(int inum, int dir_inum, const char *name,
+                   const char *path) {
+  inode_t *dd = get_inode(dir_inum);
+  if (dd->refs == 0) {
+    return -ENOENT;
+  }
+  if (directory_lookup(dd, name) != -1) {
+    return -EEXIST;
+  }
+
+  // increases ref count and points the new entry to the same inode, unless
+  // it was removed since its path was resolved
+  inode_t *inode = get_inode(inum);
+  inode_write_lock(inum);
+  int rv = 0;
+  if (inode->refs == 0) {
+    rv = -ENOENT;
+  } else if (directory_put(dd, name, inum) == -1) {
+    rv = -ENOSPC;
+  } else {
+    inode->refs++;
+  }
+  inode_unlock(inum);
+
+  if (rv == 0) {
+    invalidate(path, 0);
+  }
+  return rv;
+}
+
+int storage_unlink(const char *path) {
+  char name[DIR_NAME_LENGTH];
+  int parent_inum = path_lookup_parent(path, name);
+  if (parent_inum == -1) {
+    return -1;
+  }
+
+  journal_begin();
+  inode_write_lock(parent_inum);
+  int rv = unlink_at(parent_inum, name, path);
+  inode_unlock(parent_inum);
+  journal_end();
+  return rv;
+}
+
+int storage_unlink_inum(int dir_inum, const char *name) {
+  journal_begin();
+  inode_write_lock(dir_inum);
+  int rv = unlink_at(dir_inum, name, NULL);
+  inode_unlock(dir_inum);
+  journal_end();
+  return rv == -1 ? -ENOENT : 0;
+}
+
 int storage_link(const char *from, const char *to) {
   // 'from' is the old file and 'to' is the path to the new file
-  int to_parent_inum = tree_lookup(get_parent_path(to));
+  char name[DIR_NAME_LENGTH];
+  int to_parent_inum = path_lookup_parent(to, name);
   int from_inum = tree_lookup(from);
   if (to_parent_inum == -1 || from_inum == -1) {
     return -ENOENT;
   }
 
-  // Get new entry name from `to`.
-  char *file_name = get_entry_name(to);
+  int rv;
+  int retries = 0;
+  do {
+    journal_begin();
+    inode_write_lock(to_parent_inum);
+    rv = link_at(from_inum, to_parent_inum, name, to);
+    inode_unlock(to_parent_inum);
+    journal_end();
+  } while (rv == -ENOSPC && journal_retry_alloc(&retries));
+  return rv;
+}
 
-  inode_t *to_dd = get_inode(to_parent_inum);
-  int old_size = to_dd->size;
-  assert(directory_put(to_dd, file_name, from_inum) == 0);
-  assert(to_dd->size > old_size);
+int storage_link_inum(int inum, int dir_inum, const char *name) {
+  if (strlen(name) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
 
-  // increases ref count and points 'to' to the same inode as 'from'
-  inode_t *from_node = get_inode(from_inum);
-  from_node->refs++;
+  int rv;
+  int retries = 0;
+  do {
+    journal_begin();
+    inode_write_lock(dir_inum);
+    rv = link_at(inum, dir_inum, name, NULL);
+    if (rv == 0) {
+      inode_pin(inum);
+    }
+    inode_unlock(dir_inum);
+    journal_end();
+  } while (rv == -ENOSPC && journal_retry_alloc(&retries));
+  return rv;
+}
+
+// Held by every rename between two directories, so that no other rename
+// changes which of the two is an ancestor of the other while they are
+// being locked.
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns whether the path made of the first `len` bytes of `dir` is a
+ * proper ancestor of the one made of the first `sub_len` bytes of `sub`.
+ */
+static int is_ancestor(const char *dir, size_t len, const char *sub,
+                       size_t sub_len) {
+  return len < sub_len && strncmp(dir, sub, len) == 0 && sub[len] == '/';
+}
+
+/**
+ * Write-locks the directories `from_inum` and `to_inum`, whose paths are
+ * the parents of `from` and `to`: an ancestor before its descendants, and
+ * two unrelated directories in inode order. Without the paths, waits for
+ * neither while holding the other instead, which also locks two files.
+ */
+static void lock_parents(int from_inum, const char *from, int to_inum,
+                         const char *to) {
+  if (from_inum == to_inum) {
+    inode_write_lock(from_inum);
+    return;
+  }
+
+  if (from == NULL) {
+    for (int first = from_inum, second = to_inum;; sched_yield()) {
+      inode_write_lock(first);
+      if (inode_try_write_lock(second)) {
+        return;
+      }
+      inode_unlock(first);
+      first = second;
+      second = first == from_inum ? to_inum : from_inum;
+    }
+  }
+
+  size_t from_len;
+  size_t to_len;
+  path_split(from, &from_len);
+  path_split(to, &to_len);
+  int to_first = is_ancestor(to, to_len, from, from_len) ||
+                 (!is_ancestor(from, from_len, to, to_len) &&
+                  to_inum < from_inum);
+  inode_write_lock(to_first ? to_inum : from_inum);
+  inode_write_lock(to_first ? from_inum : to_inum);
+}
+
+/**
+ * Releases the locks taken by lock_parents().
+ */
+static void unlock_parents(int from_inum, int to_inum) {
+  inode_unlock(from_inum);
+  if (to_inum != from_inum) {
+    inode_unlock(to_inum);
+  }
+}
+
+/**
+ * Moves the entry `from_name` of the directory `from_dir` to `to_name` in
+ * the directory `to_dir`, which the caller has locked. `from` and `to` are
+ * the paths of the two entries or NULL.
+ */
+static int rename_at(int from_dir, const char *from_name, const char *from,
+                     int to_dir, const char *to_name, const char *to) {
+  int inum = directory_lookup(get_inode(from_dir), from_name);
+  int rv = inum == -1 ? -ENOENT : link_at(inum, to_dir, to_name, to);
+  if (rv < 0) {
+    return rv;
+  }
+  assert(unlink_at(from_dir, from_name, from) == 0);
+
+  // Moving a directory moves every path below it.
+  if (is_dir(get_inode(inum))) {
+    invalidate(from, 1);
+    invalidate(to, 1);
+  }
 
   return 0;
 }
 
+/**
+ * Moves the entry `from` to `to` as storage_rename() does, `moving` being
+ * set if the two are in different directories.
+ */
+static int rename_paths(const char *from, const char *to, int moving) {
+  journal_begin();
+  if (moving) {
+    pthread_mutex_lock(&rename_lock);
+  }
+
+  char from_name[DIR_NAME_LENGTH];
+  char to_name[DIR_NAME_LENGTH];
+  int from_parent_inum = path_lookup_parent(from, from_name);
+  int to_parent_inum = path_lookup_parent(to, to_name);
+  int rv = -ENOENT;
+  if (from_parent_inum != -1 && to_parent_inum != -1) {
+    lock_parents(from_parent_inum, from, to_parent_inum, to);
+    rv = rename_at(from_parent_inum, from_name, from, to_parent_inum, to_name,
+                   to);
+    unlock_parents(from_parent_inum, to_parent_inum);
+  }
+
+  if (moving) {
+    pthread_mutex_unlock(&rename_lock);
+  }
+  journal_end();
+  return rv;
+}
+
 int storage_rename(const char *from, const char *to) {
-  if (tree_lookup(from) == -1 || tree_lookup(get_parent_path(to)) == -1) {
-    return -ENOENT;
+  // A directory cannot be moved below itself.
+  if (is_ancestor(from, strlen(from), to, strlen(to))) {
+    return -EINVAL;
+  }
+
+  size_t from_len;
+  size_t to_len;
+  path_split(from, &from_len);
+  path_split(to, &to_len);
+  int moving = from_len != to_len || strncmp(from, to, from_len) != 0;
+
+  int rv;
+  int retries = 0;
+  do {
+    rv = rename_paths(from, to, moving);
+  } while (rv == -ENOSPC && journal_retry_alloc(&retries));
+  return rv;
+}
+
+int storage_rename_inum(int from_dir, const char *from_name, int to_dir,
+                        const char *to_name) {
+  if (strlen(to_name) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+
+  int moving = from_dir != to_dir;
+  int rv;
+  int retries = 0;
+  do {
+    journal_begin();
+    if (moving) {
+      pthread_mutex_lock(&rename_lock);
+    }
+    lock_parents(from_dir, NULL, to_dir, NULL);
+    rv = rename_at(from_dir, from_name, NULL, to_dir, to_name, NULL);
+    unlock_parents(from_dir, to_dir);
+    if (moving) {
+      pthread_mutex_unlock(&rename_lock);
+    }
+    journal_end();
+  } while (rv == -ENOSPC && journal_retry_alloc(&retries));
+  return rv;
+}
+
+/**
+ * Turns the bytes [`offset`, `offset` + `size`) of the file `inum`, which
+ * the caller has locked for writing, into plain blocks on disk, as they
+ * must be to be shared: inline contents and held blocks get disk blocks,
+ * and compressed clusters are decompressed.
+ * Returns 0 on success, -ENOSPC if the disk is full and -EIO if a
+ * compressed cluster is corrupt.
+ */
+static int settle_range(int inum, off_t offset, size_t size) {
+  int rv = 0;
+  if (get_inode(inum)->flags & INODE_INLINE) {
+    rv = uninline(inum);
+  }
+  if (rv == 0) {
+    rv = delalloc_flush(inum);
+  }
+  if (rv == 0) {
+    rv = decompress_range(inum, offset, size);
+  }
+  return rv;
+}
+
+/**
+ * Makes the `length` bytes at `dst_offset` of the file `dst_inum` share the
+ * blocks of those at `src_offset` of the file `src_inum`, both locked for
+ * writing, leaving the size of `dst_inum` alone. Offsets are multiples of
+ * BLOCK_SIZE, and the ranges do not overlap.
+ * Returns 0 on success, -ENOSPC if the disk is full and -EIO if a
+ * compressed cluster is corrupt.
+ */
+static int share_blocks(int src_inum, off_t src_offset, int dst_inum,
+                        off_t dst_offset, off_t length) {
+  int rv = settle_range(src_inum, src_offset, length);
+  if (rv == 0) {
+    rv = settle_range(dst_inum, dst_offset, length);
+  }
+  if (rv < 0) {
+    return rv;
+  }
+
+  inode_t *src = get_inode(src_inum);
+  inode_t *dst = get_inode(dst_inum);
+  int count = bytes_to_blocks(length);
+  int from = src_offset / BLOCK_SIZE;
+  int to = dst_offset / BLOCK_SIZE;
+  inode_dirty(dst_inum);
+
+  // Go by runs that are plain, or a hole, in both files. Each is remapped
+  // in one step that leaves it as it was if it fails, so that a full disk
+  // never leaves the destination with a hole it did not have.
+  for (int i = 0; i < count;) {
+    int run;
+    int dst_run;
+    int bnum = extent_map(src, from + i, &run);
+    int old = extent_map(dst, to + i, &dst_run);
+    run = run < dst_run ? run : dst_run;
+    run = run < count - i ? run : count - i;
+    if (bnum == old) {
+      // Already shared, as after a retry, or a hole in both.
+    } else if (bnum == 0) {
+      rv = extent_remove(dst, to + i, run);
+    } else {
+      share_ref(bnum, run);
+      rv = old == 0 ? extent_insert(dst, to + i, bnum, run)
+                    : extent_replace(dst, to + i, run, bnum);
+      if (rv == -1) {
+        free_blocks(bnum, run);
+      } else if (old != 0) {
+        free_blocks(old, run);
+      }
+    }
+    if (rv == -1) {
+      return -ENOSPC;
+    }
+    i += run;
+  }
+  return 0;
+}
+
+/**
+ * Does the work of storage_clone_inum() once both files are locked for
+ * writing.
+ */
+static int clone_range(int src_inum, off_t src_offset, int dst_inum,
+                       off_t dst_offset, off_t length) {
+  inode_t *src = get_inode(src_inum);
+  inode_t *dst = get_inode(dst_inum);
+  if (length == 0 && src_offset <= src->size) {
+    length = src->size - src_offset;
+  }
+  if (src_offset + length > src->size ||
+      (length % BLOCK_SIZE != 0 && (src_offset + length != src->size ||
+                                    dst_offset + length < dst->size))) {
+    return -EINVAL;
+  }
+  if (src_inum == dst_inum && src_offset < dst_offset + length &&
+      dst_offset < src_offset + length) {
+    return -EINVAL;
+  }
+  if (length == 0) {
+    return 0;
   }
 
-  assert(storage_link(from, to) == 0);
-  assert(storage_unlink(from) == 0);
+  int rv = share_blocks(src_inum, src_offset, dst_inum, dst_offset, length);
+  if (rv < 0) {
+    return rv;
+  }
+  if (dst->size < dst_offset + length) {
+    dst->size = dst_offset + length;
+  }
+  return 0;
+}
+
+int storage_clone_inum(int src_inum, off_t src_offset, int dst_inum,
+                       off_t dst_offset, off_t length) {
+  if (is_dir(get_inode(src_inum)) || is_dir(get_inode(dst_inum))) {
+    return -EISDIR;
+  }
+  if (src_offset < 0 || dst_offset < 0 || length < 0 ||
+      src_offset % BLOCK_SIZE != 0 || dst_offset % BLOCK_SIZE != 0) {
+    return -EINVAL;
+  }
+
+  int rv;
+  int retries = 0;
+  do {
+    journal_begin();
+    lock_parents(src_inum, NULL, dst_inum, NULL);
+    rv = clone_range(src_inum, src_offset, dst_inum, dst_offset, length);
+    unlock_parents(src_inum, dst_inum);
+    journal_end();
+  } while (rv == -ENOSPC && journal_retry_alloc(&retries));
+  return rv;
+}
+
+/**
+ * Copies the `size` bytes at `src_offset` of the file `src_inum` to
+ * `dst_offset` of the file `dst_inum`, both locked for writing, whose
+ * ranges do not overlap. The destination range is allocated in as few runs
+ * as possible up front, and plain source blocks are copied straight from
+ * the image; the rest of the source goes through a buffer.
+ * Returns 0 on success, -ENOSPC if the disk is full and -EIO if a
+ * compressed cluster is corrupt.
+ */
+static int copy_bytes(int src_inum, off_t src_offset, int dst_inum,
+                      off_t dst_offset, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  int rv = settle_range(dst_inum, dst_offset, size);
+  if (rv == 0) {
+    rv = alloc_range(dst_inum, dst_offset, size);
+  }
+  if (rv < 0) {
+    return rv;
+  }
 
+  inode_t *src = get_inode(src_inum);
+  delalloc_t *d = delallocs[src_inum];
+  off_t held_start = d != NULL ? (off_t)d->lblk * BLOCK_SIZE : 0;
+  off_t held_end = d != NULL ? held_start + (off_t)d->count * BLOCK_SIZE : 0;
+  char *buf = NULL;
+
+  for (size_t done = 0; done < size;) {
+    off_t pos = src_offset + done;
+    size_t chunk = size - done < COPY_CHUNK ? size - done : COPY_CHUNK;
+    int run = 0;
+    int bnum = 0;
+    if (!(src->flags & INODE_INLINE) &&
+        (pos < held_start || pos >= held_end)) {
+      bnum = extent_map(src, pos / BLOCK_SIZE, &run);
+    }
+
+    const char *from;
+    if (bnum > 0) {
+      if ((size_t)run * BLOCK_SIZE - pos % BLOCK_SIZE < chunk) {
+        chunk = (size_t)run * BLOCK_SIZE - pos % BLOCK_SIZE;
+      }
+      if (pos < held_start && (size_t)(held_start - pos) < chunk) {
+        chunk = held_start - pos;
+      }
+      from = (char *)blocks_get_block(bnum) + pos % BLOCK_SIZE;
+    } else {
+      if (buf == NULL) {
+        buf = malloc(COPY_CHUNK);
+        assert(buf != NULL);
+      }
+      rv = read_at(src_inum, buf, chunk, pos, NULL);
+      from = buf;
+    }
+
+    if (rv >= 0) {
+      rv = write_at(dst_inum, from, chunk, dst_offset + done);
+    }
+    if (rv < 0) {
+      break;
+    }
+    done += chunk;
+  }
+
+  free(buf);
+  return rv < 0 ? rv : 0;
+}
+
+/**
+ * Does the work of storage_copy_inum() once both files are locked for
+ * writing.
+ */
+static off_t copy_range(int src_inum, off_t src_offset, int dst_inum,
+                        off_t dst_offset, off_t length) {
+  inode_t *src = get_inode(src_inum);
+  inode_t *dst = get_inode(dst_inum);
+  if (src_offset >= src->size) {
+    return 0;
+  }
+  if (length > src->size - src_offset) {
+    length = src->size - src_offset;
+  }
+  if (src_inum == dst_inum && src_offset < dst_offset + length &&
+      dst_offset < src_offset + length) {
+    return -EINVAL;
+  }
+
+  // The whole blocks of ranges that line up are shared instead.
+  off_t head = length;
+  off_t middle = 0;
+  if (src_offset % BLOCK_SIZE == dst_offset % BLOCK_SIZE) {
+    head = (BLOCK_SIZE - src_offset % BLOCK_SIZE) % BLOCK_SIZE;
+    head = head < length ? head : length;
+    middle = (length - head) / BLOCK_SIZE * BLOCK_SIZE;
+  }
+  off_t tail = length - head - middle;
+
+  int rv = 0;
+  if (middle > 0) {
+    rv = share_blocks(src_inum, src_offset + head, dst_inum,
+                      dst_offset + head, middle);
+  }
+  if (rv == 0) {
+    rv = copy_bytes(src_inum, src_offset, dst_inum, dst_offset, head);
+  }
+  if (rv == 0) {
+    rv = copy_bytes(src_inum, src_offset + head + middle, dst_inum,
+                    dst_offset + head + middle, tail);
+  }
+  if (rv < 0) {
+    return rv;
+  }
+
+  if (dst->size < dst_offset + length) {
+    inode_dirty(dst_inum);
+    dst->size = dst_offset + length;
+  }
+  return length;
+}
+
+off_t storage_copy_inum(int src_inum, off_t src_offset, int dst_inum,
+                        off_t dst_offset, off_t length) {
+  if (is_dir(get_inode(src_inum)) || is_dir(get_inode(dst_inum))) {
+    return -EISDIR;
+  }
+  if (src_offset < 0 || dst_offset < 0 || length < 0) {
+    return -EINVAL;
+  }
+
+  off_t rv;
+  int retries = 0;
+  do {
+    journal_begin();
+    lock_parents(src_inum, NULL, dst_inum, NULL);
+    rv = copy_range(src_inum, src_offset, dst_inum, dst_offset, length);
+    unlock_parents(src_inum, dst_inum);
+    journal_end();
+  } while (rv == -ENOSPC && journal_retry_alloc(&retries));
+  return rv;
+}
+
+int storage_chmod(const char *path, int mode) {
+  int inum = tree_lookup(path);
+  if (inum == -1) {
+    return -ENOENT;
+  }
+  return storage_chmod_inum(inum, mode);
+}
+
+int storage_chmod_inum(int inum, int mode) {
+  journal_begin();
+  inode_write_lock(inum);
+  get_inode(inum)->mode = mode;
+  inode_unlock(inum);
+  journal_end();
   return 0;
 }
 
 slist_t *storage_list(const char *path) { return directory_list(path); }
+
+dirent_t *storage_list_inum(int inum, const char *path, int *count) {
+  uint64_t gen = dcache_generation();
+  dirent_t *entries = directory_entries(inum, count);
+
+  // Cached paths have no trailing slash, except for the root's "/".
+  size_t len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+  char entry_path[len + DIR_NAME_LENGTH + 1];
+  memcpy(entry_path, path, len);
+  entry_path[len] = '/';
+  for (int i = 0; entries != NULL && i < *count; i++) {
+    size_t name_len = strnlen(entries[i].name, DIR_NAME_LENGTH);
+    memcpy(entry_path + len + 1, entries[i].name, name_len);
+    dcache_insert(entry_path, len + 1 + name_len, entries[i].inum, gen);
+  }
+  return entries;
+}
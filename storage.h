@@ -12,13 +12,15 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "directory.h"
 #include "slist.h"
 
 /**
  * Initializes the root directory, if not already.
  * Loads and initializes the given disk image.
+ * Returns 0 on success and -1 if the image cannot be mounted.
  */
-void storage_init(const char *path);
+int storage_init(const char *path);
 
 /**
  * Gets an object's attributes (type, permissions, size, etc.)
@@ -28,28 +30,131 @@ void storage_init(const char *path);
 int storage_stat(const char *path, struct stat *st);
 
 /**
- * Reads contents of a file into given buffer.
- * Returns the length of the file on success and -ENOENT otherwise.
+ * Same as storage_stat(), on the inode `inum`.
+ */
+int storage_stat_inum(int inum, struct stat *st);
+
+/**
+ * Resolves the file at the given path once, for the *_inum operations below
+ * to use while it is open.
+ * Returns its inode number on success and -ENOENT otherwise.
+ */
+int storage_open(const char *path);
+
+/**
+ * Same as storage_open(), but pins the file as storage_lookup() does, so
+ * that it is not freed if it is unlinked before storage_forget().
+ */
+int storage_open_pinned(const char *path);
+
+/**
+ * Reads up to `size` bytes at `offset` of a file into given buffer.
+ * Returns the number of bytes read on success, -ENOENT if there is no such
+ * file and -EIO if its compressed contents are corrupt.
  */
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 
+// What is known of the reads of an open file, to read ahead of sequential
+// ones. Zeroed when the file is opened. One read of the file at a time
+// updates it; reads that run meanwhile leave it alone, which only makes for
+// worse guesses.
+typedef struct storage_readahead {
+  _Atomic int busy;  // set while a read updates the fields below
+  off_t next;        // where a sequential read would start
+  off_t ahead;       // where the blocks requested ahead end
+  int window;        // how many blocks to request ahead at a time
+} storage_readahead_t;
+
+/**
+ * Same as storage_read(), on the open file `inum`. Reads ahead of
+ * sequential reads, tracked with `ra` unless it is NULL.
+ */
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset,
+                      storage_readahead_t *ra);
+
 /**
- * Handles writing data from buffer into corresponding data block.
- * Returns the length of the write on success and -ENOENT otherwise.
+ * Finds where the next data of the open file `inum` starts, or if `hole` is
+ * set, the next hole, at or after `offset`, as lseek() does with SEEK_DATA
+ * and SEEK_HOLE. Unwritten blocks are holes, and so is the end of the file.
+ * Returns the offset found, or -ENXIO if `offset` is past the end of the
+ * file or no data follows it.
+ */
+off_t storage_seek_inum(int inum, off_t offset, int hole);
+
+/**
+ * Handles writing data from buffer into corresponding data blocks,
+ * allocating blocks as the file grows.
+ * Returns the length of the write on success, -ENOENT if there is no such
+ * file, -ENOSPC if the disk is full and -EIO if the compressed contents it
+ * overwrites are corrupt.
  */
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 
+/**
+ * Same as storage_write(), on the open file `inum`.
+ */
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset);
+
 /**
  * Sets the size of the entry at the given path to the given `size`.
- * Will release blocks if new size becomes 0.
- * Will grow blocks if new size exceeds `BLOCK_SIZE`.
- * Returns 0 on success and -ENOENT otherwise.
+ * Will release the blocks past the new end when shrinking.
+ * Growing leaves a hole that reads back as zeros.
+ * Returns 0 on success, -ENOENT if there is no such file, and -ENOSPC or
+ * -EIO if a compressed cluster it cuts cannot be decompressed.
  */
 int storage_truncate(const char *path, off_t size);
 
+/**
+ * Same as storage_truncate(), on the open file `inum`.
+ */
+int storage_truncate_inum(int inum, off_t size);
+
+/**
+ * Makes the `length` bytes at `dst_offset` of the open file `dst_inum`
+ * share the blocks of those at `src_offset` of the open file `src_inum`,
+ * growing it if needed, as the FICLONERANGE ioctl does. Offsets must be
+ * multiples of BLOCK_SIZE, and so must `length` unless it reaches the end
+ * of the source and the end of the destination. A `length` of 0 means up
+ * to the end of the source.
+ * Returns 0 on success, -EISDIR if either file is a directory, -EINVAL if
+ * the ranges are not aligned, lie past the end of the source or overlap,
+ * -ENOSPC if the disk is full and -EIO if compressed contents are corrupt.
+ */
+int storage_clone_inum(int src_inum, off_t src_offset, int dst_inum,
+                       off_t dst_offset, off_t length);
+
+/**
+ * Copies up to `length` bytes at `src_offset` of the open file `src_inum`
+ * to `dst_offset` of the open file `dst_inum`, as copy_file_range() does,
+ * without going through a buffer where it can: whole blocks of ranges that
+ * line up are shared as storage_clone_inum() does, and the rest is copied
+ * from the source blocks to destination blocks allocated in one go.
+ * Returns the number of bytes copied, fewer if the source ends first,
+ * -EISDIR if either file is a directory, -EINVAL if the ranges overlap,
+ * -ENOSPC if the disk is full and -EIO if compressed contents are corrupt.
+ */
+off_t storage_copy_inum(int src_inum, off_t src_offset, int dst_inum,
+                        off_t dst_offset, off_t length);
+
+/**
+ * Allocates disk blocks for what was written to the open file `inum` and is
+ * still held in memory, as is done when it is closed.
+ * Returns 0 on success and -ENOSPC if the disk is full.
+ */
+int storage_flush(int inum);
+
+/**
+ * Makes the open file `inum` durable on the disk image: writes its modified
+ * blocks if only its contents changed, and otherwise commits every
+ * operation so far.
+ * Returns 0 on success, -ENOSPC if the disk is full and -EIO otherwise.
+ */
+int storage_fsync(int inum);
+
 /**
  * Creates a file or directory (determined by `mode`) at the given `path`.
- * Returns 0 on success and -ENOENT otherwise.
+ * Returns 0 on success, -ENOENT if the parent does not exist, -EEXIST if the
+ * name is taken and -ENOSPC if the disk is full.
  */
 int storage_mknod(const char *path, int mode);
 
@@ -62,15 +167,29 @@ int storage_unlink(const char *path);
 
 /**
  * Renames a file or directory with the name `from` to the name `to`.
- * Returns 0 on success and -1 otherwise.
+ * Returns 0 on success, -EINVAL if `to` is below `from` and a negative error
+ * code as storage_link() does otherwise.
  */
 int storage_rename(const char *from, const char *to);
 
 /**
  * Increases the reference count of the `from` entry and creates the same entry at `to`.
+ * Returns 0 on success, -ENOENT if `from` or the parent of `to` does not
+ * exist, -EEXIST if `to` exists and -ENOSPC if the disk is full.
  */
 int storage_link(const char *from, const char *to);
 
+/**
+ * Sets the permission and type bits of the entry at the given path.
+ * Returns 0 on success and -ENOENT otherwise.
+ */
+int storage_chmod(const char *path, int mode);
+
+/**
+ * Same as storage_chmod(), on the inode `inum`.
+ */
+int storage_chmod_inum(int inum, int mode);
+
 int storage_set_time(const char *path, const struct timespec ts[2]);
 
 /**
@@ -78,4 +197,56 @@ int storage_set_time(const char *path, const struct timespec ts[2]);
  */
 slist_t *storage_list(const char *path);
 
+/**
+ * Copies the entries of the directory `inum`, whose path is `path`, into a
+ * new array, which the caller must free, and caches the path of each, so
+ * that looking every entry up next, as `ls -l` does, takes no directory
+ * search.
+ * Returns the array and sets `count` to its length, or returns NULL if out
+ * of memory.
+ */
+dirent_t *storage_list_inum(int inum, const char *path, int *count);
+
+// The operations below name entries by directory inode number and name,
+// for a frontend that keeps inode numbers rather than paths. The inodes
+// they return are pinned: an inode that is unlinked while pinned is only
+// freed once storage_forget() has dropped every pin.
+
+/**
+ * Finds the entry `name` in the directory `dir_inum` and pins its inode.
+ * Returns the inode number on success and -ENOENT otherwise.
+ */
+int storage_lookup(int dir_inum, const char *name);
+
+/**
+ * Drops `count` pins of the inode `inum`, freeing it if it was unlinked.
+ */
+void storage_forget(int inum, int count);
+
+/**
+ * Same as storage_mknod(), for the entry `name` of the directory `dir_inum`.
+ * Returns the new, pinned, inode number on success.
+ */
+int storage_mknod_inum(int dir_inum, const char *name, int mode);
+
+/**
+ * Same as storage_unlink(), for the entry `name` of the directory
+ * `dir_inum`. Returns 0 on success and -ENOENT otherwise.
+ */
+int storage_unlink_inum(int dir_inum, const char *name);
+
+/**
+ * Same as storage_link(), linking the inode `inum` as the entry `name` of
+ * the directory `dir_inum`, and pins `inum` on success.
+ */
+int storage_link_inum(int inum, int dir_inum, const char *name);
+
+/**
+ * Same as storage_rename(), for the entry `from_name` of the directory
+ * `from_dir` and the entry `to_name` of the directory `to_dir`. Does not
+ * check that a directory is not moved below itself.
+ */
+int storage_rename_inum(int from_dir, const char *from_name, int to_dir,
+                        const char *to_name);
+
 #endif
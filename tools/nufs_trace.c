@@ -0,0 +1,133 @@
+// Decodes a trace written by a nufs built with tracing enabled.
+//
+// Usage: nufs_trace [-s] [file]
+//
+// Prints every event, one per line, followed by a per-operation latency
+// summary. With -s, prints the summary only. Reads "nufs.trace" by default.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../trace.h"
+
+static const char *op_names[TRACE_OP_COUNT] = {
+    [TRACE_ACCESS] = "access",
+    [TRACE_GETATTR] = "getattr",
+    [TRACE_READDIR] = "readdir",
+    [TRACE_MKNOD] = "mknod",
+    [TRACE_MKDIR] = "mkdir",
+    [TRACE_UNLINK] = "unlink",
+    [TRACE_LINK] = "link",
+    [TRACE_RMDIR] = "rmdir",
+    [TRACE_RENAME] = "rename",
+    [TRACE_CHMOD] = "chmod",
+    [TRACE_TRUNCATE] = "truncate",
+    [TRACE_OPEN] = "open",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_UTIMENS] = "utimens",
+    [TRACE_IOCTL] = "ioctl",
+    [TRACE_FSYNC] = "fsync",
+    [TRACE_LOOKUP] = "lookup",
+    [TRACE_SETATTR] = "setattr",
+    [TRACE_ALLOC_BLOCKS] = "alloc_blocks",
+    [TRACE_FREE_BLOCKS] = "free_blocks",
+    [TRACE_ALLOC_INODE] = "alloc_inode",
+    [TRACE_FREE_INODE] = "free_inode",
+};
+
+typedef struct op_summary {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t max_ns;
+} op_summary_t;
+
+static const char *op_name(uint16_t op) {
+  return op < TRACE_OP_COUNT && op_names[op] != NULL ? op_names[op] : "?";
+}
+
+int main(int argc, char *argv[]) {
+  int summary_only = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s")) != -1) {
+    if (opt != 's') {
+      fprintf(stderr, "usage: %s [-s] [file]\n", argv[0]);
+      return 2;
+    }
+    summary_only = 1;
+  }
+
+  const char *path = optind < argc ? argv[optind] : "nufs.trace";
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  trace_file_header_t header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.event_size != sizeof(trace_event_t)) {
+    fprintf(stderr, "%s: not a nufs trace\n", path);
+    return 1;
+  }
+
+  op_summary_t summary[TRACE_OP_COUNT] = {0};
+  if (!summary_only) {
+    printf("%-8s %16s %-12s %6s %12s %10s %6s %10s\n", "tid", "time_ns", "op",
+           "inum", "offset", "size", "rv", "lat_ns");
+  }
+
+  for (uint32_t t = 0; t < header.thread_count; t++) {
+    trace_thread_t thread;
+    if (fread(&thread, sizeof(thread), 1, in) != 1) {
+      fprintf(stderr, "%s: truncated\n", path);
+      return 1;
+    }
+    if (thread.dropped > 0) {
+      fprintf(stderr, "thread %u: %llu older events were overwritten\n",
+              thread.tid, (unsigned long long)thread.dropped);
+    }
+
+    for (uint32_t i = 0; i < thread.count; i++) {
+      trace_event_t ev;
+      if (fread(&ev, sizeof(ev), 1, in) != 1) {
+        fprintf(stderr, "%s: truncated\n", path);
+        return 1;
+      }
+
+      if (!summary_only) {
+        printf("%-8u %16llu %-12s %6d %12lld %10llu %6d %10llu\n", thread.tid,
+               (unsigned long long)ev.time_ns, op_name(ev.op), ev.inum,
+               (long long)ev.offset, (unsigned long long)ev.size, ev.result,
+               (unsigned long long)ev.latency_ns);
+      }
+
+      if (ev.op < TRACE_OP_COUNT) {
+        op_summary_t *s = &summary[ev.op];
+        s->count++;
+        s->errors += ev.result < 0;
+        s->total_ns += ev.latency_ns;
+        s->max_ns = ev.latency_ns > s->max_ns ? ev.latency_ns : s->max_ns;
+      }
+    }
+  }
+  fclose(in);
+
+  printf("\n%-12s %10s %8s %12s %12s\n", "op", "count", "errors", "mean_ns",
+         "max_ns");
+  for (int op = 0; op < TRACE_OP_COUNT; op++) {
+    op_summary_t *s = &summary[op];
+    if (s->count > 0) {
+      printf("%-12s %10llu %8llu %12llu %12llu\n", op_name(op),
+             (unsigned long long)s->count, (unsigned long long)s->errors,
+             (unsigned long long)(s->total_ns / s->count),
+             (unsigned long long)s->max_ns);
+    }
+  }
+
+  return 0;
+}
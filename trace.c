@@ -0,0 +1,107 @@
+// Binary event tracing: one ring buffer per thread.
+//
+// A thread creates its ring on its first event and pushes it onto a global
+// list with a compare-and-swap. Only the owning thread writes a ring; it
+// publishes each event by advancing the ring's head.
+
+#include "trace.h"
+
+#ifdef NUFS_TRACE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Events kept per thread; older ones are overwritten.
+#define TRACE_RING_EVENTS 16384
+
+typedef struct trace_ring {
+  _Atomic uint64_t head;  // events ever written
+  uint32_t tid;
+  struct trace_ring *next;
+  trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+static _Atomic(trace_ring_t *) rings = NULL;
+static __thread trace_ring_t *ring = NULL;
+
+__thread int trace_inum = -1;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static trace_ring_t *ring_new() {
+  trace_ring_t *r = calloc(1, sizeof(trace_ring_t));
+  if (r == NULL) {
+    return NULL;
+  }
+  r->tid = syscall(SYS_gettid);
+
+  r->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {
+  }
+  return r;
+}
+
+uint64_t trace_begin() {
+  trace_inum = -1;
+  return now_ns();
+}
+
+void trace_record(trace_op_t op, int inum, int64_t offset, uint64_t size,
+                  int result, uint64_t start) {
+  if (ring == NULL && (ring = ring_new()) == NULL) {
+    return;
+  }
+
+  uint64_t now = now_ns();
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  trace_event_t *ev = &ring->events[head % TRACE_RING_EVENTS];
+  ev->time_ns = start != 0 ? start : now;
+  ev->latency_ns = start != 0 ? now - start : 0;
+  ev->offset = offset;
+  ev->size = size;
+  ev->inum = inum;
+  ev->result = result;
+  ev->op = op;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int trace_dump() {
+  const char *path = getenv("NUFS_TRACE_FILE");
+  FILE *out = fopen(path != NULL ? path : "nufs.trace", "wb");
+  if (out == NULL) {
+    return -1;
+  }
+
+  trace_file_header_t header = {.event_size = sizeof(trace_event_t)};
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  for (trace_ring_t *r = atomic_load(&rings); r != NULL; r = r->next) {
+    header.thread_count++;
+  }
+  fwrite(&header, sizeof(header), 1, out);
+
+  for (trace_ring_t *r = atomic_load(&rings); r != NULL; r = r->next) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t count = head < TRACE_RING_EVENTS ? head : TRACE_RING_EVENTS;
+    trace_thread_t thread = {
+        .tid = r->tid, .count = count, .dropped = head - count};
+    fwrite(&thread, sizeof(thread), 1, out);
+
+    // Oldest first: the ring wraps at head % TRACE_RING_EVENTS.
+    for (uint64_t i = head - count; i < head; i++) {
+      fwrite(&r->events[i % TRACE_RING_EVENTS], sizeof(trace_event_t), 1, out);
+    }
+  }
+
+  return fclose(out) == 0 ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,112 @@
+// Binary event tracing.
+//
+// Built with -DNUFS_TRACE (`make TRACE=1`), every traced operation appends a
+// fixed-size event to a ring buffer owned by the calling thread, so tracing
+// takes no locks. The rings are written to a file on unmount and decoded
+// offline with tools/nufs_trace. Built without it, the TRACE_* macros
+// compile to nothing and their arguments are never evaluated.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+typedef enum trace_op {
+  // FUSE operations, traced with their latency.
+  TRACE_ACCESS,
+  TRACE_GETATTR,
+  TRACE_READDIR,
+  TRACE_MKNOD,
+  TRACE_MKDIR,
+  TRACE_UNLINK,
+  TRACE_LINK,
+  TRACE_RMDIR,
+  TRACE_RENAME,
+  TRACE_CHMOD,
+  TRACE_TRUNCATE,
+  TRACE_OPEN,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_UTIMENS,
+  TRACE_IOCTL,
+  TRACE_FSYNC,
+  TRACE_LOOKUP,
+  TRACE_SETATTR,
+  // Allocator events: the offset is the first block or the inode number,
+  // the size the number of blocks.
+  TRACE_ALLOC_BLOCKS,
+  TRACE_FREE_BLOCKS,
+  TRACE_ALLOC_INODE,
+  TRACE_FREE_INODE,
+  TRACE_OP_COUNT
+} trace_op_t;
+
+typedef struct trace_event {
+  uint64_t time_ns;     // when the operation started, CLOCK_MONOTONIC
+  uint64_t latency_ns;  // 0 for events that are not operations
+  int64_t offset;
+  uint64_t size;
+  int32_t inum;    // the inode the operation resolved last, or -1
+  int32_t result;  // the return value
+  uint16_t op;     // a trace_op_t
+  uint16_t _reserved[3];
+} trace_event_t;
+
+// A trace file starts with this header. Then, for every thread, comes a
+// trace_thread_t followed by its `count` events, oldest first.
+typedef struct trace_file_header {
+  char magic[8];  // TRACE_MAGIC
+  uint32_t event_size;
+  uint32_t thread_count;
+} trace_file_header_t;
+
+typedef struct trace_thread {
+  uint32_t tid;
+  uint32_t count;    // events that follow
+  uint64_t dropped;  // older events that were overwritten
+} trace_thread_t;
+
+#define TRACE_MAGIC "NUFSTRC1"
+
+#ifdef NUFS_TRACE
+
+extern __thread int trace_inum;
+
+/**
+ * Starts timing an operation on the calling thread.
+ * Returns the start time to pass to trace_record().
+ */
+uint64_t trace_begin();
+
+/**
+ * Appends an event to the calling thread's ring, timed from `start`, or a
+ * point event if `start` is 0.
+ */
+void trace_record(trace_op_t op, int inum, int64_t offset, uint64_t size,
+                  int result, uint64_t start);
+
+/**
+ * Writes every thread's ring to the file named by $NUFS_TRACE_FILE, or to
+ * "nufs.trace". Returns 0 on success and -1 on error.
+ */
+int trace_dump();
+
+#define TRACE_BEGIN() uint64_t trace_start_ = trace_begin()
+#define TRACE_END(op, offset, size, result) \
+  trace_record(op, trace_inum, offset, size, result, trace_start_)
+#define TRACE_EVENT(op, inum, offset, size, result) \
+  trace_record(op, inum, offset, size, result, 0)
+#define TRACE_INUM(inum) (trace_inum = (inum))
+#define TRACE_DUMP() trace_dump()
+
+#else
+
+#define TRACE_BEGIN() ((void)0)
+#define TRACE_END(...) ((void)0)
+#define TRACE_EVENT(...) ((void)0)
+#define TRACE_INUM(inum) ((void)0)
+#define TRACE_DUMP() ((void)0)
+
+#endif
+
+#endif